@@ -3,170 +3,2050 @@
 ** See Copyright Notice in luaproc.h
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE  /* cpu sets and thread affinity */
+#endif
+
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "lpsched.h"
+#include "luaproc.h"
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#define FALSE 0
+#define TRUE  !FALSE
+#define LUAPROC_SCHED_WORKERS_TABLE "workertb"
+
+/* kinds of timers */
+#define LUAPROC_SCHED_TIMER_SLEEP    0  /* end of a sleep */
+#define LUAPROC_SCHED_TIMER_CHANNEL  1  /* timeout of a wait on a channel */
+#define LUAPROC_SCHED_TIMER_FD       2  /* timeout of a wait on a fd */
+
+#if (LUA_VERSION_NUM >= 502)
+#define luaproc_resume( L, from, nargs ) lua_resume( L, from, nargs )
+#else
+#define luaproc_resume( L, from, nargs ) lua_resume( L, nargs )
+#endif
+
+/***********
+ * structs *
+ ***********/
+
+/* cell of the lock-free ready queue */
+typedef struct stmpmccell {
+  size_t seq;   /* sequence number telling whether the cell is full */
+  luaproc *lp;
+} mpmccell;
+
+/* bounded lock-free multi-producer/multi-consumer ready queue (after Dmitry
+   Vyukov's array based queue). producer and consumer positions are kept in
+   separate cache lines so enqueues and dequeues do not false share. */
+typedef struct stmpmcqueue {
+  mpmccell *cells;
+  size_t mask;
+  char pad0[ LUAPROC_SCHED_CACHE_LINE ];
+  size_t enqpos;
+  char pad1[ LUAPROC_SCHED_CACHE_LINE ];
+  size_t deqpos;
+  char pad2[ LUAPROC_SCHED_CACHE_LINE ];
+} mpmcqueue;
+
+/* event count used to park idle workers. a worker reads the epoch, checks
+   for work once more and only then sleeps while the epoch is unchanged, so
+   wake-ups posted in between are never lost. workers of the list backend
+   sleep on the condition variable, as they did before the lock-free backend
+   existed; those of the lock-free backend sleep on a futex, where available */
+typedef struct steventcount {
+  unsigned int epoch;
+  int waiters;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} eventcount;
+
+/* worker pool: a set of workers with their own ready queues. lua processes
+   assigned to a pool are only executed by the workers of that pool. */
+typedef struct stpool {
+  char name[ LUAPROC_SCHED_POOL_NAME_MAX + 1 ];
+  pthread_mutex_t mutex;  /* global ready queues access mutex */
+  /* global ready queues, one per priority (processes queued from outside
+     the pool's workers) */
+  list ready[ LUAPROC_PRIORITIES ];
+  /* lock-free ready queues, one per priority (used by the
+     LUAPROC_SCHED_BACKEND_MPMC backend) */
+  mpmcqueue mpmc[ LUAPROC_PRIORITIES ];
+  int readycount[ LUAPROC_PRIORITIES ];  /* ready processes per priority */
+  eventcount ec;          /* event count idle workers park on; its waiters
+                             are the pool's parked workers */
+  int spinning;           /* number of idle workers spinning for work */
+  int workerscount;       /* number of active workers */
+  int destroyworkers;     /* number of workers to destroy */
+  int retireworkers;      /* number of idle workers to destroy */
+  int autoscale;          /* is the number of workers scaled automatically? */
+  schedscale scale;       /* automatic scaling settings */
+  int above;              /* consecutive samples with a long ready queue */
+  int idle;               /* milliseconds workers have been idle for */
+  int affinity;           /* LUAPROC_SCHED_AFFINITY_* */
+#if defined(__linux__)
+  cpu_set_t cpus;         /* cpus of LUAPROC_SCHED_AFFINITY_SET */
+#endif
+} pool;
+
+/* worker thread */
+typedef struct stworker {
+  pthread_t thread;
+  pool *pool;             /* pool the worker belongs to */
+  pthread_mutex_t mutex;  /* local ready queue access mutex */
+  list ready[ LUAPROC_PRIORITIES ];  /* local ready queues */
+  int active;             /* is this slot used by a live worker? */
+  unsigned int seed;      /* seed for choosing victims when stealing */
+  unsigned int tick;      /* number of processes taken by this worker */
+  luaproc *runnext;       /* process woken by the running one, runs next */
+  int handoffs;           /* consecutive processes taken from 'runnext' */
+  luaproc *current;       /* process being executed (or null) */
+  unsigned int passed[ LUAPROC_PRIORITIES ];  /* times a priority was passed
+                                                 over while it had work */
+  int spin;               /* current spin budget, in rounds */
+  int spingen;            /* 'spingen' the spin budget was last reset at */
+  long spinwakes;         /* times spinning found work (a park avoided) */
+  long parks;             /* times the worker parked */
+  int pinned;             /* has the worker's cpu affinity been set? */
+  int node;               /* numa node the worker is pinned to (or -1) */
+  int helper;             /* is this the main thread helping in a wait? */
+} worker;
+
+/* pending timer: a lua process to be queued again once a deadline passes,
+   either because it slept or because its wait on a channel or file
+   descriptor timed out */
+typedef struct sttimer {
+  long long deadline;  /* monotonic time, in nanoseconds */
+  luaproc *lp;
+  int kind;            /* LUAPROC_SCHED_TIMER_* */
+  int slot;            /* file descriptor wait slot (fd timers only) */
+} timer;
+
+/* lua process waiting for a file descriptor to be ready. the epoll event of
+   a wait carries both its slot and generation, so events of ended waits
+   (whose slot may have been reused) can be told apart */
+typedef struct stfdwait {
+  luaproc *lp;
+  int fd;
+  int active;         /* is the file descriptor in the epoll set? */
+  unsigned int gen;   /* bumped whenever the slot is released */
+  int next;           /* next free slot */
+} fdwait;
+
+/********************
+ * global variables *
+ *******************/
+
+/* worker pools and workers access mutex */
+pthread_mutex_t mutex_sched = PTHREAD_MUTEX_INITIALIZER;
+
+/* active luaproc count access mutex */
+pthread_mutex_t mutex_lp_count = PTHREAD_MUTEX_INITIALIZER;
+
+/* mutex to access the counter of async messages not yet received */
+pthread_mutex_t mutex_async_msg_count = PTHREAD_MUTEX_INITIALIZER;
+
+/* no active luaproc conditional variable */
+pthread_cond_t cond_no_active_lp = PTHREAD_COND_INITIALIZER;
+
+/* conditional variable to indicate that all the async message have been received */
+pthread_cond_t cond_no_remain_async_msg = PTHREAD_COND_INITIALIZER;
+
+/* lua_State used to store workers hash table */
+static lua_State *workerls = NULL;
+
+/* worker slots; a slot is never released, so thieves can always lock it */
+static worker workers[ LUAPROC_SCHED_MAX_WORKERS ];
+
+/* thread specific key used to find the worker running the calling thread */
+static pthread_key_t key_worker;
+
+/* worker pools; pool 0 is the default pool. like worker slots, pools are
+   never released. */
+static pool pools[ LUAPROC_SCHED_MAX_POOLS ];
+
+int lpcount = 0;         /* number of active luaprocs */
+static int helping = FALSE;  /* is the main thread running processes in a wait? */
+
+int async_msg = 0;//number of async messages in transit
+
+static int workerslots = 0;   /* number of worker slots ever used */
+static int joiningworkers = FALSE;  /* are the workers being joined? */
+static int poolcount = 0;     /* number of pools created */
+
+#if defined(__linux__)
+static cpu_set_t allcpus;     /* cpus the process may run on */
+static int numcpus = 0;       /* number of cpus in 'allcpus' */
+#endif
+static int backend = LUAPROC_SCHED_BACKEND_LIST;  /* ready queue backend */
+static long preemptions = 0;  /* number of processes preempted */
+static long scaleups = 0;     /* workers added by the autoscaler */
+static long scaledowns = 0;   /* workers retired by the autoscaler */
+static int spinrounds = LUAPROC_SCHED_SPIN_ROUNDS;  /* maximum spin budget */
+static int spingen = 0;  /* bumped whenever the maximum spin budget is set */
+
+/* autoscaler thread; it is only started when a pool is first autoscaled */
+static pthread_t monitor;
+static int monitorrunning = FALSE;
+static int monitorexit = FALSE;
+static pthread_mutex_t mutex_monitor = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_monitor = PTHREAD_COND_INITIALIZER;
+
+/* pending timers, kept in a binary min-heap ordered by deadline, and the
+   thread that fires them; it is only started when a timer is first set */
+static timer *timers = NULL;
+static int timercount = 0;
+static int timercap = 0;
+static pthread_t timerthread;
+static int timerrunning = FALSE;
+static int timerexit = FALSE;
+static pthread_mutex_t mutex_timers = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_timers;  /* uses the monotonic clock */
+
+/* lua processes that offloaded a blocking call, waiting for an offload
+   thread to run it, and the offload threads; they are only started when a
+   blocking call is first offloaded */
+static list offloadls;
+static pthread_t offloadthreads[ LUAPROC_SCHED_OFFLOAD_THREADS ];
+static int offloadcount = 0;  /* number of offload threads running */
+static int offloadstarted = FALSE;
+static int offloadexit = FALSE;
+static pthread_mutex_t mutex_offload = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_offload = PTHREAD_COND_INITIALIZER;
+
+/* file descriptor waits and the i/o reactor thread serving them, which waits
+   on an epoll set; it is only started when a lua process first waits on a
+   file descriptor */
+#if defined(__linux__)
+static fdwait *fdwaits = NULL;
+static int fdwaitcap = 0;
+static int fdwaitfree = -1;  /* first free slot */
+static int epfd = -1;
+static int reactorfd = -1;   /* eventfd used to stop the reactor thread */
+static pthread_t reactorthread;
+static int reactorrunning = FALSE;
+static int reactorexit = FALSE;
+static pthread_mutex_t mutex_reactor = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*********************************
+ * idle worker parking functions *
+ *********************************/
+
+/* relax the cpu while spinning */
+static void sched_cpu_relax( void ) {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* announce the calling thread is about to wait and return the current epoch */
+static unsigned int ec_prepare_wait( eventcount *ec ) {
+  unsigned int key = __atomic_load_n( &ec->epoch, __ATOMIC_SEQ_CST );
+  __atomic_add_fetch( &ec->waiters, 1, __ATOMIC_SEQ_CST );
+  return key;
+}
+
+/* give up waiting after ec_prepare_wait (the wait condition changed) */
+static void ec_cancel_wait( eventcount *ec ) {
+  __atomic_sub_fetch( &ec->waiters, 1, __ATOMIC_SEQ_CST );
+}
+
+/* sleep until the epoch differs from the one returned by ec_prepare_wait */
+static void ec_wait( eventcount *ec, unsigned int key ) {
+#if defined(__linux__)
+  if ( backend != LUAPROC_SCHED_BACKEND_LIST ) {
+    while ( __atomic_load_n( &ec->epoch, __ATOMIC_SEQ_CST ) == key ) {
+      syscall( SYS_futex, &ec->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL,
+               0 );
+    }
+    __atomic_sub_fetch( &ec->waiters, 1, __ATOMIC_SEQ_CST );
+    return;
+  }
+#endif
+  pthread_mutex_lock( &ec->mutex );
+  while ( __atomic_load_n( &ec->epoch, __ATOMIC_SEQ_CST ) == key ) {
+    pthread_cond_wait( &ec->cond, &ec->mutex );
+  }
+  pthread_mutex_unlock( &ec->mutex );
+  __atomic_sub_fetch( &ec->waiters, 1, __ATOMIC_SEQ_CST );
+}
+
+/* wake up to n waiting threads, if there is any */
+static void ec_notify( eventcount *ec, int n ) {
+
+  int waiters = __atomic_load_n( &ec->waiters, __ATOMIC_SEQ_CST );
+
+  if ( waiters == 0 ) {
+    return;
+  }
+  if ( n > waiters ) {
+    n = waiters;
+  }
+#if defined(__linux__)
+  if ( backend != LUAPROC_SCHED_BACKEND_LIST ) {
+    __atomic_add_fetch( &ec->epoch, 1, __ATOMIC_SEQ_CST );
+    syscall( SYS_futex, &ec->epoch, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+    return;
+  }
+#endif
+  pthread_mutex_lock( &ec->mutex );
+  __atomic_add_fetch( &ec->epoch, 1, __ATOMIC_SEQ_CST );
+  if ( n < waiters ) {
+    while ( n-- > 0 ) {
+      pthread_cond_signal( &ec->cond );
+    }
+  } else {
+    pthread_cond_broadcast( &ec->cond );
+  }
+  pthread_mutex_unlock( &ec->mutex );
+}
+
+/*****************************
+ * lock-free queue functions *
+ *****************************/
+
+/* initialize a lock-free queue with (a power of two) number of cells */
+static int mpmc_init( mpmcqueue *q, size_t size ) {
+
+  size_t i;
+
+  q->cells = (mpmccell *)malloc( size * sizeof( mpmccell ));
+  if ( q->cells == NULL ) {
+    return FALSE;
+  }
+  for ( i = 0; i < size; i++ ) {
+    q->cells[ i ].seq = i;
+    q->cells[ i ].lp = NULL;
+  }
+  q->mask = size - 1;
+  q->enqpos = 0;
+  q->deqpos = 0;
+
+  return TRUE;
+}
+
+/* insert a lua process in a lock-free queue; return false if it is full */
+static int mpmc_push( mpmcqueue *q, luaproc *lp ) {
+
+  mpmccell *cell;
+  size_t seq;
+  size_t pos = __atomic_load_n( &q->enqpos, __ATOMIC_RELAXED );
+  long dif;
+
+  while ( TRUE ) {
+    cell = &q->cells[ pos & q->mask ];
+    seq = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+    dif = (long)seq - (long)pos;
+    if ( dif == 0 ) {
+      if ( __atomic_compare_exchange_n( &q->enqpos, &pos, pos + 1, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+        break;
+      }
+    } else if ( dif < 0 ) {
+      return FALSE;  /* queue is full */
+    } else {
+      pos = __atomic_load_n( &q->enqpos, __ATOMIC_RELAXED );
+    }
+  }
+  cell->lp = lp;
+  __atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+
+  return TRUE;
+}
+
+/* remove and return the first lua process in a lock-free queue (if the
+   queue is empty, return null) */
+static luaproc *mpmc_pop( mpmcqueue *q ) {
+
+  mpmccell *cell;
+  luaproc *lp;
+  size_t seq;
+  size_t pos = __atomic_load_n( &q->deqpos, __ATOMIC_RELAXED );
+  long dif;
+
+  while ( TRUE ) {
+    cell = &q->cells[ pos & q->mask ];
+    seq = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+    dif = (long)seq - (long)( pos + 1 );
+    if ( dif == 0 ) {
+      if ( __atomic_compare_exchange_n( &q->deqpos, &pos, pos + 1, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+        break;
+      }
+    } else if ( dif < 0 ) {
+      return NULL;  /* queue is empty */
+    } else {
+      pos = __atomic_load_n( &q->deqpos, __ATOMIC_RELAXED );
+    }
+  }
+  lp = cell->lp;
+  __atomic_store_n( &cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE );
+
+  return lp;
+}
+
+/*************************
+ * ready queue functions *
+ *************************/
+
+/* return the pool a lua process is assigned to */
+static pool *sched_proc_pool( luaproc *lp ) {
+  return &pools[ luaproc_get_pool( lp ) ];
+}
+
+/* return the number of ready processes of all priorities in a pool */
+static int sched_ready_total( pool *p ) {
+
+  int prio, n = 0;
+
+  for ( prio = 0; prio < LUAPROC_PRIORITIES; prio++ ) {
+    n += __atomic_load_n( &p->readycount[ prio ], __ATOMIC_SEQ_CST );
+  }
+
+  return n;
+}
+
+/* wake idle workers of a pool up for n new ready processes. workers that
+   are spinning will find some of them by themselves, so only the remaining
+   ones wake parked workers up (no more than there are parked workers). a
+   spinning worker may be about to take other work, or to park, though, so at
+   least one parked worker is always woken up. */
+static void sched_wakeup_workers( pool *p, int n ) {
+  if ( n <= 0 ) {
+    return;
+  }
+  n -= __atomic_load_n( &p->spinning, __ATOMIC_SEQ_CST );
+  ec_notify( &p->ec, ( n > 1 ) ? n : 1 );
+}
+
+/* insert lua process in the ready queue of the calling worker or, if the
+   caller is not a worker of the process' pool, in the pool's global ready
+   queue. with the lock-free backend, all processes go to the pool's shared
+   lock-free queue instead. once it fills up, processes spill over into the
+   global queue, and keep going there until the global queue is drained, so
+   they are still taken in the order they were queued (the lock-free queue
+   is emptied first). */
+static void sched_ready_insert( luaproc *lp ) {
+
+  worker *self = (worker *)pthread_getspecific( key_worker );
+  pool *p = sched_proc_pool( lp );
+  int prio = luaproc_get_priority( lp );
+
+  if (( backend == LUAPROC_SCHED_BACKEND_MPMC ) &&
+      ( __atomic_load_n( &p->ready[ prio ].nodes, __ATOMIC_ACQUIRE ) == 0 ) &&
+      ( mpmc_push( &p->mpmc[ prio ], lp ))) {
+    /* nothing else to do */
+  } else if (( self != NULL ) && ( self->pool == p ) &&
+             ( backend == LUAPROC_SCHED_BACKEND_LIST )) {
+    pthread_mutex_lock( &self->mutex );
+    list_insert( &self->ready[ prio ], lp );
+    pthread_mutex_unlock( &self->mutex );
+  } else {
+    pthread_mutex_lock( &p->mutex );
+    list_insert( &p->ready[ prio ], lp );
+    pthread_mutex_unlock( &p->mutex );
+  }
+}
+
+/* insert lua process in a ready queue, count it and wake a worker up */
+static void sched_ready_push( luaproc *lp ) {
+
+  pool *p = sched_proc_pool( lp );
+
+  sched_ready_insert( lp );
+  __atomic_add_fetch( &p->readycount[ luaproc_get_priority( lp ) ], 1,
+                      __ATOMIC_SEQ_CST );
+  sched_wakeup_workers( p, 1 );
+}
+
+/* make a lua process the next one to be executed by the calling worker and
+   return the process it displaced from that slot (or null). caller must be
+   a worker executing a lua process. */
+static luaproc *sched_runnext_swap( worker *self, luaproc *lp ) {
+
+  luaproc *old;
+
+  pthread_mutex_lock( &self->mutex );
+  old = self->runnext;
+  self->runnext = lp;
+  pthread_mutex_unlock( &self->mutex );
+
+  return old;
+}
+
+/* remove and return the process in a worker's 'runnext' slot (or null) */
+static luaproc *sched_runnext_remove( worker *w ) {
+
+  luaproc *lp;
+
+  if ( __atomic_load_n( &w->runnext, __ATOMIC_RELAXED ) == NULL ) {
+    return NULL;
+  }
+  pthread_mutex_lock( &w->mutex );
+  lp = w->runnext;
+  w->runnext = NULL;
+  pthread_mutex_unlock( &w->mutex );
+
+  return lp;
+}
+
+/* remove lua process from a pool's global ready queue of a given priority */
+static luaproc *sched_global_remove( pool *p, int prio ) {
+
+  luaproc *lp;
+
+  if ( __atomic_load_n( &p->ready[ prio ].nodes, __ATOMIC_RELAXED ) == 0 ) {
+    return NULL;
+  }
+  pthread_mutex_lock( &p->mutex );
+  lp = list_remove( &p->ready[ prio ] );
+  pthread_mutex_unlock( &p->mutex );
+
+  return lp;
+}
+
+/* remove a batch of lua processes of a given priority from the global ready
+   queue of a worker's pool in a single critical section. the first one is
+   returned and the others go to the worker's local queue, where other
+   workers can steal them if they go idle. a worker takes no more than its
+   fair share of the global queue, so the others get some too. */
+static luaproc *sched_global_batch( worker *self, int prio ) {
+
+  int i, n;
+  list batch;
+  luaproc *lp;
+  pool *pl = self->pool;
+
+  if ( __atomic_load_n( &pl->ready[ prio ].nodes, __ATOMIC_RELAXED ) == 0 ) {
+    return NULL;
+  }
+  list_init( &batch );
+  pthread_mutex_lock( &pl->mutex );
+  n = list_count( &pl->ready[ prio ] ) /
+      ( __atomic_load_n( &pl->workerscount, __ATOMIC_RELAXED ) + 1 ) + 1;
+  if ( n > LUAPROC_SCHED_BATCH ) {
+    n = LUAPROC_SCHED_BATCH;
+  }
+  lp = list_remove( &pl->ready[ prio ] );
+  for ( i = 1; i < n && list_count( &pl->ready[ prio ] ) > 0; i++ ) {
+    list_insert( &batch, list_remove( &pl->ready[ prio ] ));
+  }
+  pthread_mutex_unlock( &pl->mutex );
+
+  if ( list_count( &batch ) > 0 ) {
+    pthread_mutex_lock( &self->mutex );
+    list_join( &self->ready[ prio ], &batch );
+    pthread_mutex_unlock( &self->mutex );
+  }
+
+  return lp;
+}
+
+/* remove lua process from a worker's local ready queue of a given priority */
+static luaproc *sched_local_remove( worker *w, int prio ) {
+
+  luaproc *lp;
+
+  if ( __atomic_load_n( &w->ready[ prio ].nodes, __ATOMIC_RELAXED ) == 0 ) {
+    return NULL;
+  }
+  pthread_mutex_lock( &w->mutex );
+  lp = list_remove( &w->ready[ prio ] );
+  pthread_mutex_unlock( &w->mutex );
+
+  return lp;
+}
+
+/* steal the process in a worker's 'runnext' slot. the victim usually takes it
+   as soon as the running process yields, so it is only stolen if the victim
+   is still running that same process after a grace period. */
+static luaproc *sched_steal_runnext( worker *self, worker *victim,
+                                     int prio ) {
+
+  int i;
+  unsigned int tick;
+  luaproc *lp;
+
+  lp = __atomic_load_n( &victim->runnext, __ATOMIC_RELAXED );
+  if (( lp == NULL ) || ( luaproc_get_priority( lp ) != prio )) {
+    return NULL;
+  }
+  tick = __atomic_load_n( &victim->tick, __ATOMIC_RELAXED );
+  for ( i = 0; i < LUAPROC_SCHED_RUNNEXT_GRACE; i++ ) {
+    sched_cpu_relax();
+  }
+
+  lp = NULL;
+  pthread_mutex_lock( &victim->mutex );
+  if (( victim->pool == self->pool ) &&
+      ( __atomic_load_n( &victim->tick, __ATOMIC_RELAXED ) == tick ) &&
+      ( victim->runnext != NULL ) &&
+      ( luaproc_get_priority( victim->runnext ) == prio )) {
+    lp = victim->runnext;
+    victim->runnext = NULL;
+  }
+  pthread_mutex_unlock( &victim->mutex );
+
+  return lp;
+}
+
+/* steal half of the ready processes of a given priority from another
+   (randomly chosen) worker of the same pool; return the first stolen process
+   and keep the others in the local queue */
+static luaproc *sched_steal( worker *self, int prio ) {
+
+  int i, n, start;
+  list stolen;
+  worker *victim;
+  luaproc *lp = NULL, *extra;
+
+  n = __atomic_load_n( &workerslots, __ATOMIC_ACQUIRE );
+  if ( n <= 1 ) {
+    return NULL;
+  }
+  start = rand_r( &self->seed ) % n;
+
+  for ( i = 0; i < n && lp == NULL; i++ ) {
+    victim = &workers[ ( start + i ) % n ];
+    if (( victim == self ) ||
+        ( __atomic_load_n( &victim->pool, __ATOMIC_RELAXED ) != self->pool )) {
+      continue;
+    }
+    if ( __atomic_load_n( &victim->ready[ prio ].nodes,
+                          __ATOMIC_RELAXED ) == 0 ) {
+      lp = sched_steal_runnext( self, victim, prio );
+      continue;
+    }
+    list_init( &stolen );
+    pthread_mutex_lock( &victim->mutex );
+    if ( victim->pool != self->pool ) {  /* slot was reused meanwhile */
+      pthread_mutex_unlock( &victim->mutex );
+      continue;
+    }
+    lp = list_remove( &victim->ready[ prio ] );
+    while ( list_count( &stolen ) < list_count( &victim->ready[ prio ] )) {
+      extra = list_remove( &victim->ready[ prio ] );
+      list_insert( &stolen, extra );
+    }
+    pthread_mutex_unlock( &victim->mutex );
+
+    if ( list_count( &stolen ) > 0 ) {
+      pthread_mutex_lock( &self->mutex );
+      list_join( &self->ready[ prio ], &stolen );
+      pthread_mutex_unlock( &self->mutex );
+    }
+  }
+
+  return lp;
+}
+
+/* take a lua process of a given priority handed off to another worker of
+   the same pool, which did not get around to running it. with the lock-free
+   backend, these are the only ready processes outside the shared queues. */
+static luaproc *sched_steal_any_runnext( worker *self, int prio ) {
+
+  int i, n, start;
+  worker *victim;
+  luaproc *lp = NULL;
+
+  n = __atomic_load_n( &workerslots, __ATOMIC_ACQUIRE );
+  if ( n <= 1 ) {
+    return NULL;
+  }
+  start = rand_r( &self->seed ) % n;
+
+  for ( i = 0; i < n && lp == NULL; i++ ) {
+    victim = &workers[ ( start + i ) % n ];
+    if (( victim != self ) &&
+        ( __atomic_load_n( &victim->pool, __ATOMIC_RELAXED ) == self->pool )) {
+      lp = sched_steal_runnext( self, victim, prio );
+    }
+  }
+
+  return lp;
+}
+
+/* remove a lua process of a given priority from the ready queues. the local
+   queue is preferred, but the global queue is checked first every once in a
+   while so it does not starve. */
+static luaproc *sched_next_prio( worker *self, int prio ) {
+
+  luaproc *lp = NULL;
+
+  if ( backend == LUAPROC_SCHED_BACKEND_MPMC ) {
+    lp = mpmc_pop( &self->pool->mpmc[ prio ] );
+    if ( lp == NULL ) {
+      lp = sched_global_remove( self->pool, prio );
+    }
+    if ( lp == NULL ) {
+      lp = sched_steal_any_runnext( self, prio );
+    }
+  } else {
+    if (( self->tick % LUAPROC_SCHED_GLOBAL_CHECK ) == 0 ) {
+      lp = sched_global_remove( self->pool, prio );
+    }
+    if ( lp == NULL ) {
+      lp = sched_local_remove( self, prio );
+    }
+    if ( lp == NULL ) {
+      lp = sched_global_batch( self, prio );
+    }
+    if ( lp == NULL ) {
+      lp = sched_steal( self, prio );
+    }
+  }
+
+  return lp;
+}
+
+/* return the highest priority with ready processes, or the lowest priority
+   that has been passed over too many times by this worker (aging) */
+static int sched_first_prio( worker *self ) {
+
+  int p;
+  int *readycount = self->pool->readycount;
+
+  for ( p = LUAPROC_PRIORITIES - 1; p > 0; p-- ) {
+    if (( self->passed[ p ] >= LUAPROC_SCHED_AGING_LIMIT ) &&
+        ( __atomic_load_n( &readycount[ p ], __ATOMIC_SEQ_CST ) > 0 )) {
+      return p;
+    }
+  }
+  for ( p = 0; p < LUAPROC_PRIORITIES - 1; p++ ) {
+    if ( __atomic_load_n( &readycount[ p ], __ATOMIC_SEQ_CST ) > 0 ) {
+      return p;
+    }
+  }
+
+  return p;
+}
+
+/* account for a lua process of a given priority being taken: lower priorities
+   with ready processes were passed over once more */
+static void sched_taken( worker *self, int prio ) {
+
+  int p;
+  int *readycount = self->pool->readycount;
+
+  __atomic_sub_fetch( &readycount[ prio ], 1, __ATOMIC_SEQ_CST );
+  self->passed[ prio ] = 0;
+  for ( p = prio + 1; p < LUAPROC_PRIORITIES; p++ ) {
+    if ( __atomic_load_n( &readycount[ p ], __ATOMIC_RELAXED ) > 0 ) {
+      self->passed[ p ]++;
+    }
+  }
+}
+
+/* return the next lua process to be executed by a worker (if none, return
+   null). higher priorities are always served first, except that a priority
+   passed over LUAPROC_SCHED_AGING_LIMIT times gets the next turn. */
+static luaproc *sched_next( worker *self ) {
+
+  int p, first;
+  int *readycount = self->pool->readycount;
+  luaproc *lp = NULL;
+
+  __atomic_add_fetch( &self->tick, 1, __ATOMIC_RELAXED );
+  first = sched_first_prio( self );
+
+  /* a process woken by the last one executed goes first, unless there is
+     more urgent work; then it goes back to the ready queue */
+  lp = sched_runnext_remove( self );
+  if ( lp != NULL ) {
+    if ( luaproc_get_priority( lp ) <= first ) {
+      self->handoffs++;
+      sched_taken( self, luaproc_get_priority( lp ));
+      return lp;
+    }
+    sched_ready_insert( lp );
+    sched_wakeup_workers( self->pool, 1 );
+    lp = NULL;
+  }
+  self->handoffs = 0;
+
+  if ( __atomic_load_n( &readycount[ first ], __ATOMIC_SEQ_CST ) > 0 ) {
+    lp = sched_next_prio( self, first );
+  }
+  for ( p = 0; ( lp == NULL ) && ( p < LUAPROC_PRIORITIES ); p++ ) {
+    if (( p != first ) &&
+        ( __atomic_load_n( &readycount[ p ], __ATOMIC_SEQ_CST ) > 0 )) {
+      lp = sched_next_prio( self, p );
+    }
+  }
+  if ( lp != NULL ) {
+    sched_taken( self, luaproc_get_priority( lp ));
+  }
+
+  return lp;
+}
+
+/* free a worker slot, handing its ready processes over to its pool's global
+   queues. caller must lock 'mutex_sched' before calling this function. */
+static void sched_worker_release( worker *self ) {
+
+  int p, n = 0;
+  pool *pl = self->pool;
+
+  /* move remaining local processes to the global ready queues */
+  pthread_mutex_lock( &self->mutex );
+  pthread_mutex_lock( &pl->mutex );
+  if ( self->runnext != NULL ) {
+    list_insert( &pl->ready[ luaproc_get_priority( self->runnext ) ],
+                 self->runnext );
+    self->runnext = NULL;
+    n++;
+  }
+  for ( p = 0; p < LUAPROC_PRIORITIES; p++ ) {
+    if ( list_count( &self->ready[ p ] ) > 0 ) {
+      n += list_count( &self->ready[ p ] );
+      list_join( &pl->ready[ p ], &self->ready[ p ] );
+      list_init( &self->ready[ p ] );
+    }
+  }
+  pthread_mutex_unlock( &pl->mutex );
+  self->active = FALSE;
+  pthread_mutex_unlock( &self->mutex );
+
+  sched_wakeup_workers( pl, n );  /* wake other workers up */
+}
+
+/* destroy the calling worker. caller must lock 'mutex_sched' before calling
+   this function. */
+static void sched_worker_exit( worker *self ) {
+
+  pool *pl = self->pool;
+
+  pl->workerscount--; /* decrease active workers count */
+
+  /* remove worker from workers table */
+  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  lua_pushlightuserdata( workerls, (void *)pthread_self( ));
+  lua_pushnil( workerls );
+  lua_rawset( workerls, -3 );
+  lua_pop( workerls, 1 );
+
+  /* a worker leaving before the workers are joined (retired by the
+     autoscaler, or dropped by setnumworkers) is no longer in the workers
+     table, so no one will join it */
+  if ( !joiningworkers ) {
+    pthread_detach( pthread_self( ));
+  }
+
+  sched_worker_release( self );
+  pthread_mutex_unlock( &mutex_sched );
+  pthread_exit( NULL );  /* destroy itself */
+}
+
+/* check whether there is work to do or workers must be destroyed in a
+   worker's pool. the main thread helping in a wait is never destroyed, but
+   must stop once there are no more active lua processes. */
+static int sched_worker_has_work( worker *self ) {
+  if ( self->helper ) {
+    return (( sched_ready_total( self->pool ) > 0 ) ||
+            ( __atomic_load_n( &lpcount, __ATOMIC_SEQ_CST ) == 0 ));
+  }
+  return (( sched_ready_total( self->pool ) > 0 ) ||
+          ( __atomic_load_n( &self->pool->destroyworkers,
+                             __ATOMIC_SEQ_CST ) > 0 ) ||
+          ( __atomic_load_n( &self->pool->retireworkers,
+                             __ATOMIC_SEQ_CST ) > 0 ));
+}
+
+/* put a worker to sleep until the pool's eventcount is notified, unless
+   work shows up while it is getting ready to sleep */
+static void sched_worker_sleep( worker *self ) {
+
+  unsigned int key;
+  pool *p = self->pool;
+
+  __atomic_add_fetch( &self->parks, 1, __ATOMIC_RELAXED );
+  key = ec_prepare_wait( &p->ec );
+  if ( sched_worker_has_work( self )) {
+    ec_cancel_wait( &p->ec );
+    return;
+  }
+  ec_wait( &p->ec, key );
+}
+
+/* wait until there is work to do or workers must be destroyed. the ready
+   queues are polled for a while before the worker is actually parked, since
+   work usually shows up again shortly. polls back off exponentially, and the
+   spin budget adapts: it doubles (up to the configured maximum) when spinning
+   finds work and halves when the worker has to park anyway. once a new
+   maximum is set, workers still spinning stop, and budgets start over from
+   it, since a budget that has shrunk to the minimum hardly ever finds work
+   and would never grow back. */
+static void sched_worker_park( worker *self ) {
+
+  int i, j, backoff = 1;
+  int gen = __atomic_load_n( &spingen, __ATOMIC_ACQUIRE );
+  int maxspin = __atomic_load_n( &spinrounds, __ATOMIC_RELAXED );
+  int minspin = ( maxspin < LUAPROC_SCHED_SPIN_MIN ) ?
+                maxspin : LUAPROC_SCHED_SPIN_MIN;
+  pool *p = self->pool;
+
+  if (( self->spin > maxspin ) || ( self->spingen != gen )) {
+    self->spin = maxspin;
+    self->spingen = gen;
+  }
+  __atomic_add_fetch( &p->spinning, 1, __ATOMIC_SEQ_CST );
+  for ( i = 0; ( i < self->spin ) &&
+              ( __atomic_load_n( &spingen, __ATOMIC_ACQUIRE ) == gen ); i++ ) {
+    if ( sched_worker_has_work( self )) {
+      __atomic_sub_fetch( &p->spinning, 1, __ATOMIC_SEQ_CST );
+      __atomic_add_fetch( &self->spinwakes, 1, __ATOMIC_RELAXED );
+      self->spin = ( self->spin * 2 < maxspin ) ? self->spin * 2 : maxspin;
+      return;
+    }
+    for ( j = 0; j < backoff; j++ ) {
+      sched_cpu_relax();
+    }
+    if ( backoff < LUAPROC_SCHED_SPIN_BACKOFF_MAX ) {
+      backoff *= 2;
+    }
+  }
+  __atomic_sub_fetch( &p->spinning, 1, __ATOMIC_SEQ_CST );
+  self->spin = ( self->spin / 2 > minspin ) ? self->spin / 2 : minspin;
+  sched_worker_sleep( self );
+}
+
+/************************
+ * preemption functions *
+ ************************/
+
+#if (LUA_VERSION_NUM >= 503)
+/* count hook that preempts a lua process at the end of its time slice. the
+   process is not preempted while it cannot yield (for instance, when it is
+   running Lua code called from a C function). */
+static void sched_preempt_hook( lua_State *L, lua_Debug *ar ) {
+
+  worker *self = (worker *)pthread_getspecific( key_worker );
+
+  if (( self == NULL ) || ( self->current == NULL ) ||
+      ( luaproc_get_state( self->current ) != L ) || ( !lua_isyieldable( L ))) {
+    return;
+  }
+  luaproc_set_status( self->current, LUAPROC_STATUS_PREEMPTED );
+  lua_yield( L, 0 );
+}
+#endif
+
+/* (re)start the time slice of a lua process that is about to be resumed */
+static void sched_set_timeslice( luaproc *lp ) {
+#if (LUA_VERSION_NUM >= 503)
+  lua_State *L = luaproc_get_state( lp );
+  int quantum = luaproc_get_quantum( lp );
+
+  if ( quantum > 0 ) {
+    /* setting the hook again also resets its instruction count */
+    lua_sethook( L, sched_preempt_hook, LUA_MASKCOUNT, quantum );
+  } else if ( lua_gethook( L ) == sched_preempt_hook ) {
+    /* recycled lua state created with a time slice */
+    lua_sethook( L, NULL, 0, 0 );
+  }
+#else
+  (void)lp;
+#endif
+}
+
+/*******************
+ * timer functions *
+ *******************/
+
+/* return the current monotonic time, in nanoseconds */
+static long long sched_now( void ) {
+
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* place a timer at a slot of the heap, keeping track of the slot in its lua
+   process */
+static void sched_timer_set( int i, timer t ) {
+  timers[ i ] = t;
+  luaproc_set_timer( t.lp, i );
+}
+
+/* move a timer from a slot of the heap towards the root until it is in
+   order. caller must lock 'mutex_timers' */
+static void sched_timer_up( int i, timer t ) {
+
+  int parent;
+
+  while ( i > 0 ) {
+    parent = ( i - 1 ) / 2;
+    if ( timers[ parent ].deadline <= t.deadline ) {
+      break;
+    }
+    sched_timer_set( i, timers[ parent ] );
+    i = parent;
+  }
+  sched_timer_set( i, t );
+}
+
+/* move a timer from a slot of the heap towards the leaves until it is in
+   order. caller must lock 'mutex_timers' */
+static void sched_timer_down( int i, timer t ) {
+
+  int child;
+
+  while (( child = 2 * i + 1 ) < timercount ) {
+    if (( child + 1 < timercount ) &&
+        ( timers[ child + 1 ].deadline < timers[ child ].deadline )) {
+      child++;
+    }
+    if ( t.deadline <= timers[ child ].deadline ) {
+      break;
+    }
+    sched_timer_set( i, timers[ child ] );
+    i = child;
+  }
+  sched_timer_set( i, t );
+}
+
+/* remove the timer at a slot of the heap. caller must lock 'mutex_timers'
+   and make sure the slot is in use. */
+static void sched_timer_remove( int i ) {
+
+  timer last = timers[ --timercount ];
+
+  luaproc_set_timer( timers[ i ].lp, -1 );
+  if ( i == timercount ) {
+    return;
+  }
+  if (( i > 0 ) && ( last.deadline < timers[ ( i - 1 ) / 2 ].deadline )) {
+    sched_timer_up( i, last );
+  } else {
+    sched_timer_down( i, last );
+  }
+}
+
+static int sched_reactor_expire( int slot );
+
+/* timer thread main function: queue lua processes whose deadlines have
+   passed, all at once. a timed out wait is ended while the timer is still in
+   the heap, so that a lua process matching the waiting one at the same time
+   finds it either still waiting (and cancels the timer) or gone */
+static void *sched_timer_main( void *args ) {
+
+  list expired;
+  long long now;
+  struct timespec ts;
+  int ret, kind;
+  channel *busy;
+
+  (void)args;
+  pthread_mutex_lock( &mutex_timers );
+  while ( !timerexit ) {
+    if ( timercount == 0 ) {
+      pthread_cond_wait( &cond_timers, &mutex_timers );
+      continue;
+    }
+    now = sched_now();
+    if ( timers[ 0 ].deadline > now ) {
+      ts.tv_sec = (time_t)( timers[ 0 ].deadline / 1000000000LL );
+      ts.tv_nsec = (long)( timers[ 0 ].deadline % 1000000000LL );
+      pthread_cond_timedwait( &cond_timers, &mutex_timers, &ts );
+      continue;
+    }
+    list_init( &expired );
+    ret = TRUE;
+    while (( timercount > 0 ) && ( timers[ 0 ].deadline <= now )) {
+      kind = timers[ 0 ].kind;
+      if ( kind == LUAPROC_SCHED_TIMER_CHANNEL ) {
+        ret = luaproc_expire_wait( timers[ 0 ].lp, &busy );
+      } else if ( kind == LUAPROC_SCHED_TIMER_FD ) {
+        ret = sched_reactor_expire( timers[ 0 ].slot );
+      }
+      /* the channel or reactor is in use: try again once it is released */
+      if ( ret < 0 ) {
+        break;
+      }
+      if ( ret ) {
+        luaproc_set_status( timers[ 0 ].lp, LUAPROC_STATUS_READY );
+        list_insert( &expired, timers[ 0 ].lp );
+      }
+      sched_timer_remove( 0 );
+      ret = TRUE;
+    }
+    pthread_mutex_unlock( &mutex_timers );
+    sched_queue_list_proc( &expired );
+    /* block on the lock that was in use, without holding 'mutex_timers'
+       (its holder may be waiting for it) */
+    if (( ret < 0 ) && ( kind == LUAPROC_SCHED_TIMER_CHANNEL )) {
+      luaproc_wait_channel( busy );
+    }
+#if defined(__linux__)
+    else if ( ret < 0 ) {
+      pthread_mutex_lock( &mutex_reactor );
+      pthread_mutex_unlock( &mutex_reactor );
+    }
+#endif
+    pthread_mutex_lock( &mutex_timers );
+  }
+  pthread_mutex_unlock( &mutex_timers );
+
+  return NULL;
+}
+
+/* set a timer for a lua process, firing once a deadline (in monotonic
+   nanoseconds) passes. returns 0 if successful or -1 otherwise */
+static int sched_timer_add( luaproc *lp, long long deadline, int kind,
+                            int slot ) {
+
+  int cap;
+  timer t;
+  timer *heap;
+  pthread_condattr_t attr;
+
+  pthread_mutex_lock( &mutex_timers );
+  if ( !timerrunning ) {
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &cond_timers, &attr );
+    pthread_condattr_destroy( &attr );
+    if ( pthread_create( &timerthread, NULL, sched_timer_main, NULL ) != 0 ) {
+      pthread_mutex_unlock( &mutex_timers );
+      return -1;
+    }
+    timerrunning = TRUE;
+  }
+  if ( timercount == timercap ) {
+    cap = ( timercap == 0 ) ? LUAPROC_SCHED_TIMERS_INITIAL : 2 * timercap;
+    heap = (timer *)realloc( timers, cap * sizeof( timer ));
+    if ( heap == NULL ) {
+      pthread_mutex_unlock( &mutex_timers );
+      return -1;
+    }
+    timers = heap;
+    timercap = cap;
+  }
+  t.deadline = deadline;
+  t.lp = lp;
+  t.kind = kind;
+  t.slot = slot;
+  sched_timer_up( timercount++, t );
+  /* wake the timer thread up if this is the new earliest deadline */
+  if ( timers[ 0 ].lp == lp ) {
+    pthread_cond_signal( &cond_timers );
+  }
+  pthread_mutex_unlock( &mutex_timers );
+
+  return 0;
+}
+
+/************************
+ * i/o reactor functions *
+ ************************/
+
+/* make a lua process waiting on a file descriptor return nil and an error
+   message */
+static void sched_fdwait_fail( luaproc *lp, const char *msg ) {
+  lua_pushnil( luaproc_get_state( lp ));
+  lua_pushstring( luaproc_get_state( lp ), msg );
+  luaproc_set_numargs( lp, 2 );
+  sched_queue_proc( lp );
+}
+
+#if defined(__linux__)
+
+/* event data of the reactor's stop eventfd (never a valid wait) */
+#define LUAPROC_SCHED_REACTOR_STOP  (~(uint64_t)0)
+
+/* take a free file descriptor wait slot (-1 if there is no memory). caller
+   must lock 'mutex_reactor' */
+static int sched_fdwait_get( void ) {
+
+  int i, cap;
+  fdwait *w;
+
+  if ( fdwaitfree < 0 ) {
+    cap = ( fdwaitcap == 0 ) ? LUAPROC_SCHED_FDWAITS_INITIAL : 2 * fdwaitcap;
+    w = (fdwait *)realloc( fdwaits, cap * sizeof( fdwait ));
+    if ( w == NULL ) {
+      return -1;
+    }
+    for ( i = fdwaitcap; i < cap; i++ ) {
+      w[ i ].active = FALSE;
+      w[ i ].gen = 0;
+      w[ i ].next = ( i + 1 < cap ) ? i + 1 : -1;
+    }
+    fdwaits = w;
+    fdwaitfree = fdwaitcap;
+    fdwaitcap = cap;
+  }
+  i = fdwaitfree;
+  fdwaitfree = fdwaits[ i ].next;
+  return i;
+}
+
+/* release a file descriptor wait slot, taking its file descriptor out of the
+   epoll set if it is there. caller must lock 'mutex_reactor' */
+static void sched_fdwait_put( int i ) {
+
+  struct epoll_event ev;
+
+  if ( fdwaits[ i ].active ) {
+    epoll_ctl( epfd, EPOLL_CTL_DEL, fdwaits[ i ].fd, &ev );
+    fdwaits[ i ].active = FALSE;
+  }
+  fdwaits[ i ].gen++;
+  fdwaits[ i ].next = fdwaitfree;
+  fdwaitfree = i;
+}
+
+/* reactor thread main function: queue lua processes whose file descriptors
+   are ready, all at once */
+static void *sched_reactor_main( void *args ) {
+
+  struct epoll_event events[ LUAPROC_SCHED_REACTOR_EVENTS ];
+  list ready;
+  fdwait *w;
+  int i, n, slot;
+
+  (void)args;
+  for (;;) {
+    n = epoll_wait( epfd, events, LUAPROC_SCHED_REACTOR_EVENTS, -1 );
+    if (( n < 0 ) && ( errno != EINTR )) {
+      break;
+    }
+    list_init( &ready );
+    pthread_mutex_lock( &mutex_reactor );
+    if ( reactorexit ) {
+      pthread_mutex_unlock( &mutex_reactor );
+      break;
+    }
+    for ( i = 0; i < n; i++ ) {
+      if ( events[ i ].data.u64 == LUAPROC_SCHED_REACTOR_STOP ) {
+        continue;
+      }
+      slot = (int)( events[ i ].data.u64 & 0xffffffffu );
+      w = &fdwaits[ slot ];
+      /* skip waits that timed out after the event was reported */
+      if (( !w->active ) ||
+          ( w->gen != (unsigned int)( events[ i ].data.u64 >> 32 ))) {
+        continue;
+      }
+      sched_cancel_timeout( w->lp );
+      lua_pushboolean( luaproc_get_state( w->lp ), TRUE );
+      luaproc_set_numargs( w->lp, 1 );
+      luaproc_set_status( w->lp, LUAPROC_STATUS_READY );
+      list_insert( &ready, w->lp );
+      sched_fdwait_put( slot );
+    }
+    pthread_mutex_unlock( &mutex_reactor );
+    sched_queue_list_proc( &ready );
+  }
+
+  return NULL;
+}
+
+/* start the reactor thread, if it is not running yet. caller must lock
+   'mutex_reactor'. returns 0 if successful or -1 otherwise */
+static int sched_reactor_start( void ) {
+
+  struct epoll_event ev;
+
+  if ( reactorrunning ) {
+    return 0;
+  }
+  if (( epfd = epoll_create1( EPOLL_CLOEXEC )) < 0 ) {
+    return -1;
+  }
+  if (( reactorfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) < 0 ) {
+    close( epfd );
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.u64 = LUAPROC_SCHED_REACTOR_STOP;
+  if (( epoll_ctl( epfd, EPOLL_CTL_ADD, reactorfd, &ev ) != 0 ) ||
+      ( pthread_create( &reactorthread, NULL, sched_reactor_main,
+                        NULL ) != 0 )) {
+    close( reactorfd );
+    close( epfd );
+    return -1;
+  }
+  reactorrunning = TRUE;
+  return 0;
+}
+
+/* make a lua process wait until a file descriptor is ready or the timeout
+   of its wait (if any) expires */
+static void sched_reactor_add( luaproc *lp ) {
+
+  int i, err;
+  struct epoll_event ev;
+  long long deadline = luaproc_get_deadline( lp );
+
+  pthread_mutex_lock( &mutex_reactor );
+  if ( sched_reactor_start() != 0 ) {
+    pthread_mutex_unlock( &mutex_reactor );
+    sched_fdwait_fail( lp, "could not start the i/o reactor" );
+    return;
+  }
+  if (( i = sched_fdwait_get()) < 0 ) {
+    pthread_mutex_unlock( &mutex_reactor );
+    sched_fdwait_fail( lp, "not enough memory" );
+    return;
+  }
+  fdwaits[ i ].lp = lp;
+  fdwaits[ i ].fd = luaproc_get_fd( lp );
+  ev.events = EPOLLONESHOT;
+  if ( luaproc_get_fdmode( lp ) & LUAPROC_FD_READ ) {
+    ev.events |= EPOLLIN;
+  }
+  if ( luaproc_get_fdmode( lp ) & LUAPROC_FD_WRITE ) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.u64 = ((uint64_t)fdwaits[ i ].gen << 32 ) | (uint64_t)i;
+  if ( epoll_ctl( epfd, EPOLL_CTL_ADD, fdwaits[ i ].fd, &ev ) != 0 ) {
+    err = errno;
+    sched_fdwait_put( i );
+    pthread_mutex_unlock( &mutex_reactor );
+    /* regular files cannot be polled, but they are always ready */
+    if ( err == EPERM ) {
+      lua_pushboolean( luaproc_get_state( lp ), TRUE );
+      luaproc_set_numargs( lp, 1 );
+      sched_queue_proc( lp );
+    } else {
+      sched_fdwait_fail( lp, strerror( err ));
+    }
+    return;
+  }
+  fdwaits[ i ].active = TRUE;
+  /* the timer is set before the reactor can see the event; if it cannot be
+     set, the lua process waits without a timeout */
+  if ( deadline >= 0 ) {
+    sched_timer_add( lp, deadline, LUAPROC_SCHED_TIMER_FD, i );
+  }
+  pthread_mutex_unlock( &mutex_reactor );
+}
+
+/* end a file descriptor wait whose timeout expired. called by the timer
+   thread while it holds 'mutex_timers', so it must not block: returns -1 if
+   the reactor is busy (try again once 'mutex_reactor' is released) or TRUE
+   otherwise */
+static int sched_reactor_expire( int slot ) {
+
+  luaproc *lp;
+
+  if ( pthread_mutex_trylock( &mutex_reactor ) != 0 ) {
+    return -1;
+  }
+  lp = fdwaits[ slot ].lp;
+  sched_fdwait_put( slot );
+  lua_pushnil( luaproc_get_state( lp ));
+  lua_pushliteral( luaproc_get_state( lp ), "timeout" );
+  luaproc_set_numargs( lp, 2 );
+  pthread_mutex_unlock( &mutex_reactor );
+
+  return TRUE;
+}
+
+/* stop the reactor thread, if it is running */
+static void sched_reactor_stop( void ) {
+
+  int running;
+
+  pthread_mutex_lock( &mutex_reactor );
+  running = reactorrunning;
+  reactorexit = TRUE;
+  if ( running ) {
+    eventfd_write( reactorfd, 1 );
+  }
+  pthread_mutex_unlock( &mutex_reactor );
+  if ( running ) {
+    pthread_join( reactorthread, NULL );
+    close( reactorfd );
+    close( epfd );
+  }
+}
+
+#else
+
+/* waiting on file descriptors is only supported on linux */
+static void sched_reactor_add( luaproc *lp ) {
+  sched_fdwait_fail( lp, "waiting on file descriptors is not supported on "
+                         "this platform" );
+}
+
+static int sched_reactor_expire( int slot ) {
+  (void)slot;
+  return TRUE;
+}
+
+static void sched_reactor_stop( void ) {
+}
+
+#endif
+
+/*********************
+ * offload functions *
+ *********************/
+
+/* offload thread main function: run the blocking calls offloaded by lua
+   processes, off the workers, and queue the lua processes again */
+static void *sched_offload_main( void *args ) {
+
+  luaproc *lp;
+
+  (void)args;
+  pthread_mutex_lock( &mutex_offload );
+  for (;;) {
+    while (( list_count( &offloadls ) == 0 ) && ( !offloadexit )) {
+      pthread_cond_wait( &cond_offload, &mutex_offload );
+    }
+    if (( lp = list_remove( &offloadls )) == NULL ) {
+      break;
+    }
+    pthread_mutex_unlock( &mutex_offload );
+    luaproc_run_offloaded( lp );
+    sched_queue_proc( lp );
+    pthread_mutex_lock( &mutex_offload );
+  }
+  pthread_mutex_unlock( &mutex_offload );
+
+  return NULL;
+}
+
+/* hand a lua process that offloaded a blocking call to the offload threads */
+static void sched_offload( luaproc *lp ) {
+
+  pthread_mutex_lock( &mutex_offload );
+  if ( !offloadstarted ) {
+    while (( offloadcount < LUAPROC_SCHED_OFFLOAD_THREADS ) &&
+           ( pthread_create( &offloadthreads[ offloadcount ], NULL,
+                             sched_offload_main, NULL ) == 0 )) {
+      offloadcount++;
+    }
+    /* if no thread could be started, try again next time */
+    offloadstarted = ( offloadcount > 0 );
+  }
+  /* if no offload thread could be started, run the call right here */
+  if ( offloadcount == 0 ) {
+    pthread_mutex_unlock( &mutex_offload );
+    luaproc_run_offloaded( lp );
+    sched_queue_proc( lp );
+    return;
+  }
+  list_insert( &offloadls, lp );
+  pthread_cond_signal( &cond_offload );
+  pthread_mutex_unlock( &mutex_offload );
+}
+
+/* stop the offload threads, if they are running */
+static void sched_offload_stop( void ) {
+
+  int i;
+
+  pthread_mutex_lock( &mutex_offload );
+  offloadexit = TRUE;
+  pthread_cond_broadcast( &cond_offload );
+  pthread_mutex_unlock( &mutex_offload );
+  for ( i = 0; i < offloadcount; i++ ) {
+    pthread_join( offloadthreads[ i ], NULL );
+  }
+}
+
+/**********************
+ * affinity functions *
+ **********************/
+
+#if defined(__linux__)
+/* return the numa node a cpu belongs to (or -1 if it is unknown) */
+static int sched_cpu_node( int cpu ) {
+
+  int node;
+  char path[ 64 ];
+
+  for ( node = 0; node < LUAPROC_SCHED_MAX_NODES; node++ ) {
+    snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d/node%d",
+              cpu, node );
+    if ( access( path, F_OK ) == 0 ) {
+      return node;
+    }
+  }
+
+  return -1;
+}
+
+/* return the numa node all cpus of a set belong to (or -1 if they span more
+   than one node or it is unknown) */
+static int sched_cpuset_node( cpu_set_t *cpus ) {
+
+  int cpu, n, node = -1;
+
+  for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+    if ( CPU_ISSET( cpu, cpus )) {
+      n = sched_cpu_node( cpu );
+      if (( n < 0 ) || (( node >= 0 ) && ( n != node ))) {
+        return -1;
+      }
+      node = n;
+    }
+  }
+
+  return node;
+}
+
+/* return the n-th cpu (modulo the number of cpus) the process may run on */
+static int sched_nth_cpu( int n ) {
+
+  int cpu;
+
+  n = n % numcpus;
+  for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+    if (( CPU_ISSET( cpu, &allcpus )) && ( n-- == 0 )) {
+      return cpu;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+#if defined(__linux__)
+/* get the cpus a worker must run on, given the affinity of its pool; return
+   false if its affinity need not be set */
+static int sched_worker_cpus( worker *w, cpu_set_t *cpus ) {
+
+  switch ( w->pool->affinity ) {
+    case LUAPROC_SCHED_AFFINITY_AUTO:
+      CPU_ZERO( cpus );
+      CPU_SET( sched_nth_cpu( (int)( w - workers )), cpus );
+      return TRUE;
+    case LUAPROC_SCHED_AFFINITY_SET:
+      *cpus = w->pool->cpus;
+      return TRUE;
+    default:
+      *cpus = allcpus;
+      return w->pinned;
+  }
+}
+
+/* record the cpus a worker has been pinned to */
+static void sched_worker_pinned( worker *w, cpu_set_t *cpus ) {
+  w->pinned = ( w->pool->affinity != LUAPROC_SCHED_AFFINITY_NONE );
+  w->node = w->pinned ? sched_cpuset_node( cpus ) : -1;
+}
+#endif
+
+/* apply the affinity of its pool to a running worker. with automatic
+   affinity, each worker slot gets a cpu of its own (as long as there are
+   enough cpus). */
+static void sched_pin_worker( worker *w ) {
+#if defined(__linux__)
+  cpu_set_t cpus;
+
+  if ( !sched_worker_cpus( w, &cpus )) {
+    return;
+  }
+  pthread_setaffinity_np( w->thread, sizeof( cpu_set_t ), &cpus );
+  sched_worker_pinned( w, &cpus );
+#else
+  (void)w;
+#endif
+}
+
+/* return the numa node of the worker most likely to run the next process
+   created in a pool: the calling worker, if it belongs to the pool, or else
+   the first pinned worker of the pool (or -1 if there is none) */
+static int sched_pool_node( pool *pl ) {
+
+  int i, n;
+  worker *self = (worker *)pthread_getspecific( key_worker );
+
+  if (( self != NULL ) && ( self->pool == pl )) {
+    return self->node;
+  }
+  n = __atomic_load_n( &workerslots, __ATOMIC_ACQUIRE );
+  for ( i = 0; i < n; i++ ) {
+    if (( workers[ i ].active ) && ( workers[ i ].pool == pl ) &&
+        ( workers[ i ].node >= 0 )) {
+      return workers[ i ].node;
+    }
+  }
+
+  return -1;
+}
+
+/*******************************
+ * worker thread main function *
+ *******************************/
+
+/* execute a lua process on a worker (or on the main thread, while it helps
+   in sched_wait_help) and handle the way it stopped */
+static void sched_run_proc( worker *self, luaproc *lp ) {
+
+  int procstat;
+
+  /* start a new time slice, if the lua process can be preempted */
+  sched_set_timeslice( lp );
+
+  /* execute the lua code specified in the lua process struct */
+  self->current = lp;
+  procstat = luaproc_resume( luaproc_get_state( lp ), NULL,
+                             luaproc_get_numargs( lp ));
+  self->current = NULL;
+  /* reset the process argument count */
+  luaproc_set_numargs( lp, 0 );
+
+  /* has the lua process sucessfully finished its execution? */
+  if ( procstat == 0 ) {
+    luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );  
+    luaproc_recycle_insert( lp );  /* try to recycle finished lua process */
+    sched_dec_lpcount();  /* decrease active lua process count */
+  }
+
+  /* has the lua process yielded? */
+  else if ( procstat == LUA_YIELD ) {
+
+    /* yield attempting to send a message */
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
+      luaproc_queue_sender( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* yield attempting to receive a message */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
+      luaproc_queue_receiver( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+    
+    /* yield attempting to receive a message through an asynchronous channel*/
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_TMP_RECV ) {
+      luaproc_queue_receiver( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* yield attempting to send a message through a full asynchronous channel */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_TMP_SEND ) {
+      luaproc_queue_sender( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* yield while performing a barrier operation*/
+    else if ( luaproc_get_status( lp ) == LUAPROC_BLOCKED_BARRIER){
+	      luaproc_set_status(lp, LUAPROC_STATUS_READY);
+	      
+	      /* unlock channel */
+	      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* preempted at the end of its time slice */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_PREEMPTED ) {
+      __atomic_add_fetch( &preemptions, 1, __ATOMIC_RELAXED );
+      luaproc_set_status( lp, LUAPROC_STATUS_READY );
+      /* re-insert the job at the end of the local ready process queue */
+      sched_ready_push( lp );
+    }
+
+    /* blocking call to be run off the workers */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_OFFLOADED ) {
+      sched_offload( lp );
+    }
+
+    /* waiting for a file descriptor to be ready */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_WAITING_FD ) {
+      sched_reactor_add( lp );
+    }
+
+    /* sleeping until a deadline */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_SLEEPING ) {
+      /* if the timer cannot be set, just wake it up right away */
+      if ( sched_timer_add( lp, luaproc_get_deadline( lp ),
+                            LUAPROC_SCHED_TIMER_SLEEP, 0 ) != 0 ) {
+        sched_queue_proc( lp );
+      }
+    }
+
+    /* yield on explicit coroutine.yield call */
+    else { 
+      /* re-insert the job at the end of the local ready process queue */
+      sched_ready_push( lp );
+    }
+  }
+
+  /* or was there an error executing the lua process? */
+  else {
+    /* print error message */
+    fprintf( stderr, "close lua_State (error: %s)\n",
+             luaL_checkstring( luaproc_get_state( lp ), -1 ));
+    luaproc_unbind_channels( lp );
+    lua_close( luaproc_get_state( lp ));  /* close lua state */
+    sched_dec_lpcount();  /* decrease active lua process count */
+  }
+}
+
+/* worker thread main function */
+void *workermain( void *args ) {
+
+  worker *self = (worker *)args;
+  luaproc *lp;
+
+  pthread_setspecific( key_worker, self );
+
+  /* main worker loop */
+  while ( TRUE ) {
+
+    /* check whether workers should be destroyed */
+    if ( __atomic_load_n( &self->pool->destroyworkers, __ATOMIC_SEQ_CST ) > 0 ) {
+      pthread_mutex_lock( &mutex_sched );
+      if ( self->pool->destroyworkers > 0 ) {
+        __atomic_sub_fetch( &self->pool->destroyworkers, 1, __ATOMIC_SEQ_CST );
+        sched_worker_exit( self );
+      }
+      pthread_mutex_unlock( &mutex_sched );
+    }
+
+    /* get a lua process from the ready queues; if there is none, wait until
+       instructed to wake up (because there's work to do or because workers
+       must be destroyed) */
+    lp = sched_next( self );
+    if ( lp == NULL ) {
+      /* workers retired by the autoscaler are only taken among idle ones */
+      if ( __atomic_load_n( &self->pool->retireworkers,
+                            __ATOMIC_SEQ_CST ) > 0 ) {
+        pthread_mutex_lock( &mutex_sched );
+        if ( self->pool->retireworkers > 0 ) {
+          __atomic_sub_fetch( &self->pool->retireworkers, 1,
+                              __ATOMIC_SEQ_CST );
+          sched_worker_exit( self );
+        }
+        pthread_mutex_unlock( &mutex_sched );
+      }
+      sched_worker_park( self );
+      continue;
+    }
 
-#include <lua.h>
-#include <lauxlib.h>
-#include <lualib.h>
+    sched_run_proc( self, lp );
+  }
+}
 
-#include "lpsched.h"
-#include "luaproc.h"
+/* take a free worker slot (or a new one) for a pool. caller must lock
+   'mutex_sched' before calling this function. return null if there are no
+   slots left. */
+static worker *sched_worker_slot( pool *pl ) {
 
-#include <unistd.h>
-#include <sys/types.h>
+  int i, p;
+  worker *w = NULL;
 
-#define FALSE 0
-#define TRUE  !FALSE
-#define LUAPROC_SCHED_WORKERS_TABLE "workertb"
+  /* find a free worker slot */
+  for ( i = 0; i < workerslots; i++ ) {
+    if ( !workers[ i ].active ) {
+      w = &workers[ i ];
+      break;
+    }
+  }
+  if ( w == NULL ) {
+    if ( workerslots >= LUAPROC_SCHED_MAX_WORKERS ) {
+      return NULL;
+    }
+    w = &workers[ workerslots ];
+    pthread_mutex_init( &w->mutex, NULL );
+    for ( p = 0; p < LUAPROC_PRIORITIES; p++ ) {
+      list_init( &w->ready[ p ] );
+      w->passed[ p ] = 0;
+    }
+    w->seed = (unsigned int)workerslots + 1;
+    w->tick = 0;
+    w->runnext = NULL;
+    w->handoffs = 0;
+    w->current = NULL;
+    w->spinwakes = 0;
+    w->parks = 0;
+    __atomic_store_n( &workerslots, workerslots + 1, __ATOMIC_RELEASE );
+  }
 
-#if (LUA_VERSION_NUM >= 502)
-#define luaproc_resume( L, from, nargs ) lua_resume( L, from, nargs )
-#else
-#define luaproc_resume( L, from, nargs ) lua_resume( L, nargs )
-#endif
+  pthread_mutex_lock( &w->mutex );
+  w->pool = pl;
+  pthread_mutex_unlock( &w->mutex );
+  w->pinned = FALSE;
+  w->node = -1;
+  w->helper = FALSE;
+  w->spingen = __atomic_load_n( &spingen, __ATOMIC_ACQUIRE );
+  w->spin = __atomic_load_n( &spinrounds, __ATOMIC_RELAXED );
 
-/********************
- * global variables *
- *******************/
+  return w;
+}
 
-/* ready process list */
-list ready_lp_list;
+/* create a new worker thread in a pool. caller must lock 'mutex_sched' and
+   push the workers table onto workerls' stack before calling this function. */
+static int sched_create_worker( pool *pl ) {
 
-/* ready process queue access mutex */
-pthread_mutex_t mutex_sched = PTHREAD_MUTEX_INITIALIZER;
+  worker *w = sched_worker_slot( pl );
+  pthread_attr_t attr;
+  int ret;
+#if defined(__linux__)
+  cpu_set_t cpus;
+  int pin;
+#endif
 
-/* active luaproc count access mutex */
-pthread_mutex_t mutex_lp_count = PTHREAD_MUTEX_INITIALIZER;
+  if ( w == NULL ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
 
-/* mutex to access the counter of async messages not yet received */
-pthread_mutex_t mutex_async_msg_count = PTHREAD_MUTEX_INITIALIZER;
+  /* pin the worker from the start, so it never runs (nor allocates memory)
+     on another cpu */
+  pthread_attr_init( &attr );
+#if defined(__linux__)
+  pin = sched_worker_cpus( w, &cpus );
+  if ( pin ) {
+    pthread_attr_setaffinity_np( &attr, sizeof( cpu_set_t ), &cpus );
+  }
+#endif
+  w->active = TRUE;
+  ret = pthread_create( &w->thread, &attr, workermain, w );
+  pthread_attr_destroy( &attr );
+  if ( ret != 0 ) {
+    w->active = FALSE;
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+#if defined(__linux__)
+  if ( pin ) {
+    sched_worker_pinned( w, &cpus );
+  }
+#endif
 
-/* wake worker up conditional variable */
-pthread_cond_t cond_wakeup_worker = PTHREAD_COND_INITIALIZER;
+  /* store worker thread id in a table */
+  lua_pushlightuserdata( workerls, (void *)w->thread );
+  lua_pushboolean( workerls, TRUE );
+  lua_rawset( workerls, -3 );
 
-/* no active luaproc conditional variable */
-pthread_cond_t cond_no_active_lp = PTHREAD_COND_INITIALIZER;
+  pl->workerscount++; /* increase active workers count */
 
-/* conditional variable to indicate that all the async message have been received */
-pthread_cond_t cond_no_remain_async_msg = PTHREAD_COND_INITIALIZER;
+  return LUAPROC_SCHED_OK;
+}
 
-/* lua_State used to store workers hash table */
-static lua_State *workerls = NULL;
+/* set the number of workers of a pool, creating and destroying workers
+   accordingly. caller must lock 'mutex_sched' before calling this function. */
+static int sched_resize_pool( pool *pl, int numworkers ) {
 
-int lpcount = 0;         /* number of active luaprocs */
-int workerscount = 0;    /* number of active workers */
-int destroyworkers = 0;  /* number of workers to destroy */
+  int i, delta;
 
-int async_msg = 0;//number of async messages in transit
+  /* cancel pending destructions; they are recalculated below */
+  __atomic_store_n( &pl->destroyworkers, 0, __ATOMIC_SEQ_CST );
+  __atomic_store_n( &pl->retireworkers, 0, __ATOMIC_SEQ_CST );
 
-/*******************************
- * worker thread main function *
- *******************************/
+  /* calculate delta between existing workers and set number of workers */
+  delta = numworkers - pl->workerscount;
 
-/* worker thread main function */
-void *workermain( void *args ) {
+  /* create additional workers */
+  if ( numworkers > pl->workerscount ) {
 
-  luaproc *lp;
-  int procstat;
+    /* get ready to access worker threads table */
+    lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
 
-  /* main worker loop */
-  while ( TRUE ) {
-    /*
-      wait until instructed to wake up (because there's work to do
-      or because workers must be destroyed)
-    */
-    pthread_mutex_lock( &mutex_sched );
-    while (( list_count( &ready_lp_list ) == 0 ) && ( destroyworkers <= 0 )) {
-      pthread_cond_wait( &cond_wakeup_worker, &mutex_sched );
+    /* create additional workers */
+    for ( i = 0; i < delta; i++ ) {
+      if ( sched_create_worker( pl ) != LUAPROC_SCHED_OK ) {
+        lua_pop( workerls, 1 ); /* pop workers table from stack */
+        return LUAPROC_SCHED_PTHREAD_ERROR;
+      }
     }
 
-    if ( destroyworkers > 0 ) {  /* check whether workers should be destroyed */
-      
-      destroyworkers--; /* decrease workers to be destroyed count */
-      workerscount--; /* decrease active workers count */
+    lua_pop( workerls, 1 ); /* pop workers table from stack */
+  }
+  /* destroy existing workers; each one hands its local ready processes over
+     to the global queue before exiting */
+  else if ( numworkers < pl->workerscount ) {
+    __atomic_store_n( &pl->destroyworkers, -delta, __ATOMIC_SEQ_CST );
+    ec_notify( &pl->ec, INT_MAX );
+  }
+
+  return LUAPROC_SCHED_OK;
+}
+
+/* initialize a pool and create its workers. caller must lock 'mutex_sched'
+   before calling this function. */
+static int sched_create_pool( const char *name, int numworkers ) {
 
-      /* remove worker from workers table */
-      lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
-      lua_pushlightuserdata( workerls, (void *)pthread_self( ));
-      lua_pushnil( workerls );
-      lua_rawset( workerls, -3 );
-      lua_pop( workerls, 1 );
+  int i, prio;
+  pool *pl;
 
-      pthread_cond_signal( &cond_wakeup_worker );  /* wake other workers up */
-      pthread_mutex_unlock( &mutex_sched );
-      pthread_exit( NULL );  /* destroy itself */
+  if (( poolcount >= LUAPROC_SCHED_MAX_POOLS ) ||
+      ( strlen( name ) > LUAPROC_SCHED_POOL_NAME_MAX )) {
+    return LUAPROC_SCHED_POOL_ERROR;
+  }
+  pl = &pools[ poolcount ];
+  strcpy( pl->name, name );
+  pthread_mutex_init( &pl->mutex, NULL );
+  for ( prio = 0; prio < LUAPROC_PRIORITIES; prio++ ) {
+    list_init( &pl->ready[ prio ] );
+    pl->readycount[ prio ] = 0;
+    if (( backend == LUAPROC_SCHED_BACKEND_MPMC ) &&
+        ( !mpmc_init( &pl->mpmc[ prio ], LUAPROC_SCHED_MPMC_SIZE ))) {
+      return LUAPROC_SCHED_PTHREAD_ERROR;
     }
+  }
+  pl->ec.epoch = 0;
+  pl->ec.waiters = 0;
+  pthread_mutex_init( &pl->ec.mutex, NULL );
+  pthread_cond_init( &pl->ec.cond, NULL );
+  pl->workerscount = 0;
+  pl->destroyworkers = 0;
+  pl->retireworkers = 0;
+  pl->spinning = 0;
+  pl->affinity = LUAPROC_SCHED_AFFINITY_NONE;
+  pl->autoscale = FALSE;
+  __atomic_store_n( &poolcount, poolcount + 1, __ATOMIC_RELEASE );
 
-    /* remove lua process from the ready queue */
-    lp = list_remove( &ready_lp_list );
-    pthread_mutex_unlock( &mutex_sched );
+  /* get ready to access worker threads table */
+  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+
+  /* create initial worker threads */
+  for ( i = 0; i < numworkers; i++ ) {
+    if ( sched_create_worker( pl ) != LUAPROC_SCHED_OK ) {
+      lua_pop( workerls, 1 ); /* pop workers table from stack */
+      /* unregister the pool and destroy the workers already created. the
+         slot itself is not reused, since those workers may still be
+         exiting. */
+      pl->name[ 0 ] = '\0';
+      __atomic_store_n( &pl->destroyworkers, pl->workerscount,
+                        __ATOMIC_SEQ_CST );
+      ec_notify( &pl->ec, INT_MAX );
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+  }
+
+  lua_pop( workerls, 1 ); /* pop workers table from stack */
 
-    /* execute the lua code specified in the lua process struct */
-    procstat = luaproc_resume( luaproc_get_state( lp ), NULL,
-                               luaproc_get_numargs( lp ));
-    /* reset the process argument count */
-    luaproc_set_numargs( lp, 0 );
+  return poolcount - 1;
+}
+
+/************************
+ * autoscaler functions *
+ ************************/
+
+/* sample the ready queues and idle workers of a pool and add or retire a
+   worker if needed. caller must lock 'mutex_sched' before calling this
+   function. */
+static void sched_autoscale_pool( pool *pl ) {
+
+  int ready = sched_ready_total( pl );
+  int numworkers = pl->workerscount -
+                   __atomic_load_n( &pl->destroyworkers, __ATOMIC_SEQ_CST ) -
+                   __atomic_load_n( &pl->retireworkers, __ATOMIC_SEQ_CST );
+
+  /* keep the number of workers within bounds */
+  if ( numworkers < pl->scale.minworkers ) {
+    sched_resize_pool( pl, pl->scale.minworkers );
+    return;
+  } else if ( numworkers > pl->scale.maxworkers ) {
+    sched_resize_pool( pl, pl->scale.maxworkers );
+    return;
+  }
 
-    /* has the lua process sucessfully finished its execution? */
-    if ( procstat == 0 ) {
-      luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );  
-      luaproc_recycle_insert( lp );  /* try to recycle finished lua process */
-      sched_dec_lpcount();  /* decrease active lua process count */
+  /* grow while the ready queues have stayed long */
+  pl->above = ( ready > pl->scale.threshold ) ? pl->above + 1 : 0;
+  if (( pl->above >= LUAPROC_SCHED_SCALE_UP_SAMPLES ) &&
+      ( numworkers < pl->scale.maxworkers )) {
+    if ( sched_resize_pool( pl, numworkers + 1 ) == LUAPROC_SCHED_OK ) {
+      __atomic_add_fetch( &scaleups, 1, __ATOMIC_RELAXED );
     }
+    pl->above = 0;
+  }
 
-    /* has the lua process yielded? */
-    else if ( procstat == LUA_YIELD ) {
+  /* shrink once some worker has been idle for the whole cool-down. the
+     worker to retire is one of the idle ones, never one that is busy running
+     lua processes, so all parked workers are woken up to pick it. */
+  if (( ready == 0 ) &&
+      ( __atomic_load_n( &pl->ec.waiters, __ATOMIC_SEQ_CST ) > 0 )) {
+    pl->idle += LUAPROC_SCHED_SCALE_INTERVAL;
+  } else {
+    pl->idle = 0;
+  }
+  if (( pl->idle >= pl->scale.cooldown ) &&
+      ( numworkers > pl->scale.minworkers )) {
+    __atomic_add_fetch( &pl->retireworkers, 1, __ATOMIC_SEQ_CST );
+    ec_notify( &pl->ec, INT_MAX );
+    __atomic_add_fetch( &scaledowns, 1, __ATOMIC_RELAXED );
+    pl->idle = 0;
+  }
+}
 
-      /* yield attempting to send a message */
-      if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
-        luaproc_queue_sender( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
+/* return whether the number of workers of some pool is scaled automatically.
+   caller must lock 'mutex_sched' before calling this function. */
+static int sched_autoscaling( void ) {
 
-      /* yield attempting to receive a message */
-      else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
-        luaproc_queue_receiver( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
-      
-      /* yield attempting to receive a message through an asynchronous channel*/
-      else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_TMP_RECV ) {
-        luaproc_queue_receiver( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
+  int i;
 
-      /* yield while performing a barrier operation*/
-      else if ( luaproc_get_status( lp ) == LUAPROC_BLOCKED_BARRIER){
-	      luaproc_set_status(lp, LUAPROC_STATUS_READY);
-	      
-	      /* unlock channel */
-	      luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
+  for ( i = 0; i < poolcount; i++ ) {
+    if ( pools[ i ].autoscale ) {
+      return TRUE;
+    }
+  }
 
-      /* yield on explicit coroutine.yield call */
-      else { 
-        /* re-insert the job at the end of the ready process queue */
-        pthread_mutex_lock( &mutex_sched );
-        list_insert( &ready_lp_list, lp );
-        pthread_mutex_unlock( &mutex_sched );
+  return FALSE;
+}
+
+/* autoscaler thread main function. the thread sleeps while no pool is
+   scaled automatically. */
+static void *sched_monitor( void *args ) {
+
+  int i, scaling;
+  struct timespec ts;
+
+  (void)args;
+  pthread_mutex_lock( &mutex_monitor );
+  while ( !monitorexit ) {
+    pthread_mutex_lock( &mutex_sched );
+    scaling = sched_autoscaling();
+    pthread_mutex_unlock( &mutex_sched );
+    if ( !scaling ) {
+      pthread_cond_wait( &cond_monitor, &mutex_monitor );
+      continue;
+    }
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_nsec += LUAPROC_SCHED_SCALE_INTERVAL * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait( &cond_monitor, &mutex_monitor, &ts );
+    if ( monitorexit ) {
+      break;
+    }
+    pthread_mutex_lock( &mutex_sched );
+    for ( i = 0; i < poolcount; i++ ) {
+      if ( pools[ i ].autoscale ) {
+        sched_autoscale_pool( &pools[ i ] );
       }
     }
+    pthread_mutex_unlock( &mutex_sched );
+  }
+  pthread_mutex_unlock( &mutex_monitor );
 
-    /* or was there an error executing the lua process? */
-    else {
-      /* print error message */
-      fprintf( stderr, "close lua_State (error: %s)\n",
-               luaL_checkstring( luaproc_get_state( lp ), -1 ));
-      lua_close( luaproc_get_state( lp ));  /* close lua state */
-      sched_dec_lpcount();  /* decrease active lua process count */
-    }
-  }    
+  return NULL;
 }
 
 /***********************
@@ -175,13 +2055,19 @@ void *workermain( void *args ) {
 
 /* decrease active lua process count */
 void sched_dec_lpcount( void ) {
+  int last;
+
   pthread_mutex_lock( &mutex_lp_count );
-  lpcount--;
+  last = ( __atomic_sub_fetch( &lpcount, 1, __ATOMIC_SEQ_CST ) == 0 );
   /* if count reaches zero, signal there are no more active processes */
-  if ( lpcount == 0 ) {
+  if ( last ) {
     pthread_cond_signal( &cond_no_active_lp );
   }
   pthread_mutex_unlock( &mutex_lp_count );
+  /* the main thread may be parked among the workers of the default pool */
+  if (( last ) && ( __atomic_load_n( &helping, __ATOMIC_SEQ_CST ))) {
+    ec_notify( &pools[ 0 ].ec, INT_MAX );
+  }
 }
 
 /**********************
@@ -190,143 +2076,383 @@ void sched_dec_lpcount( void ) {
 
 /* increase active lua process count */
 void sched_inc_lpcount( void ) {
-  pthread_mutex_lock( &mutex_lp_count );
-  lpcount++;
-  pthread_mutex_unlock( &mutex_lp_count );
+  __atomic_add_fetch( &lpcount, 1, __ATOMIC_SEQ_CST );
 }
 
 /* increases the number of asynchronous messages in transit*/
 void sched_inc_async_msg_count( void ) {
-  pthread_mutex_lock( &mutex_async_msg_count );
-  async_msg++;
-  pthread_mutex_unlock( &mutex_async_msg_count );
+  __atomic_add_fetch( &async_msg, 1, __ATOMIC_SEQ_CST );
 }
 
-/* decreases the number of asynchronous messages in transit */
+/* decreases the number of asynchronous messages in transit. the lock is only
+   taken by the last message, so senders and receivers of lock-free channels
+   do not serialize on it */
 void sched_dec_async_msg_count( void ) {
-  pthread_mutex_lock( &mutex_async_msg_count );
-  async_msg--;
   /* if count reaches zero, signal all the async messages have been received */
-  if ( async_msg == 0 ) {
+  if ( __atomic_sub_fetch( &async_msg, 1, __ATOMIC_SEQ_CST ) == 0 ) {
+    pthread_mutex_lock( &mutex_async_msg_count );
     pthread_cond_signal( &cond_no_remain_async_msg );
+    pthread_mutex_unlock( &mutex_async_msg_count );
   }
-  pthread_mutex_unlock( &mutex_async_msg_count );
 }
 
 /* local scheduler initialization */
-int sched_init( void ) {
+int sched_init( int readyqueue ) {
 
-  int i;
-  pthread_t worker;
+  int ret;
+
+  backend = readyqueue;
+
+#if defined(__linux__)
+  /* find out which cpus workers may be pinned to */
+  if ( sched_getaffinity( 0, sizeof( cpu_set_t ), &allcpus ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  numcpus = CPU_COUNT( &allcpus );
+#endif
+
+  list_init( &offloadls );
 
-  /* initialize ready process list */
-  list_init( &ready_lp_list );
+  /* initialize key used by workers to find their own worker slot */
+  if ( pthread_key_create( &key_worker, NULL ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
 
   /* initialize workers table and lua_State used to store it */
   workerls = luaL_newstate();
   lua_newtable( workerls );
   lua_setglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
 
-  /* get ready to access worker threads table */
-  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  /* create the default pool with the default number of initial worker
+     threads */
+  pthread_mutex_lock( &mutex_sched );
+  ret = sched_create_pool( LUAPROC_SCHED_DEFAULT_POOL,
+                           LUAPROC_SCHED_DEFAULT_WORKER_THREADS );
+  pthread_mutex_unlock( &mutex_sched );
 
-  /* create default number of initial worker threads */
-  for ( i = 0; i < LUAPROC_SCHED_DEFAULT_WORKER_THREADS; i++ ) {
+  return ( ret < 0 ) ? ret : LUAPROC_SCHED_OK;
+}
 
-    if ( pthread_create( &worker, NULL, workermain, NULL ) != 0 ) {
-      lua_pop( workerls, 1 ); /* pop workers table from stack */
-      return LUAPROC_SCHED_PTHREAD_ERROR;
-    }
+/* create a new named worker pool with a number of workers; return its id
+   (or an error constant) */
+int sched_new_pool( const char *name, int numworkers ) {
 
-    /* store worker thread id in a table */
-    lua_pushlightuserdata( workerls, (void *)worker );
-    lua_pushboolean( workerls, TRUE );
-    lua_rawset( workerls, -3 );
+  int ret;
 
-    workerscount++; /* increase active workers count */
+  pthread_mutex_lock( &mutex_sched );
+  if ( sched_find_pool( name ) >= 0 ) {
+    ret = LUAPROC_SCHED_POOL_ERROR;
+  } else {
+    ret = sched_create_pool( name, numworkers );
   }
+  pthread_mutex_unlock( &mutex_sched );
 
-  lua_pop( workerls, 1 ); /* pop workers table from stack */
-
-  return LUAPROC_SCHED_OK;
+  return ret;
 }
 
-/* set number of active workers */
-int sched_set_numworkers( int numworkers ) {
+/* return the id of a worker pool given its name (or -1 if there is none) */
+int sched_find_pool( const char *name ) {
 
-  int i, delta;
-  pthread_t worker;
+  int i, n = __atomic_load_n( &poolcount, __ATOMIC_ACQUIRE );
 
-  pthread_mutex_lock( &mutex_sched );
+  for ( i = 0; i < n; i++ ) {
+    if (( pools[ i ].name[ 0 ] != '\0' ) &&
+        ( strcmp( pools[ i ].name, name ) == 0 )) {
+      return i;
+    }
+  }
 
-  /* calculate delta between existing workers and set number of workers */
-  delta = numworkers - workerscount;
+  return -1;
+}
 
-  /* create additional workers */
-  if ( numworkers > workerscount ) {
+/* set number of active workers of a pool */
+int sched_set_numworkers( int poolid, int numworkers ) {
 
-    /* get ready to access worker threads table */
-    lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  int ret;
 
-    /* create additional workers */
-    for ( i = 0; i < delta; i++ ) {
+  pthread_mutex_lock( &mutex_sched );
+  ret = sched_resize_pool( &pools[ poolid ], numworkers );
+  pthread_mutex_unlock( &mutex_sched );
 
-      if ( pthread_create( &worker, NULL, workermain, NULL ) != 0 ) {
-        pthread_mutex_unlock( &mutex_sched );
-        lua_pop( workerls, 1 ); /* pop workers table from stack */
-        return LUAPROC_SCHED_PTHREAD_ERROR;
-      }
+  return ret;
+}
 
-      /* store worker thread id in a table */
-      lua_pushlightuserdata( workerls, (void *)worker );
-      lua_pushboolean( workerls, TRUE );
-      lua_rawset( workerls, -3 );
+/* enable (or, if 'scale' is null, disable) automatic scaling of the number
+   of workers of a pool */
+int sched_set_autoscale( int poolid, const schedscale *scale ) {
 
-      workerscount++; /* increase active workers count */
+  int ret = LUAPROC_SCHED_OK;
+  pool *pl = &pools[ poolid ];
+
+  pthread_mutex_lock( &mutex_sched );
+  if ( scale == NULL ) {
+    pl->autoscale = FALSE;
+  } else {
+    pl->scale = *scale;
+    pl->above = 0;
+    pl->idle = 0;
+    pl->autoscale = TRUE;
+    if (( !monitorrunning ) &&
+        ( pthread_create( &monitor, NULL, sched_monitor, NULL ) != 0 )) {
+      pl->autoscale = FALSE;
+      ret = LUAPROC_SCHED_PTHREAD_ERROR;
+    } else {
+      monitorrunning = TRUE;
     }
+  }
+  pthread_mutex_unlock( &mutex_sched );
 
-    lua_pop( workerls, 1 ); /* pop workers table from stack */
+  /* wake the autoscaler up, in case it was sleeping */
+  if ( ret == LUAPROC_SCHED_OK ) {
+    pthread_mutex_lock( &mutex_monitor );
+    pthread_cond_signal( &cond_monitor );
+    pthread_mutex_unlock( &mutex_monitor );
   }
-  /* destroy existing workers */
-  else if ( numworkers < workerscount ) {
-    destroyworkers = destroyworkers + numworkers;
+
+  return ret;
+}
+
+/* set the cpu affinity of the workers of a pool: none, automatic (one cpu
+   per worker) or the given set of cpus */
+int sched_set_affinity( int poolid, int affinity, const int *cpus, int n ) {
+#if defined(__linux__)
+  int i;
+  pool *pl = &pools[ poolid ];
+  cpu_set_t set;
+
+  CPU_ZERO( &set );
+  for ( i = 0; i < n; i++ ) {
+    if (( cpus[ i ] < 0 ) || ( cpus[ i ] >= CPU_SETSIZE ) ||
+        ( !CPU_ISSET( cpus[ i ], &allcpus ))) {
+      return LUAPROC_SCHED_AFFINITY_ERROR;
+    }
+    CPU_SET( cpus[ i ], &set );
   }
 
+  pthread_mutex_lock( &mutex_sched );
+  pl->affinity = affinity;
+  pl->cpus = set;
+  n = __atomic_load_n( &workerslots, __ATOMIC_ACQUIRE );
+  for ( i = 0; i < n; i++ ) {
+    if (( workers[ i ].active ) && ( workers[ i ].pool == pl ) &&
+        ( !workers[ i ].helper )) {
+      sched_pin_worker( &workers[ i ] );
+    }
+  }
   pthread_mutex_unlock( &mutex_sched );
 
   return LUAPROC_SCHED_OK;
+#else
+  (void)poolid; (void)cpus; (void)n;
+  return ( affinity == LUAPROC_SCHED_AFFINITY_NONE ) ?
+         LUAPROC_SCHED_OK : LUAPROC_SCHED_AFFINITY_ERROR;
+#endif
+}
+
+/* make the memory the calling thread allocates from now on prefer the numa
+   node of the workers of a pool; return true if a preference was set, in
+   which case the previous policy is saved in 'saved' and sched_numa_restore
+   must be called afterwards */
+int sched_numa_prefer( int poolid, schedmempolicy *saved ) {
+#if defined(__linux__)
+  unsigned long mask[ LUAPROC_SCHED_MAX_NODES / ( 8 * sizeof( long )) + 1 ];
+  int node = sched_pool_node( &pools[ poolid ] );
+
+  if ( node < 0 ) {
+    return FALSE;
+  }
+  memset( saved, 0, sizeof( schedmempolicy ));
+  if ( syscall( SYS_get_mempolicy, &saved->mode, saved->nodes,
+                sizeof( saved->nodes ) * 8, NULL, 0 ) != 0 ) {
+    return FALSE;
+  }
+  memset( mask, 0, sizeof( mask ));
+  mask[ node / ( 8 * sizeof( long )) ] = 1UL << ( node % ( 8 * sizeof( long )));
+  return ( syscall( SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                    sizeof( mask ) * 8 ) == 0 );
+#else
+  (void)poolid; (void)saved;
+  return FALSE;
+#endif
+}
+
+/* restore the memory policy saved by sched_numa_prefer */
+void sched_numa_restore( const schedmempolicy *saved ) {
+#if defined(__linux__)
+  syscall( SYS_set_mempolicy, saved->mode, saved->nodes,
+           sizeof( saved->nodes ) * 8 );
+#else
+  (void)saved;
+#endif
 }
 
-/* return the number of active workers */
-int sched_get_numworkers( void ) {
+/* return the number of active workers of a pool */
+int sched_get_numworkers( int poolid ) {
 
   int numworkers;
 
   pthread_mutex_lock( &mutex_sched );
-  numworkers = workerscount;
+  numworkers = pools[ poolid ].workerscount;
   pthread_mutex_unlock( &mutex_sched );
 
   return numworkers;
 }
 
+/* get scheduler statistics */
+void sched_get_stats( schedstats *stats ) {
+
+  int i, n;
+
+  stats->preemptions = __atomic_load_n( &preemptions, __ATOMIC_RELAXED );
+  stats->scaleups = __atomic_load_n( &scaleups, __ATOMIC_RELAXED );
+  stats->scaledowns = __atomic_load_n( &scaledowns, __ATOMIC_RELAXED );
+
+  /* per worker counters (of retired workers too) */
+  stats->spinwakes = 0;
+  stats->parks = 0;
+  n = __atomic_load_n( &workerslots, __ATOMIC_ACQUIRE );
+  for ( i = 0; i < n; i++ ) {
+    stats->spinwakes += __atomic_load_n( &workers[ i ].spinwakes,
+                                         __ATOMIC_RELAXED );
+    stats->parks += __atomic_load_n( &workers[ i ].parks, __ATOMIC_RELAXED );
+  }
+}
+
+/* return the monotonic time a number of milliseconds from now, in
+   nanoseconds. deadlines too far away to be represented are clamped. */
+long long sched_deadline( long long ms ) {
+
+  long long now = sched_now();
+
+  if ( ms > ( LLONG_MAX - now ) / 1000000LL ) {
+    return LLONG_MAX;
+  }
+
+  return now + ms * 1000000LL;
+}
+
+/* set the timeout of a lua process waiting on a channel, which must remain
+   locked until the lua process is in the channel's lists. when the timeout
+   expires, the wait is ended by luaproc_expire_wait */
+int sched_set_timeout( luaproc *lp, long long deadline ) {
+  return sched_timer_add( lp, deadline, LUAPROC_SCHED_TIMER_CHANNEL, 0 );
+}
+
+/* cancel the timeout of a lua process taken out of a channel's lists. the
+   channel must still be locked */
+void sched_cancel_timeout( luaproc *lp ) {
+
+  int i;
+
+  pthread_mutex_lock( &mutex_timers );
+  if (( i = luaproc_get_timer( lp )) >= 0 ) {
+    sched_timer_remove( i );
+  }
+  pthread_mutex_unlock( &mutex_timers );
+}
+
+/* set the maximum number of rounds an idle worker spins before parking */
+void sched_set_spin( int rounds ) {
+  __atomic_store_n( &spinrounds, rounds, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &spingen, 1, __ATOMIC_RELEASE );
+}
+
 /* insert lua process in ready queue */
 void sched_queue_proc( luaproc *lp ) {
-  pthread_mutex_lock( &mutex_sched );
-  list_insert( &ready_lp_list, lp );  /* add process to ready queue */
+
+  worker *self = (worker *)pthread_getspecific( key_worker );
+
   /* set process status ready */
   luaproc_set_status( lp, LUAPROC_STATUS_READY );
-  pthread_cond_signal( &cond_wakeup_worker );  /* wake worker up */
-  pthread_mutex_unlock( &mutex_sched );
+
+  /* a process woken by a running process is handed off directly to the
+     waking worker, to run as soon as the waker yields, unless that worker
+     has been handing off for too long (other processes must run too), the
+     woken process has a lower priority than the waker or it belongs to
+     another pool */
+  if (( self != NULL ) && ( self->current != NULL ) &&
+      ( self->handoffs < LUAPROC_SCHED_RUNNEXT_MAX ) &&
+      ( self->pool == sched_proc_pool( lp )) &&
+      ( luaproc_get_priority( lp ) <=
+        luaproc_get_priority( self->current ))) {
+    __atomic_add_fetch( &self->pool->readycount[ luaproc_get_priority( lp ) ],
+                        1, __ATOMIC_SEQ_CST );
+    lp = sched_runnext_swap( self, lp );
+    if ( lp == NULL ) {
+      return;
+    }
+    /* the displaced process goes to the ready queue (already counted) */
+    sched_ready_insert( lp );
+    sched_wakeup_workers( self->pool, 1 );
+    return;
+  }
+
+  /* add process to the waking worker's ready queue */
+  sched_ready_push( lp );
 }
 
 //enqueue more than one lua process at the time in ready queue
 void sched_queue_list_proc( list *l ){
-	pthread_mutex_lock( &mutex_sched );
-	
-	//appends the queue of processes to the ready queue
-	list_join(&ready_lp_list, l);
-	pthread_cond_signal( &cond_wakeup_worker );  /* wake worker up */
-	pthread_mutex_unlock( &mutex_sched );
+
+	worker *self;
+	pool *pl;
+	luaproc *lp;
+	list bypool[ LUAPROC_SCHED_MAX_POOLS ][ LUAPROC_PRIORITIES ];
+	int i, p, n, total, used[ LUAPROC_SCHED_MAX_POOLS ];
+
+	if ( list_count( l ) == 0 ) {
+		return;
+	}
+
+	//split the processes by pool and priority
+	for ( i = 0; i < LUAPROC_SCHED_MAX_POOLS; i++ ) {
+		used[ i ] = FALSE;
+	}
+	for ( lp = list_remove( l ); lp != NULL; lp = list_remove( l )) {
+		i = luaproc_get_pool( lp );
+		if ( !used[ i ] ) {
+			used[ i ] = TRUE;
+			for ( p = 0; p < LUAPROC_PRIORITIES; p++ ) {
+				list_init( &bypool[ i ][ p ] );
+			}
+		}
+		list_insert( &bypool[ i ][ luaproc_get_priority( lp ) ], lp );
+	}
+
+	//appends the queues of processes to the ready queues of the waking worker (or to the global ones of their pool)
+	self = (worker *)pthread_getspecific( key_worker );
+	for ( i = 0; i < LUAPROC_SCHED_MAX_POOLS; i++ ) {
+		if ( !used[ i ] ) {
+			continue;
+		}
+		pl = &pools[ i ];
+		total = 0;
+		for ( p = 0; p < LUAPROC_PRIORITIES; p++ ) {
+			n = list_count( &bypool[ i ][ p ] );
+			if ( n == 0 ) {
+				continue;
+			}
+			//with the lock-free backend, processes are queued one by one
+			if ( backend == LUAPROC_SCHED_BACKEND_MPMC ) {
+				for ( lp = list_remove( &bypool[ i ][ p ] ); lp != NULL;
+				      lp = list_remove( &bypool[ i ][ p ] )) {
+					sched_ready_insert( lp );
+				}
+			} else if (( self != NULL ) && ( self->pool == pl )) {
+				pthread_mutex_lock( &self->mutex );
+				list_join( &self->ready[ p ], &bypool[ i ][ p ] );
+				pthread_mutex_unlock( &self->mutex );
+			} else {
+				pthread_mutex_lock( &pl->mutex );
+				list_join( &pl->ready[ p ], &bypool[ i ][ p ] );
+				pthread_mutex_unlock( &pl->mutex );
+			}
+			__atomic_add_fetch( &pl->readycount[ p ], n, __ATOMIC_SEQ_CST );
+			total += n;
+		}
+		//wake as many workers up as there are new processes (at most all idle ones)
+		sched_wakeup_workers( pl, total );
+	}
 }
 
 /* join worker threads (called when Lua exits). not joining workers causes a
@@ -335,6 +2461,7 @@ void sched_queue_list_proc( list *l ){
    alive. */
 void sched_join_workers( void ) {
 
+  int i;
   lua_State *L = luaL_newstate();
   const char *wtb = "workerstbcopy";
 
@@ -344,12 +2471,39 @@ void sched_join_workers( void ) {
   //ensures there are no remainder async messages when the app closes
   sched_no_async_msg();
 
+  /* stop the offload, i/o reactor and timer threads */
+  sched_offload_stop();
+  sched_reactor_stop();
+  pthread_mutex_lock( &mutex_timers );
+  i = timerrunning;
+  timerexit = TRUE;
+  if ( i ) {
+    pthread_cond_signal( &cond_timers );
+  }
+  pthread_mutex_unlock( &mutex_timers );
+  if ( i ) {
+    pthread_join( timerthread, NULL );
+  }
+
+  /* stop the autoscaler, so it does not create workers anymore */
+  pthread_mutex_lock( &mutex_sched );
+  i = monitorrunning;
+  pthread_mutex_unlock( &mutex_sched );
+  if ( i ) {
+    pthread_mutex_lock( &mutex_monitor );
+    monitorexit = TRUE;
+    pthread_cond_signal( &cond_monitor );
+    pthread_mutex_unlock( &mutex_monitor );
+    pthread_join( monitor, NULL );
+  }
+
   /* initialize new state and create table to copy worker ids */
   lua_newtable( L );
   lua_setglobal( L, wtb );
   lua_getglobal( L, wtb );
 
   pthread_mutex_lock( &mutex_sched );
+  joiningworkers = TRUE;
 
   /* determine remaining active worker threads and copy their ids */
   lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
@@ -365,11 +2519,12 @@ void sched_join_workers( void ) {
   /* pop workers copy table name from stack */
   lua_pop( L, 1 );
 
-  /* set all workers to be destroyed */
-  destroyworkers = workerscount;
-
-  /* wake workers up */
-  pthread_cond_signal( &cond_wakeup_worker );
+  /* set all workers of all pools to be destroyed and wake them up */
+  for ( i = 0; i < poolcount; i++ ) {
+    __atomic_store_n( &pools[ i ].destroyworkers, pools[ i ].workerscount,
+                      __ATOMIC_SEQ_CST );
+    ec_notify( &pools[ i ].ec, INT_MAX );
+  }
   pthread_mutex_unlock( &mutex_sched );
 
   /* join with worker threads (read ids from local table copy ) */
@@ -392,18 +2547,59 @@ void sched_wait( void ) {
 
   /* wait until there are no more active lua processes */
   pthread_mutex_lock( &mutex_lp_count );
-  if( lpcount != 0 ) {
+  while ( __atomic_load_n( &lpcount, __ATOMIC_SEQ_CST ) != 0 ) {
     pthread_cond_wait( &cond_no_active_lp, &mutex_lp_count );
   }
   pthread_mutex_unlock( &mutex_lp_count );
 
 }
 
+/* wait until there are no more active lua processes, running ready lua
+   processes of the default pool on the calling thread meanwhile. */
+void sched_wait_help( void ) {
+
+  worker *self = NULL;
+  luaproc *lp;
+
+  /* borrow a worker slot, unless called from a worker thread */
+  pthread_mutex_lock( &mutex_sched );
+  if ( pthread_getspecific( key_worker ) == NULL ) {
+    self = sched_worker_slot( &pools[ 0 ] );
+  }
+  if ( self != NULL ) {
+    self->helper = TRUE;
+    self->active = TRUE;
+  }
+  pthread_mutex_unlock( &mutex_sched );
+  if ( self == NULL ) {
+    sched_wait();
+    return;
+  }
+
+  pthread_setspecific( key_worker, self );
+  __atomic_store_n( &helping, TRUE, __ATOMIC_SEQ_CST );
+  while ( __atomic_load_n( &lpcount, __ATOMIC_SEQ_CST ) > 0 ) {
+    lp = sched_next( self );
+    if ( lp == NULL ) {
+      sched_worker_park( self );
+      continue;
+    }
+    sched_run_proc( self, lp );
+  }
+  __atomic_store_n( &helping, FALSE, __ATOMIC_SEQ_CST );
+  pthread_setspecific( key_worker, NULL );
+
+  /* give the slot back */
+  pthread_mutex_lock( &mutex_sched );
+  sched_worker_release( self );
+  pthread_mutex_unlock( &mutex_sched );
+}
+
 /* blocks until there are no remainder async messages. */
 void sched_no_async_msg( void ) {
 	pthread_mutex_lock(&mutex_async_msg_count);
 	
-	if( async_msg != 0 ) {
+	if( __atomic_load_n( &async_msg, __ATOMIC_SEQ_CST ) != 0 ) {
 		pthread_cond_wait(&cond_no_remain_async_msg, &mutex_async_msg_count);
 	}
 	
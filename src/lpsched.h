@@ -15,6 +15,17 @@
 /* scheduler function return constants */
 #define	LUAPROC_SCHED_OK                 0
 #define LUAPROC_SCHED_PTHREAD_ERROR     -1
+#define LUAPROC_SCHED_POOL_ERROR        -2
+#define LUAPROC_SCHED_AFFINITY_ERROR    -3
+
+/************************
+ * ready queue backends *
+ ***********************/
+
+/* per-worker (locked) ready queues with work stealing */
+#define LUAPROC_SCHED_BACKEND_LIST       0
+/* single shared lock-free ready queue */
+#define LUAPROC_SCHED_BACKEND_MPMC       1
 
 /*************************************
  * default number of initial workers *
@@ -23,26 +34,182 @@
 /* scheduler default number of worker threads */
 #define LUAPROC_SCHED_DEFAULT_WORKER_THREADS 1
 
+/* maximum number of worker threads (in all pools) */
+#define LUAPROC_SCHED_MAX_WORKERS 256
+
+/****************
+ * worker pools *
+ ***************/
+
+/* name of the pool lua processes are assigned to by default */
+#define LUAPROC_SCHED_DEFAULT_POOL "default"
+
+/* maximum number of worker pools (including the default one) */
+#define LUAPROC_SCHED_MAX_POOLS 16
+
+/* maximum length of a worker pool name */
+#define LUAPROC_SCHED_POOL_NAME_MAX 31
+
+/*******************
+ * worker affinity *
+ ******************/
+
+/* workers run on any cpu */
+#define LUAPROC_SCHED_AFFINITY_NONE 0
+/* each worker is pinned to a cpu of its own */
+#define LUAPROC_SCHED_AFFINITY_AUTO 1
+/* workers are pinned to a given set of cpus */
+#define LUAPROC_SCHED_AFFINITY_SET  2
+
+/* maximum number of numa nodes */
+#define LUAPROC_SCHED_MAX_NODES 64
+
+/* memory allocation policy of a thread, saved by sched_numa_prefer */
+typedef struct stschedmempolicy {
+  int mode;
+  unsigned long nodes[ LUAPROC_SCHED_MAX_NODES / ( 8 * sizeof( long )) + 1 ];
+} schedmempolicy;
+
+/***************
+ * autoscaling *
+ **************/
+
+/* milliseconds between two samples of the autoscaler */
+#define LUAPROC_SCHED_SCALE_INTERVAL 10
+
+/* number of consecutive samples the ready queues must stay above the
+   threshold before a worker is added */
+#define LUAPROC_SCHED_SCALE_UP_SAMPLES 3
+
+/* default number of ready processes above which workers are added */
+#define LUAPROC_SCHED_SCALE_THRESHOLD 4
+
+/* default milliseconds a worker must be idle before it is retired */
+#define LUAPROC_SCHED_SCALE_COOLDOWN 1000
+
+/* autoscaling settings of a pool */
+typedef struct stschedscale {
+  int minworkers;  /* minimum number of workers */
+  int maxworkers;  /* maximum number of workers */
+  int threshold;   /* ready processes above which workers are added */
+  int cooldown;    /* milliseconds a worker must be idle before retiring */
+} schedscale;
+
+/*****************************
+ * ready queue tuning knobs *
+ ****************************/
+
+/* a worker checks the global ready queue before its local one once every
+   this many processes, so processes queued from outside workers do not
+   starve */
+#define LUAPROC_SCHED_GLOBAL_CHECK 61
+
+/* maximum number of processes a worker moves from the global ready queue to
+   its local one at once (list backend) */
+#define LUAPROC_SCHED_BATCH 32
+
+/* maximum number of consecutive processes a worker executes straight from its
+   'runnext' slot (processes woken by the process it was running) before it
+   goes back to its ready queue */
+#define LUAPROC_SCHED_RUNNEXT_MAX 16
+
+/* number of spin rounds a thief waits before stealing a 'runnext' slot */
+#define LUAPROC_SCHED_RUNNEXT_GRACE 256
+
+/* number of cells in each lock-free ready queue (one per priority, must be a
+   power of two); processes that do not fit are kept in the global ready
+   queue */
+#define LUAPROC_SCHED_MPMC_SIZE 16384
+
+/* number of times a worker may pass over a priority that has ready processes
+   (to serve a higher one) before that priority gets the next turn */
+#define LUAPROC_SCHED_AGING_LIMIT 8
+
+/* default maximum number of times an idle worker polls for work before
+   parking */
+#define LUAPROC_SCHED_SPIN_ROUNDS 128
+
+/* the adaptive spin budget of a worker never drops below this many rounds */
+#define LUAPROC_SCHED_SPIN_MIN 4
+
+/* maximum number of cpu pauses between two polls of a spinning worker */
+#define LUAPROC_SCHED_SPIN_BACKOFF_MAX 64
+
+/* initial capacity of the timer heap (it grows as needed) */
+#define LUAPROC_SCHED_TIMERS_INITIAL 1024
+
+/* initial number of file descriptor wait slots of the i/o reactor (it grows
+   as needed) */
+#define LUAPROC_SCHED_FDWAITS_INITIAL 256
+
+/* maximum number of events the i/o reactor handles per epoll wait */
+#define LUAPROC_SCHED_REACTOR_EVENTS 64
+
+/* number of threads that run blocking calls offloaded by lua processes */
+#define LUAPROC_SCHED_OFFLOAD_THREADS 4
+
+/* cache line size, used to keep hot shared counters apart */
+#define LUAPROC_SCHED_CACHE_LINE 64
+
+/**************
+ * statistics *
+ **************/
+
+/* scheduler counters */
+typedef struct stschedstats {
+  long preemptions;  /* processes preempted at the end of their time slice */
+  long scaleups;     /* workers added by the autoscaler */
+  long scaledowns;   /* workers retired by the autoscaler */
+  long spinwakes;    /* times a spinning idle worker found work (no park) */
+  long parks;        /* times an idle worker parked */
+} schedstats;
+
 /***********************
  * function prototypes *
  **********************/
 
-/* initialize scheduler */
-int sched_init( void );
+/* initialize scheduler with the given ready queue backend */
+int sched_init( int readyqueue );
 /* join workers */
 void sched_join_workers( void );
 /* wait until there are no more active lua processes */
 void sched_wait( void );
+/* wait until there are no more active lua processes, running ready processes
+   of the default pool on the calling thread meanwhile */
+void sched_wait_help( void );
 /* move process to ready queue (ie, schedule process) */
 void sched_queue_proc( luaproc *lp );
 /* increase active luaproc count */
 void sched_inc_lpcount( void );
 /* increase active luaproc count */
 void sched_dec_lpcount( void );
-/* set number of active workers (creates and destroys accordingly) */
-int sched_set_numworkers( int numworkers );
-/* return the number of active workers */
-int sched_get_numworkers( void );
+/* set number of active workers of a pool (creates and destroys accordingly) */
+int sched_set_numworkers( int poolid, int numworkers );
+/* return the number of active workers of a pool */
+int sched_get_numworkers( int poolid );
+/* create a named worker pool; return its id */
+int sched_new_pool( const char *name, int numworkers );
+/* return the id of a worker pool given its name (or -1) */
+int sched_find_pool( const char *name );
+/* enable (or disable, if 'scale' is null) autoscaling of a pool */
+int sched_set_autoscale( int poolid, const schedscale *scale );
+/* set the cpu affinity (LUAPROC_SCHED_AFFINITY_*) of the workers of a pool */
+int sched_set_affinity( int poolid, int affinity, const int *cpus, int n );
+/* prefer the numa node of a pool's workers for new allocations of the
+   calling thread, saving its previous memory allocation policy */
+int sched_numa_prefer( int poolid, schedmempolicy *saved );
+/* restore the memory allocation policy saved by sched_numa_prefer */
+void sched_numa_restore( const schedmempolicy *saved );
+/* get scheduler statistics */
+void sched_get_stats( schedstats *stats );
+/* set the maximum number of rounds idle workers spin before parking */
+void sched_set_spin( int rounds );
+/* return the deadline (monotonic nanoseconds) a number of ms from now */
+long long sched_deadline( long long ms );
+/* set the timeout (a deadline) of a lua process waiting on a locked channel */
+int sched_set_timeout( luaproc *lp, long long deadline );
+/* cancel the timeout of a lua process no longer waiting on a channel */
+void sched_cancel_timeout( luaproc *lp );
 
 //enqueues more than one lua process at the time in the ready list
 void sched_queue_list_proc( list *l );
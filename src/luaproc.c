@@ -11,7 +11,18 @@
 
 #include <unistd.h> /* close */
 #include <string.h> /* memset */
+#include <limits.h> /* INT_MAX */
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h> /* sched_yield */
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "luaproc.h"
 #include "lpsched.h"
@@ -19,8 +30,14 @@
 
 #define FALSE 0
 #define TRUE  !FALSE
-#define LUAPROC_CHANNELS_TABLE "channeltb"
+#define LUAPROC_CHANNEL_SHARDS 64
+#define LUAPROC_CHANNEL_BUCKETS 16
+#define LUAPROC_CHANNEL_MT "LUAPROC_CHANNEL_MT"
 #define LUAPROC_RECYCLE_MAX 0
+#define LUAPROC_QUANTUM_DEFAULT 0
+
+//environment variable choosing the scheduler's ready queue backend ("list" or "mpmc")
+#define LUAPROC_READY_QUEUE_ENV "LUAPROC_READY_QUEUE"
 
 //name of the blocking userdata metatable
 #define LUAPROC_DENIED_MTUDATA "denied_mtudata"
@@ -34,6 +51,50 @@
 //max number of nesting levels that a table may have in message exchange
 #define MAX_NESTING_LEVELS 250
 
+//times the main state checks whether its channel operation was completed before going to sleep
+#define LUAPROC_MAIN_SPIN_ROUNDS 1000
+
+//registry field of the main state holding the names of the channels it polls
+#define LUAPROC_SUBSCRIPTIONS_TABLE "LUAPROC_SUBSCRIPTIONS"
+
+//smallest number of slots of the message queue of an async channel
+#define LUAPROC_MSGQUEUE_MIN 8
+
+//number of slots of the lock-free queue of an async channel declared with a topology, unless bounded in messages
+#define LUAPROC_LFQUEUE_SIZE 1024
+
+//topologies of the lock-free async channels (senders and receivers they may have)
+#define LUAPROC_TOPOLOGY_SPSC 1  /* single producer, single consumer */
+#define LUAPROC_TOPOLOGY_MPSC 2  /* multiple producers, single consumer */
+#define LUAPROC_TOPOLOGY_MPMC 3  /* multiple producers, multiple consumers */
+
+//message count of a destroyed lock-free async channel
+#define LUAPROC_LFQUEUE_DESTROYED UINT_MAX
+
+//results of reserving room in a lock-free async channel
+#define LUAPROC_LFQUEUE_OK    0
+#define LUAPROC_LFQUEUE_FULL  1
+#define LUAPROC_LFQUEUE_GONE  2  /* the channel was destroyed */
+
+//tags of the values encoded in an async message
+#define LUAPROC_MSG_NIL       0
+#define LUAPROC_MSG_FALSE     1
+#define LUAPROC_MSG_TRUE      2
+#define LUAPROC_MSG_INTEGER   3
+#define LUAPROC_MSG_NUMBER    4
+#define LUAPROC_MSG_STRING    5
+#define LUAPROC_MSG_TABLE     6  /* followed by its keys and values, up to an end tag */
+#define LUAPROC_MSG_END       7
+#define LUAPROC_MSG_FUNCTION  8  /* followed by its binary code and its upvalues */
+#define LUAPROC_MSG_FUNCREF   9  /* a lua function met before in the message */
+#define LUAPROC_MSG_GLOBALS  10  /* the global table of the receiver */
+#define LUAPROC_MSG_CHANNEL  11  /* a channel handle */
+
+//results of encoding a value of an async message
+#define LUAPROC_MSG_OK        0
+#define LUAPROC_MSG_ERROR    -1
+#define LUAPROC_MSG_FALLBACK  1  /* the message must be kept in a container Lua state */
+
 #if (LUA_VERSION_NUM == 501)
 
 #define lua_rawlen(L, index)	lua_objlen(L, index)
@@ -96,7 +157,7 @@
  * global variables *
  *******************/
 
-/* channel list mutex */
+/* free channel list mutex */
 static pthread_mutex_t mutex_channel_list = PTHREAD_MUTEX_INITIALIZER;
 
 /* recycle list mutex */
@@ -108,18 +169,79 @@ static list recycle_list;
 /* maximum lua processes to recycle */
 static int recyclemax = LUAPROC_RECYCLE_MAX;
 
-/* lua_State used to store channel hash table */
-static lua_State *chanls = NULL;
+/* default time slice of new lua processes, in VM instructions (0: none) */
+static int defaultquantum = LUAPROC_QUANTUM_DEFAULT;
+
+/* bucket array of a channel directory shard. lookups read it without locks,
+   so a shard that grows keeps its old arrays until luaproc exits */
+typedef struct stchantable {
+  unsigned int mask;              /* number of buckets - 1 */
+  struct stchantable *retired;    /* array this one replaced */
+  channel *buckets[ 1 ];
+} chantable;
+
+/* channel directory shard; channels are spread over the shards by the hash
+   of their names */
+typedef struct stchanshard {
+  pthread_mutex_t mutex;  /* serializes channel creation and destruction */
+  chantable *table;       /* current bucket array (or null) */
+  int count;              /* number of channels in the shard */
+} chanshard;
+
+/* channel directory */
+static chanshard chanshards[ LUAPROC_CHANNEL_SHARDS ];
+
+/* name of a channel the main state subscribed to */
+typedef struct stsubscription {
+  char *name;
+  struct stsubscription *next;
+} subscription;
+
+/* names of the channels the main state subscribed to (see luaproc.subscribe).
+   subscriptions are kept by name, so a channel destroyed and created again
+   starts subscribed. a name is added holding the lock of its directory
+   shard, so a channel being created at the same time either sees it or is
+   found by the subscriber. */
+static subscription *subscriptions = NULL;
+
+/* subscribed channel names mutex */
+static pthread_mutex_t mutex_subscriptions = PTHREAD_MUTEX_INITIALIZER;
+
+/* destroyed channels whose last reference is gone. their memory is reused
+   for new channels and never freed while luaproc runs, so a lookup that
+   races with a destruction still reads a channel struct */
+static channel *chanfree = NULL;
 
 /* lua process used to wrap main state. allows main state to be queued in 
    channels when sending and receiving messages */
 static luaproc mainlp;
 
+/* wait of the main state on a channel. every blocking operation of the main
+   state gets a new number; the lua process (or timer) that completes it stores
+   that number in 'done', which is also the word the main state sleeps on */
+typedef struct stmainwait {
+  unsigned int op;    /* number of the current operation */
+  unsigned int done;  /* number of the last completed operation */
+  int sleeping;       /* is the main state sleeping (instead of polling)? */
+} mainwait;
+
+static mainwait mainwaiter;
+
+/* eventfd signaled when a message may be waiting for the main state on a
+   subscribed channel (or -1, if luaproc.pollfd was never called) */
+static int mainevfd = -1;
+
+/* has the eventfd been signaled since the main state last found no
+   messages in luaproc.poll? */
+static int mainpending = FALSE;
+
+#if !defined(__linux__)
 /* main state matched a send/recv operation conditional variable */
 pthread_cond_t cond_mainls_sendrecv = PTHREAD_COND_INITIALIZER;
 
 /* main state communication mutex */
 static pthread_mutex_t mutex_mainls = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 /* key of the table used for storing transferred C functions*/
@@ -134,6 +256,9 @@ static const char *recursive_counter = "recursive_counter";
 /* key of the table used for storing userdata metatables and their corresponding transfer functions*/
 static const char *transferable_udata = "transferable_udata";
 
+/* key of the table holding the userdata received from a container Lua state by a receive not yet completed */
+static const char *received_udata = "received_udata";
+
 
 /***********
  * enums *
@@ -162,11 +287,28 @@ static int luaproc_create_newproc( lua_State *L );
 static int luaproc_wait( lua_State *L );
 static int luaproc_send( lua_State *L );
 static int luaproc_receive( lua_State *L );
+static int luaproc_timedsend( lua_State *L );
+static int luaproc_trysend( lua_State *L );
 static int luaproc_create_channel( lua_State *L );
 static int luaproc_destroy_channel( lua_State *L );
+static int luaproc_find_channel( lua_State *L );
 static int luaproc_set_numworkers( lua_State *L );
 static int luaproc_get_numworkers( lua_State *L );
+static int luaproc_new_pool( lua_State *L );
+static int luaproc_set_affinity( lua_State *L );
+static int luaproc_autoscale( lua_State *L );
+static int luaproc_set_spin( lua_State *L );
+static int luaproc_sleep( lua_State *L );
+static int luaproc_waitfd( lua_State *L );
+static int luaproc_subscribe( lua_State *L );
+static int luaproc_unsubscribe( lua_State *L );
+static int luaproc_pollfd( lua_State *L );
+static int luaproc_poll( lua_State *L );
+static int luaproc_io_read( lua_State *L );
+static int luaproc_io_write( lua_State *L );
 static int luaproc_recycle_set( lua_State *L );
+static int luaproc_set_quantum( lua_State *L );
+static int luaproc_get_schedstats( lua_State *L );
 LUALIB_API int luaopen_luaproc( lua_State *L );
 static int luaproc_loadlib( lua_State *L ); 
 
@@ -201,6 +343,16 @@ struct stbarrier {
 	int num_elem;
 };
 
+/* blocking file operation, run off the workers */
+typedef struct stiojob {
+	int writing;       /* write (or read)? */
+	char *path;
+	char *data;        /* data to write or data read */
+	size_t len;        /* length of the data (read: (size_t)-1 for all) */
+	long long offset;  /* file offset (write: -1 to append) */
+	int err;           /* errno of a failed operation (0 if none) */
+} iojob;
+
 /* lua process */
 struct stluaproc {
 	lua_State *lstate;
@@ -208,15 +360,123 @@ struct stluaproc {
 	int args;
 	channel *chan;
 	luaproc *next;
+	luaproc *prev;
+	list *waitlist;   /* channel list the lua process waits in, if any */
+	int quantum;
+	int priority;
+	int pool;
+	long long deadline;
+	int timedwait;
+	int timer;
+	int fd;
+	int fdmode;
+	iojob *job;
+	struct stlfbind *lfbinds;  /* single sides of lock-free channels it is bound to */
 };
 
+/* message stored in an async channel. its values are encoded into a byte
+   buffer; values that cannot be encoded (userdata, c functions and tables
+   registered by c modules) make the whole message be kept instead on the
+   stack of a container lua state of its own */
+typedef struct stmessage {
+	char *data;          /* encoded values, following the struct (null if kept in a lua state) */
+	size_t len;          /* length of the encoded values */
+	lua_State *lstate;   /* container lua state holding the values, if any */
+	channel **handles;   /* channels of the channel handles in the message */
+	int nhandles;
+	size_t size;         /* memory taken by the message */
+} message;
+
+/* async message being encoded */
+typedef struct stmsgenc {
+	char *data;
+	size_t len;
+	size_t size;
+	channel **handles;
+	int nhandles;
+	const void **funcs;  /* lua functions encoded so far, in order */
+	int nfuncs;
+	char err[ 128 ];     /* error message of a failed encoding */
+} msgenc;
+
+/* async message being decoded */
+typedef struct stmsgdec {
+	const char *p;
+	message *msg;
+	int funcs;  /* stack index of the table of the lua functions decoded so far */
+	int nfuncs;
+	const char *err;
+} msgdec;
+
+/* fifo of the messages stored in an async channel (a growable ring buffer) */
+typedef struct stmsgqueue {
+	message **slots;
+	unsigned int head;      /* slot of the oldest message */
+	unsigned int count;     /* number of messages */
+	unsigned int cap;       /* number of slots (a power of two, or 0) */
+	unsigned int reserved;  /* messages being encoded by their senders */
+	size_t bytes;           /* memory taken by the messages */
+} msgqueue;
+
+/* slot of the lock-free queue of an async channel */
+typedef struct stlfcell {
+	size_t seq;    /* sequence number telling whether the slot is full */
+	message *msg;
+} lfcell;
+
+/* bounded lock-free fifo of the messages stored in an async channel declared
+   with a topology (after Dmitry Vyukov's array based queue, like the ready
+   queue of the scheduler). a side declared single moves its position with a
+   plain store instead of a compare-and-swap. the channel's lock is only taken
+   to park and wake the lua processes waiting on the channel. */
+typedef struct stlfqueue {
+	lfcell *cells;
+	size_t mask;
+	int topology;
+	lua_State *sender;    /* the single sender its topology declares, from its first send until it ends (null otherwise) */
+	lua_State *receiver;  /* the single receiver its topology declares, from its first receive until it ends (null otherwise) */
+	char pad0[ LUAPROC_SCHED_CACHE_LINE ];
+	size_t enqpos;
+	char pad1[ LUAPROC_SCHED_CACHE_LINE ];
+	size_t deqpos;
+	char pad2[ LUAPROC_SCHED_CACHE_LINE ];
+	unsigned int count;  /* messages stored or being stored (LUAPROC_LFQUEUE_DESTROYED once destroyed) */
+	size_t bytes;        /* memory taken by the stored messages */
+	int recvwait;        /* receivers waiting (or about to wait) in the channel */
+	int sendwait;        /* senders waiting (or about to wait) for room */
+	char pad3[ LUAPROC_SCHED_CACHE_LINE ];
+} lfqueue;
+
+/* single side of a lock-free async channel a lua process is bound to, let go
+   of when the process ends */
+typedef struct stlfbind {
+	channel *chan;           /* channel, kept by a reference of its own */
+	lua_State *lstate;       /* lua state bound to the side */
+	int recv;                /* is it the receiving side? */
+	struct stlfbind *next;
+} lfbind;
+
+/* settings of a new lua process, optionally given to newproc as a table */
+typedef struct stprocopts {
+	int quantum;
+	int priority;
+	int pool;
+} procopts;
+
 /* communication channel */
 struct stchannel {
 	//indicates the channel's type (0: sync, 1: async)
 	int type;
 	
-	//in async channels, it stores the container Lua state
-	lua_State *lstate;
+	//in async channels, the queue of messages in transit
+	msgqueue msgs;
+	
+	//in async channels declared with a topology, the lock-free queue used instead (null otherwise)
+	lfqueue *lfq;
+	
+	//in async channels, the most messages and bytes it may store (0 if unbounded)
+	int maxmsgs;
+	size_t maxbytes;
 	
 	list send;
 	list recv;
@@ -224,8 +484,21 @@ struct stchannel {
 	//stores the structure defined for handling barrier operation, in case such an operation to be performed on this channel
 	struct stbarrier *barrier;
 	
+	//indicates whether the main state polls this channel (see luaproc.subscribe)
+	int subscribed;
+	
+	//number of references to this channel: one from the channel directory, plus one per operation in progress
+	int refs;
+	
+	//channel's name, hash of its name and next channel in its directory bucket
+	char *name;
+	unsigned long long hash;
+	channel *dirnext;
+	
+	//indicates whether the channel was destroyed (operations still holding it must give it up)
+	int destroyed;
+	
 	pthread_mutex_t mutex;
-	pthread_cond_t can_be_used;
 };
 
 
@@ -239,11 +512,26 @@ static const struct luaL_Reg luaproc_funcs[] = {
 	{ "wait", luaproc_wait },
 	{ "send", luaproc_send },
 	{ "receive", luaproc_receive },
+	{ "timedsend", luaproc_timedsend },
+	{ "trysend", luaproc_trysend },
 	{ "newchannel", luaproc_create_channel },
 	{ "delchannel", luaproc_destroy_channel },
+	{ "getchannel", luaproc_find_channel },
 	{ "setnumworkers", luaproc_set_numworkers },
 	{ "getnumworkers", luaproc_get_numworkers },
+	{ "newpool", luaproc_new_pool },
+	{ "setaffinity", luaproc_set_affinity },
+	{ "autoscale", luaproc_autoscale },
+	{ "setspin", luaproc_set_spin },
+	{ "sleep", luaproc_sleep },
+	{ "waitfd", luaproc_waitfd },
+	{ "subscribe", luaproc_subscribe },
+	{ "unsubscribe", luaproc_unsubscribe },
+	{ "pollfd", luaproc_pollfd },
+	{ "poll", luaproc_poll },
 	{ "recycle", luaproc_recycle_set },
+	{ "setquantum", luaproc_set_quantum },
+	{ "getschedstats", luaproc_get_schedstats },
 
 	{"regudata", luaproc_regudata},
 	{"barrier", luaproc_barrier},
@@ -251,6 +539,14 @@ static const struct luaL_Reg luaproc_funcs[] = {
 	{ NULL, NULL }
 };
 
+/* luaproc.io function registration array: blocking file operations run off
+   the workers */
+static const struct luaL_Reg luaproc_io_funcs[] = {
+	{ "read", luaproc_io_read },
+	{ "write", luaproc_io_write },
+	{ NULL, NULL }
+};
+
 /******************
  * list functions *
  ******************/
@@ -259,8 +555,10 @@ static const struct luaL_Reg luaproc_funcs[] = {
 void list_insert( list *l, luaproc *lp ) {
   if ( l->head == NULL ) {
     l->head = lp;
+    lp->prev = NULL;
   } else {
     l->tail->next = lp;
+    lp->prev = l->tail;
   }
   l->tail = lp;
   lp->next = NULL;
@@ -271,8 +569,10 @@ void list_insert( list *l, luaproc *lp ) {
 void list_join(list *left, list *right) {
   if ( left->head == NULL ) {
     left->head = right->head;
+    right->head->prev = NULL;
   } else {
     left->tail->next = right->head;
+    right->head->prev = left->tail;
   }
   left->tail = right->tail;
   right->tail->next = NULL;
@@ -284,6 +584,9 @@ luaproc *list_remove( list *l ) {
   if ( l->head != NULL ) {
     luaproc *lp = l->head;
     l->head = lp->next;
+    if ( l->head != NULL ) {
+      l->head->prev = NULL;
+    }
     l->nodes--;
     return lp;
   } else {
@@ -303,118 +606,809 @@ void list_init( list *l ) {
   l->nodes = 0;
 }
 
+/* remove a given lua process from the (fifo) list it is in */
+static void list_unlink( list *l, luaproc *lp ) {
+  if ( lp->prev == NULL ) {
+    l->head = lp->next;
+  } else {
+    lp->prev->next = lp->next;
+  }
+  if ( lp->next == NULL ) {
+    l->tail = lp->prev;
+  } else {
+    lp->next->prev = lp->prev;
+  }
+  l->nodes--;
+}
+
+/***************************
+ * message queue functions *
+ ***************************/
+
+/* initialize an empty message queue */
+static void msgqueue_init( msgqueue *q ) {
+  q->slots = NULL;
+  q->head = 0;
+  q->count = 0;
+  q->cap = 0;
+  q->reserved = 0;
+  q->bytes = 0;
+}
+
+/* release the slots of a message queue */
+static void msgqueue_free( msgqueue *q ) {
+  free( q->slots );
+  msgqueue_init( q );
+}
+
+/* move the messages of a queue to a new array of slots, oldest first */
+static int msgqueue_resize( msgqueue *q, unsigned int cap ) {
+
+  unsigned int i;
+  message **slots = (message **)malloc( cap * sizeof( message * ));
+
+  if ( slots == NULL ) {
+    return FALSE;
+  }
+  for ( i = 0; i < q->count; i++ ) {
+    slots[ i ] = q->slots[ ( q->head + i ) & ( q->cap - 1 ) ];
+  }
+  free( q->slots );
+  q->slots = slots;
+  q->head = 0;
+  q->cap = cap;
+  return TRUE;
+}
+
+/* append a message to a queue, growing it if full. returns FALSE if out of
+   memory */
+static int msgqueue_push( msgqueue *q, message *msg ) {
+
+  if (( q->count == q->cap ) &&
+      ( !msgqueue_resize( q, ( q->cap > 0 ) ? q->cap * 2 : LUAPROC_MSGQUEUE_MIN ))) {
+    return FALSE;
+  }
+  q->slots[ ( q->head + q->count ) & ( q->cap - 1 ) ] = msg;
+  q->count++;
+  q->bytes += msg->size;
+  return TRUE;
+}
+
+/* return the oldest message of a queue (null if empty) */
+static message *msgqueue_peek( msgqueue *q ) {
+  return ( q->count > 0 ) ? q->slots[ q->head ] : NULL;
+}
+
+/* remove the oldest message of a non-empty queue, shrinking it once mostly
+   empty */
+static void msgqueue_pop( msgqueue *q ) {
+  q->bytes -= q->slots[ q->head ]->size;
+  q->head = ( q->head + 1 ) & ( q->cap - 1 );
+  q->count--;
+  if (( q->cap > LUAPROC_MSGQUEUE_MIN ) && ( q->count <= q->cap / 4 )) {
+    /* if there is no memory to shrink it, the queue just keeps its slots */
+    msgqueue_resize( q, q->cap / 2 );
+  }
+}
+
+/*************************************
+ * lock-free message queue functions *
+ *************************************/
+
+/* create an empty lock-free queue of a topology with (a power of two) number
+   of slots (if out of memory, return null) */
+static lfqueue *lfqueue_new( int topology, size_t size ) {
+
+  size_t i;
+  lfqueue *q = (lfqueue *)calloc( 1, sizeof( lfqueue ));
+
+  if ( q == NULL ) {
+    return NULL;
+  }
+  q->cells = (lfcell *)malloc( size * sizeof( lfcell ));
+  if ( q->cells == NULL ) {
+    free( q );
+    return NULL;
+  }
+  for ( i = 0; i < size; i++ ) {
+    q->cells[ i ].seq = i;
+    q->cells[ i ].msg = NULL;
+  }
+  q->mask = size - 1;
+  q->topology = topology;
+
+  return q;
+}
+
+/* release a lock-free queue (its messages must be released before) */
+static void lfqueue_free( lfqueue *q ) {
+  free( q->cells );
+  free( q );
+}
+
+/* append a message to a lock-free queue. the sender must have reserved room
+   for it, so a slot is free or about to be freed by a receiver */
+static void lfqueue_push( lfqueue *q, message *msg ) {
+
+  lfcell *cell;
+  size_t pos = __atomic_load_n( &q->enqpos, __ATOMIC_RELAXED );
+  long dif;
+
+  while ( TRUE ) {
+    cell = &q->cells[ pos & q->mask ];
+    dif = (long)__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) - (long)pos;
+    if ( dif == 0 ) {
+      if ( q->topology == LUAPROC_TOPOLOGY_SPSC ) {
+        __atomic_store_n( &q->enqpos, pos + 1, __ATOMIC_RELAXED );
+        break;
+      }
+      if ( __atomic_compare_exchange_n( &q->enqpos, &pos, pos + 1, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+        break;
+      }
+    } else {
+      if ( dif < 0 ) {
+        sched_yield();  /* a receiver is still releasing the slot */
+      }
+      pos = __atomic_load_n( &q->enqpos, __ATOMIC_RELAXED );
+    }
+  }
+  cell->msg = msg;
+  __atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+}
+
+/* return the oldest message of a lock-free queue with a single consumer,
+   without removing it (null if empty) */
+static message *lfqueue_peek( lfqueue *q ) {
+
+  size_t pos = __atomic_load_n( &q->deqpos, __ATOMIC_RELAXED );
+  lfcell *cell = &q->cells[ pos & q->mask ];
+
+  if ( __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) != pos + 1 ) {
+    return NULL;
+  }
+  return cell->msg;
+}
+
+/* remove and return the oldest message of a lock-free queue (if the queue is
+   empty, return null) */
+static message *lfqueue_pop( lfqueue *q ) {
+
+  lfcell *cell;
+  message *msg;
+  size_t pos = __atomic_load_n( &q->deqpos, __ATOMIC_RELAXED );
+  long dif;
+
+  while ( TRUE ) {
+    cell = &q->cells[ pos & q->mask ];
+    dif = (long)__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) -
+          (long)( pos + 1 );
+    if ( dif == 0 ) {
+      if ( q->topology != LUAPROC_TOPOLOGY_MPMC ) {
+        __atomic_store_n( &q->deqpos, pos + 1, __ATOMIC_RELAXED );
+        break;
+      }
+      if ( __atomic_compare_exchange_n( &q->deqpos, &pos, pos + 1, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+        break;
+      }
+    } else if ( dif < 0 ) {
+      return NULL;  /* queue is empty */
+    } else {
+      pos = __atomic_load_n( &q->deqpos, __ATOMIC_RELAXED );
+    }
+  }
+  msg = cell->msg;
+  __atomic_store_n( &cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE );
+
+  return msg;
+}
+
 /*********************
  * channel functions *
  *********************/
 
-/* create a new channel (sync or async) and insert it into channels table */
-static channel *channel_create( const char *cname, int type_ch) {
+/* hash a channel name (fnv-1a) */
+static unsigned long long channel_hash( const char *chname ) {
 
-	channel *chan;
+  unsigned long long h = 14695981039346656037ULL;
 
-	/* get exclusive access to channels list */
-	pthread_mutex_lock( &mutex_channel_list );
+  while ( *chname != '\0' ) {
+    h ^= (unsigned char)*chname++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* return the directory shard of a channel name hash */
+static chanshard *channel_shard( unsigned long long hash ) {
+  return &chanshards[ hash % LUAPROC_CHANNEL_SHARDS ];
+}
+
+/* return the bucket of a channel name hash in a shard's bucket array */
+static channel **channel_bucket( chantable *t, unsigned long long hash ) {
+  return &t->buckets[ ( hash / LUAPROC_CHANNEL_SHARDS ) & t->mask ];
+}
+
+/*
+   return a channel of a shard (if not found, return null). caller must lock
+   the shard.
+ */
+static channel *channel_unlocked_get( chanshard *sh, const char *chname,
+                                      unsigned long long hash ) {
+
+  channel *chan;
+
+  if ( sh->table == NULL ) {
+    return NULL;
+  }
+  for ( chan = *channel_bucket( sh->table, hash ); chan != NULL;
+        chan = chan->dirnext ) {
+    if (( chan->hash == hash ) && ( strcmp( chan->name, chname ) == 0 )) {
+      return chan;
+    }
+  }
+  return NULL;
+}
+
+/* double the number of buckets of a shard. caller must lock the shard. */
+static void channel_grow( chanshard *sh ) {
+
+  unsigned int i, n = ( sh->table == NULL ) ?
+                      LUAPROC_CHANNEL_BUCKETS : 2 * ( sh->table->mask + 1 );
+  chantable *t = (chantable *)calloc( 1, sizeof( chantable ) +
+                                         ( n - 1 ) * sizeof( channel * ));
+  channel *chan, *next, **bucket;
+
+  if ( t == NULL ) {
+    return;  /* keep the current buckets; lookups just get slower */
+  }
+  t->mask = n - 1;
+  t->retired = sh->table;
+  /* channels are moved between chains, so a lookup running meanwhile may
+     miss a channel; it then looks again holding the shard's lock */
+  if ( sh->table != NULL ) {
+    for ( i = 0; i <= sh->table->mask; i++ ) {
+      for ( chan = sh->table->buckets[ i ]; chan != NULL; chan = next ) {
+        next = chan->dirnext;
+        bucket = channel_bucket( t, chan->hash );
+        __atomic_store_n( &chan->dirnext, *bucket, __ATOMIC_RELEASE );
+        *bucket = chan;
+      }
+    }
+  }
+  __atomic_store_n( &sh->table, t, __ATOMIC_RELEASE );
+}
+
+/* return the link to a subscribed channel name (pointing to null if the
+   name is not subscribed). caller must lock 'mutex_subscriptions' */
+static subscription **channel_subscription( const char *cname ) {
+
+	subscription **link;
+
+	for ( link = &subscriptions; *link != NULL; link = &(*link)->next ) {
+		if ( strcmp( (*link)->name, cname ) == 0 ) {
+			break;
+		}
+	}
+	return link;
+}
+
+/* create a new channel (sync or async, the latter bounded to a number of
+   messages and bytes, or unbounded if 0, and storing its messages in a
+   lock-free queue, if given one) and insert it into the channel directory.
+   return it with a reference taken for the caller, or null if a channel with
+   the same name already exists ('exists' is then set to true) or if there is
+   not enough memory. */
+static channel *channel_create( const char *cname, int type_ch, int maxmsgs,
+                                size_t maxbytes, lfqueue *lfq, int *exists ) {
+
+	channel *chan, **bucket;
+	char *name;
+	unsigned long long hash = channel_hash( cname );
+	chanshard *sh = channel_shard( hash );
+
+	pthread_mutex_lock( &sh->mutex );
+	*exists = ( channel_unlocked_get( sh, cname, hash ) != NULL );
+	if ( *exists ) {
+		pthread_mutex_unlock( &sh->mutex );
+		return NULL;
+	}
 
-	/* create new channel and register its name */
-	lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-	chan = (channel *)lua_newuserdata( chanls, sizeof( channel ));
-	lua_setfield( chanls, -2, cname );
-	lua_pop( chanls, 1 );  /* remove channel table from stack */
+	/* make room for its name in the directory */
+	if (( sh->table == NULL ) || ( sh->count > 2 * (int)sh->table->mask )) {
+		channel_grow( sh );
+	}
+	name = strdup( cname );
+	if (( sh->table == NULL ) || ( name == NULL )) {
+		pthread_mutex_unlock( &sh->mutex );
+		free( name );
+		return NULL;
+	}
+
+	/* reuse the memory of a destroyed channel, if there is any */
+	pthread_mutex_lock( &mutex_channel_list );
+	chan = chanfree;
+	if ( chan != NULL ) {
+		chanfree = chan->dirnext;
+	}
+	pthread_mutex_unlock( &mutex_channel_list );
+	if ( chan == NULL ) {
+		chan = (channel *)malloc( sizeof( channel ));
+		if ( chan == NULL ) {
+			pthread_mutex_unlock( &sh->mutex );
+			free( name );
+			return NULL;
+		}
+		chan->refs = 0;
+		pthread_mutex_init( &chan->mutex, NULL );
+	}
 
 	/* initialize channel struct */
 	
 	//establishing the channel's type ("type_ch" may be: 0 - sync or 1 - async)
 	chan->type = type_ch;
 	
-	//initializes a queue for storing Lua processes sending message, for sync channels
-	if(!type_ch){
-		list_init( &chan->send );
-	}
-	else{
-		//for async channels, create a container Lua state
-		chan->lstate = luaL_newstate();
+	//initializes a queue for storing Lua processes sending message (async channels use it once full)
+	list_init( &chan->send );
+	
+	if(type_ch){
+		//for async channels, create an empty message queue
+		msgqueue_init( &chan->msgs );
+		chan->maxmsgs = maxmsgs;
+		chan->maxbytes = maxbytes;
 	}
+	chan->lfq = lfq;
 	
 	list_init( &chan->recv );
 
 	//this pointer stores a structure only when the barrier operation is being performed
 	chan->barrier = NULL;
 	
-	pthread_mutex_init( &chan->mutex, NULL );
-	pthread_cond_init( &chan->can_be_used, NULL );
+	pthread_mutex_lock( &mutex_subscriptions );
+	chan->subscribed = ( *channel_subscription( cname ) != NULL );
+	pthread_mutex_unlock( &mutex_subscriptions );
+	chan->destroyed = FALSE;
+	chan->name = name;
+	__atomic_store_n( &chan->hash, hash, __ATOMIC_RELAXED );
+	
+	//the references of the channel directory and the caller; lookups may take references from now on
+	__atomic_store_n( &chan->refs, 2, __ATOMIC_RELEASE );
 
-	/* release exclusive access to channels list */
-	pthread_mutex_unlock( &mutex_channel_list );
+	/* register its name */
+	bucket = channel_bucket( sh->table, hash );
+	__atomic_store_n( &chan->dirnext, *bucket, __ATOMIC_RELEASE );
+	__atomic_store_n( bucket, chan, __ATOMIC_RELEASE );
+	sh->count++;
+
+	pthread_mutex_unlock( &sh->mutex );
 
 	return chan;
 }
 
+/* remove a channel from the channel directory */
+static void channel_unregister( channel *chan ) {
+
+	channel **link;
+	chanshard *sh = channel_shard( chan->hash );
+
+	pthread_mutex_lock( &sh->mutex );
+	for ( link = channel_bucket( sh->table, chan->hash ); *link != NULL;
+	      link = &(*link)->dirnext ) {
+		if ( *link == chan ) {
+			/* the channel keeps its next link, for lookups standing on it */
+			__atomic_store_n( link, chan->dirnext, __ATOMIC_RELEASE );
+			sh->count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &sh->mutex );
+}
+
+/* take a reference to a channel, which keeps its memory valid */
+static void channel_retain( channel *chan ) {
+  __atomic_add_fetch( &chan->refs, 1, __ATOMIC_RELAXED );
+}
+
+/* take a reference to a channel unless its last one is already gone */
+static int channel_tryretain( channel *chan ) {
+
+  int refs = __atomic_load_n( &chan->refs, __ATOMIC_RELAXED );
+
+  while ( refs > 0 ) {
+    if ( __atomic_compare_exchange_n( &chan->refs, &refs, refs + 1, TRUE,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED )) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* drop a reference to a channel, moving it to the free channels list when
+   the last one is gone */
+static void channel_release( channel *chan ) {
+  if ( __atomic_sub_fetch( &chan->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( chan->name );
+    chan->name = NULL;
+    /* lock-free receivers may look at the queue until they let the channel go */
+    if ( chan->lfq != NULL ) {
+      lfqueue_free( chan->lfq );
+      chan->lfq = NULL;
+    }
+    pthread_mutex_lock( &mutex_channel_list );
+    /* lookups still standing on the channel go on along the free list, find
+       nothing there and look again holding the shard's lock */
+    __atomic_store_n( &chan->dirnext, chanfree, __ATOMIC_RELEASE );
+    chanfree = chan;
+    pthread_mutex_unlock( &mutex_channel_list );
+  }
+}
+
+/* release a message of an async channel */
+static void message_free( message *msg ) {
+
+	int i;
+
+	if ( msg->lstate != NULL ) {
+		lua_close( msg->lstate );
+	}
+	for ( i = 0; i < msg->nhandles; i++ ) {
+		channel_release( msg->handles[ i ] );
+	}
+	free( msg->handles );
+	free( msg );  /* along with its encoded values */
+}
+
 /*
-   return a channel (if not found, return null).
-   caller function MUST lock 'mutex_channel_list' before calling this function.
+   return a channel with a reference taken (if not found, return null),
+   without locking the directory. the chains are walked comparing hashes
+   only; names are compared once a reference pins the channel. if nothing
+   is found, the lookup is repeated holding the shard's lock, since chains
+   may change under a lookup that does not hold it.
  */
-static channel *channel_unlocked_get( const char *chname ) {
+static channel *channel_lookup( const char *chname ) {
 
   channel *chan;
+  chantable *t;
+  unsigned long long hash = channel_hash( chname );
+  chanshard *sh = channel_shard( hash );
+
+  t = __atomic_load_n( &sh->table, __ATOMIC_ACQUIRE );
+  if ( t != NULL ) {
+    chan = __atomic_load_n( channel_bucket( t, hash ), __ATOMIC_ACQUIRE );
+    while ( chan != NULL ) {
+      if (( __atomic_load_n( &chan->hash, __ATOMIC_RELAXED ) == hash ) &&
+          ( channel_tryretain( chan ))) {
+        if (( chan->name != NULL ) && ( strcmp( chan->name, chname ) == 0 )) {
+          return chan;
+        }
+        channel_release( chan );
+        break;  /* the channel was reused meanwhile */
+      }
+      chan = __atomic_load_n( &chan->dirnext, __ATOMIC_ACQUIRE );
+    }
+  }
 
-  lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-  lua_getfield( chanls, -1, chname );
-  chan = (channel *)lua_touserdata( chanls, -1 );
-  lua_pop( chanls, 2 );  /* pop userdata and channel */
+  pthread_mutex_lock( &sh->mutex );
+  chan = channel_unlocked_get( sh, chname, hash );
+  if ( chan != NULL ) {
+    channel_retain( chan );
+  }
+  pthread_mutex_unlock( &sh->mutex );
 
   return chan;
 }
 
 /*
-   return a channel (if not found, return null) with its (mutex) lock set.
-   caller function should unlock channel's (mutex) lock after calling this
-   function.
+   set the lock of a channel the caller holds a reference to. if the channel
+   was destroyed (possibly while waiting for its lock), drop the reference and
+   return FALSE.
  */
-static channel *channel_locked_get( const char *chname ) {
+static int channel_lock( channel *chan ) {
 
-  channel *chan;
+  pthread_mutex_lock( &chan->mutex );
+  if ( chan->destroyed ) {
+    luaproc_unlock_channel( chan );
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* release the reference held by a channel handle */
+static int channel_handle_gc( lua_State *L ) {
+
+  channel **handle = (channel **)lua_touserdata( L, 1 );
+
+  if ( *handle != NULL ) {
+    channel_release( *handle );
+    *handle = NULL;
+  }
+  return 0;
+}
+
+/* return a string describing a channel handle */
+static int channel_handle_tostring( lua_State *L ) {
+  channel **handle = (channel **)lua_touserdata( L, 1 );
+  lua_pushfstring( L, "channel: %s", (*handle)->name );
+  return 1;
+}
+
+/* tell whether two channel handles refer to the same channel */
+static int channel_handle_eq( lua_State *L ) {
+  lua_pushboolean( L, *(channel **)lua_touserdata( L, 1 ) ==
+                      *(channel **)lua_touserdata( L, 2 ));
+  return 1;
+}
+
+/*
+   push a handle to a channel onto a lua state's stack. the handle holds a
+   reference to the channel, so operations on it skip the directory and it
+   stays valid (though the channel may be destroyed) while the handle lives.
+ */
+static void channel_pushhandle( lua_State *L, channel *chan ) {
+
+  channel **handle = (channel **)lua_newuserdata( L, sizeof( channel * ));
+
+  channel_retain( chan );
+  *handle = chan;
+  if ( luaL_newmetatable( L, LUAPROC_CHANNEL_MT )) {
+    lua_pushcfunction( L, channel_handle_gc );
+    lua_setfield( L, -2, "__gc" );
+    lua_pushcfunction( L, channel_handle_tostring );
+    lua_setfield( L, -2, "__tostring" );
+    lua_pushcfunction( L, channel_handle_eq );
+    lua_setfield( L, -2, "__eq" );
+  }
+  lua_setmetatable( L, -2 );
+}
+
+/* return the channel of the handle at a stack index (if the value is not a
+   channel handle, return null) */
+static channel *channel_tohandle( lua_State *L, int idx ) {
+
+  channel **handle = (channel **)lua_touserdata( L, idx );
+
+  if (( handle == NULL ) || ( lua_type( L, idx ) != LUA_TUSERDATA ) ||
+      ( !lua_getmetatable( L, idx ))) {
+    return NULL;
+  }
+  luaL_getmetatable( L, LUAPROC_CHANNEL_MT );
+  if ( !lua_rawequal( L, -1, -2 )) {
+    handle = NULL;
+  }
+  lua_pop( L, 2 );
+
+  return ( handle != NULL ) ? *handle : NULL;
+}
+
+/* return the name of the channel given, by name or handle, at a stack
+   index */
+static const char *channel_checkname( lua_State *L, int idx ) {
+
+  channel *chan = channel_tohandle( L, idx );
+
+  if ( chan != NULL ) {
+    return chan->name;
+  }
+  if ( lua_type( L, idx ) != LUA_TSTRING ) {
+    luaL_argerror( L, idx, "channel name or handle expected" );
+  }
+  return lua_tostring( L, idx );
+}
+
+/* return the channel given, by name or handle, at a stack index with a
+   reference taken (if not found, return null); handles skip the channel
+   directory */
+static channel *channel_arg( lua_State *L, int idx ) {
 
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
+  channel *chan = channel_tohandle( L, idx );
 
-  /*
-     try to get channel and lock it; if lock fails, release external
-     lock ('mutex_channel_list') to try again when signaled -- this avoids
-     keeping the external lock busy for too long. during the release,
-     the channel may be destroyed, so it must try to get it again.
-  */
-  while ((( chan = channel_unlocked_get( chname )) != NULL ) &&
-        ( pthread_mutex_trylock( &chan->mutex ) != 0 )) {
-    pthread_cond_wait( &chan->can_be_used, &mutex_channel_list );
+  if ( chan == NULL ) {
+    return channel_lookup( lua_tostring( L, idx ));
   }
 
-  /* release exclusive access to channels list */
-  pthread_mutex_unlock( &mutex_channel_list );
+  channel_retain( chan );
+  return chan;
+}
+
+/*
+   return the channel given, by name or handle, at a stack index (if not
+   found, return null) with its (mutex) lock set and a reference taken.
+   caller function should release both with luaproc_unlock_channel after
+   calling this function. no global lock is taken, so operations on
+   different channels do not wait for each other.
+ */
+static channel *channel_locked_arg( lua_State *L, int idx ) {
+
+  channel *chan = channel_arg( L, idx );
+
+  if (( chan == NULL ) || ( !channel_lock( chan ))) {
+    return NULL;
+  }
 
   return chan;
 }
 
+/* set the timeout of a lua process about to wait on a locked channel, in
+   milliseconds (negative for none) */
+static void channel_set_timeout( luaproc *lp, lua_Integer ms ) {
+  lp->timedwait = ( ms >= 0 );
+  if ( lp->timedwait ) {
+    lp->deadline = sched_deadline( ms );
+  }
+}
+
+/* start the timeout of a lua process just put in one of a locked channel's
+   lists (or null if it does not wait in a list). if it cannot be started,
+   the lua process waits without a timeout */
+static void channel_start_timeout( luaproc *lp, list *l ) {
+  lp->waitlist = l;
+  if (( lp->timedwait ) && ( sched_set_timeout( lp, lp->deadline ) != 0 )) {
+    lp->timedwait = FALSE;
+  }
+}
+
+/* stop the timeout of a lua process taken out of a locked channel's lists */
+static void channel_stop_timeout( luaproc *lp ) {
+  if ( lp->timedwait ) {
+    lp->timedwait = FALSE;
+    sched_cancel_timeout( lp );
+  }
+}
+
+/*
+   remove and return the first lua process waiting in a channel list (if
+   none, return null), stopping the timeout of its wait. caller must lock
+   the channel.
+ */
+static luaproc *channel_dequeue( list *l ) {
+
+  luaproc *lp = list_remove( l );
+
+  if ( lp != NULL ) {
+    channel_stop_timeout( lp );
+  }
+  return lp;
+}
+
+/*
+   complete the current channel operation of the main state, waking it up. the
+   caller must have taken the main state out of the channel (or barrier) it
+   was waiting in, so no other operation can be completed meanwhile.
+ */
+static void luaproc_wake_main( void ) {
+  __atomic_store_n( &mainwaiter.done,
+                    __atomic_load_n( &mainwaiter.op, __ATOMIC_SEQ_CST ),
+                    __ATOMIC_SEQ_CST );
+  /* the main state may still be polling; only a sleeping one needs a call */
+  if ( __atomic_load_n( &mainwaiter.sleeping, __ATOMIC_SEQ_CST )) {
+#if defined(__linux__)
+    syscall( SYS_futex, &mainwaiter.done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+             0 );
+#else
+    pthread_mutex_lock( &mutex_mainls );
+    pthread_cond_signal( &cond_mainls_sendrecv );
+    pthread_mutex_unlock( &mutex_mainls );
+#endif
+  }
+}
+
+/*
+   block the main state, already queued on a locked channel, until a lua
+   process (or the timeout of its wait) completes its operation. the channel
+   is unlocked by this function. the main state polls for a while before
+   sleeping, since the peer of a message exchange is usually running already.
+ */
+static int luaproc_main_wait( channel *chan ) {
+
+  int i;
+  unsigned int done;
+  unsigned int op = mainwaiter.op + 1;
+
+  /* start a new operation before any lua process can see the main state */
+  __atomic_store_n( &mainwaiter.op, op, __ATOMIC_SEQ_CST );
+  luaproc_unlock_channel( chan );
+
+  for ( i = 0; i < LUAPROC_MAIN_SPIN_ROUNDS; i++ ) {
+    if ( __atomic_load_n( &mainwaiter.done, __ATOMIC_ACQUIRE ) == op ) {
+      return mainlp.args;
+    }
+  }
+
+  __atomic_store_n( &mainwaiter.sleeping, TRUE, __ATOMIC_SEQ_CST );
+#if defined(__linux__)
+  while (( done = __atomic_load_n( &mainwaiter.done,
+                                   __ATOMIC_SEQ_CST )) != op ) {
+    syscall( SYS_futex, &mainwaiter.done, FUTEX_WAIT_PRIVATE, done, NULL,
+             NULL, 0 );
+  }
+#else
+  pthread_mutex_lock( &mutex_mainls );
+  while (( done = __atomic_load_n( &mainwaiter.done,
+                                   __ATOMIC_SEQ_CST )) != op ) {
+    pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
+  }
+  pthread_mutex_unlock( &mutex_mainls );
+#endif
+  __atomic_store_n( &mainwaiter.sleeping, FALSE, __ATOMIC_SEQ_CST );
+
+  return mainlp.args;
+}
+
+/* does a locked channel hold a message that can be received right away? */
+static int channel_has_message( channel *chan ) {
+
+  unsigned int n;
+
+  if ( chan->type == 0 ) {
+    return ( list_count( &chan->send ) > 0 );
+  }
+  if ( chan->lfq != NULL ) {
+    /* messages still being stored are counted too */
+    n = __atomic_load_n( &chan->lfq->count, __ATOMIC_ACQUIRE );
+    return (( n > 0 ) && ( n != LUAPROC_LFQUEUE_DESTROYED ));
+  }
+  return ( chan->msgs.count > 0 );
+}
+
+/* have the messages stored in a locked async channel reached its bound on
+   memory? the size of a message is only known once encoded, so senders check
+   this again before storing a message they encoded without holding the
+   channel */
+static int channel_bytes_full( channel *chan ) {
+  return (( chan->maxbytes > 0 ) && ( chan->msgs.count > 0 ) &&
+          ( chan->msgs.bytes >= chan->maxbytes ));
+}
+
+/* is a locked async channel full? messages being encoded by their senders
+   count as stored. an empty channel takes a message of any size, so a message
+   larger than the channel's bound still gets through */
+static int channel_is_full( channel *chan ) {
+  return ((( chan->maxmsgs > 0 ) &&
+           ( chan->msgs.count + chan->msgs.reserved >=
+             (unsigned int)chan->maxmsgs )) ||
+          channel_bytes_full( chan ));
+}
+
+/*
+   tell the event loop driving the main state, through its eventfd, that a
+   message may be waiting on a channel. only the first message after the main
+   state found no more messages signals the eventfd. senders of lock-free
+   channels call it without holding the channel's lock.
+ */
+static void luaproc_notify_main( channel *chan ) {
+#if defined(__linux__)
+  int fd = __atomic_load_n( &mainevfd, __ATOMIC_ACQUIRE );
+
+  if (( __atomic_load_n( &chan->subscribed, __ATOMIC_RELAXED )) && ( fd >= 0 ) &&
+      ( !__atomic_exchange_n( &mainpending, TRUE, __ATOMIC_SEQ_CST ))) {
+    eventfd_write( fd, 1 );
+  }
+#else
+  (void)chan;
+#endif
+}
+
 /********************************
  * exported auxiliary functions *
  ********************************/
 
-/* unlock access to a channel and signal it can be used */
+/* unlock access to a channel and drop the reference taken with its lock */
 void luaproc_unlock_channel( channel *chan ) {
 
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
   /* release exclusive access to operate on a particular channel */
   pthread_mutex_unlock( &chan->mutex );
-  /* signal that a particular channel can be used */
-  pthread_cond_signal( &chan->can_be_used );
-  /* release exclusive access to channels list */
-  pthread_mutex_unlock( &mutex_channel_list );
+  channel_release( chan );
 
 }
 
 /* insert lua process in recycle list */
 void luaproc_recycle_insert( luaproc *lp ) {
 
+  /* a recycled lua state must not keep the channel sides it was bound to */
+  luaproc_unbind_channels( lp );
+
   /* get exclusive access to recycled lua processes list */
   pthread_mutex_lock( &mutex_recycle_list );
 
@@ -434,15 +1428,79 @@ void luaproc_recycle_insert( luaproc *lp ) {
 /* queue a lua process that tried to send a message */
 void luaproc_queue_sender( luaproc *lp ) {
   list_insert( &lp->chan->send, lp );
+  channel_start_timeout( lp, &lp->chan->send );
+  luaproc_notify_main( lp->chan );
 }
 
 /* queue a lua process that tried to receive a message */
 void luaproc_queue_receiver( luaproc *lp ) {
   list_insert( &lp->chan->recv, lp );
+  channel_start_timeout( lp, &lp->chan->recv );
 }
 
-/********************************
- * internal auxiliary functions *
+/*
+   end the wait of a lua process on a channel whose timeout expired: take it
+   out of the channel and make the waiting call return nil and an error
+   message. the scheduler calls it while the lua process' timer is still
+   set, so the channel cannot be destroyed meanwhile (destroying it stops
+   the timer first); it must not block, though, as the scheduler holds its
+   timers lock.
+ */
+int luaproc_expire_wait( luaproc *lp, channel **busy ) {
+
+  channel *chan = lp->chan;
+  struct stbarrier *barrier;
+
+  if ( pthread_mutex_trylock( &chan->mutex ) != 0 ) {
+    channel_retain( chan );
+    *busy = chan;
+    return -1;
+  }
+  /* released with the lock by luaproc_unlock_channel */
+  channel_retain( chan );
+
+  /* take the lua process out of the barrier or list it is waiting in */
+  barrier = chan->barrier;
+  if (( barrier != NULL ) && ( barrier->mainlp == lp )) {
+    barrier->mainlp = NULL;
+  } else if ( lp->waitlist != NULL ) {
+    list_unlink( lp->waitlist, lp );
+    if (( lp->waitlist == &chan->recv ) && ( chan->lfq != NULL )) {
+      __atomic_sub_fetch( &chan->lfq->recvwait, 1, __ATOMIC_SEQ_CST );
+    } else if (( lp->waitlist == &chan->send ) && ( chan->lfq != NULL )) {
+      __atomic_sub_fetch( &chan->lfq->sendwait, 1, __ATOMIC_SEQ_CST );
+    }
+    lp->waitlist = NULL;
+  }
+
+  /* if no lua process is left in the barrier, a new one may start over */
+  if (( barrier != NULL ) && ( barrier->mainlp == NULL ) &&
+      ( list_count( &barrier->elems ) == 0 )) {
+    free( barrier );
+    chan->barrier = NULL;
+  }
+
+  lp->timedwait = FALSE;
+  lua_pushnil( lp->lstate );
+  lua_pushliteral( lp->lstate, "timeout" );
+  lp->args = 2;
+  luaproc_unlock_channel( chan );
+
+  if ( lp == &mainlp ) {
+    luaproc_wake_main();
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* block until a channel found in use by luaproc_expire_wait is released */
+void luaproc_wait_channel( channel *chan ) {
+  pthread_mutex_lock( &chan->mutex );
+  luaproc_unlock_channel( chan );
+}
+
+/********************************
+ * internal auxiliary functions *
  ********************************/
 static void luaproc_loadbuffer( lua_State *parent, lua_State *lstate,
                                 const char *code, size_t len ) {
@@ -489,8 +1547,49 @@ static luaproc *luaproc_new( lua_State *L ) {
 
 /* join schedule workers (called before exiting Lua) */
 static int luaproc_join_workers( lua_State *L ) {
+  int i;
+  unsigned int b;
+  chantable *t, *retired;
+  channel *chan;
+  message *msg;
+
   sched_join_workers();
-  lua_close( chanls );
+  /* free the channel directory; no operation can hold channels anymore */
+  for ( i = 0; i < LUAPROC_CHANNEL_SHARDS; i++ ) {
+    t = chanshards[ i ].table;
+    if ( t != NULL ) {
+      for ( b = 0; b <= t->mask; b++ ) {
+        while (( chan = t->buckets[ b ] ) != NULL ) {
+          t->buckets[ b ] = chan->dirnext;
+          /* messages never received go away with their channels */
+          if ( chan->type == 1 ) {
+            while (( msg = msgqueue_peek( &chan->msgs )) != NULL ) {
+              msgqueue_pop( &chan->msgs );
+              message_free( msg );
+            }
+            msgqueue_free( &chan->msgs );
+            if ( chan->lfq != NULL ) {
+              while (( msg = lfqueue_pop( chan->lfq )) != NULL ) {
+                message_free( msg );
+              }
+            }
+          }
+          channel_release( chan );
+        }
+      }
+    }
+    for ( ; t != NULL; t = retired ) {
+      retired = t->retired;
+      free( t );
+    }
+    chanshards[ i ].table = NULL;
+    chanshards[ i ].count = 0;
+  }
+  while (( chan = chanfree ) != NULL ) {
+    chanfree = chan->dirnext;
+    pthread_mutex_destroy( &chan->mutex );
+    free( chan );
+  }
   return 0;
 }
 
@@ -523,6 +1622,14 @@ FALSE plus error messages	:otherwise
 */
 static int transferUdata(lua_State *Lfrom, int i, lua_State *Lto, enum t_transfer type_){
 	
+	//channel handles are copied instead of moved: the receiver gets its own handle to the same channel
+	channel *chan = channel_tohandle(Lfrom, i);
+	
+	if(chan != NULL){
+		channel_pushhandle(Lto, chan);
+		return TRUE;
+	}
+	
 	//type of message transfer
 	int type_transfer = 0;
 	
@@ -851,6 +1958,19 @@ static int transferUdata(lua_State *Lfrom, int i, lua_State *Lto, enum t_transfe
 		
 		//Lto's stack: resulting userdata
 		
+		//userdata received from a container Lua state are kept aside until the whole message is received (see message_decode)
+		if(type_ == from_temp){
+			lua_pushlightuserdata(Lto, (void *)received_udata);
+			lua_rawget(Lto, LUA_REGISTRYINDEX);
+			
+			if(lua_istable(Lto, -1)){
+				lua_pushvalue(Lto, -2);
+				lua_rawseti(Lto, -2, lua_rawlen(Lto, -2) + 1);
+			}
+			
+			lua_pop(Lto, 1);
+		}
+		
 		//removing the remaining two values in the Lfrom's stack: ud mt | ud mt name 
 		lua_pop(Lfrom, 2);
 		
@@ -1978,239 +3098,1139 @@ static int luaproc_copyvalues( lua_State *Lfrom, lua_State *Lto, enum t_transfer
 }
 
 
-/* 
-copies values to and from a container Lua state
+/****************************
+ * async message encoding *
+ ****************************/
 
-params:
+/* set the error message of a failed encoding */
+static int msgenc_fail( msgenc *e, const char *fmt, const char *arg ) {
+	snprintf( e->err, sizeof( e->err ), fmt, arg );
+	return LUAPROC_MSG_ERROR;
+}
 
-Lfrom	: sender Lua state
-Lto		: receiver Lua state
-type_	: kind of message transfer
+/* append bytes to a message being encoded */
+static int msgenc_put( msgenc *e, const void *p, size_t n ) {
 
-return values:
+	char *data;
+	size_t size = ( e->size > 0 ) ? e->size : 64;
 
-TRUE	: all values were transferred sucessfully
-FALSE	: otherwise
+	if ( e->len + n > e->size ) {
+		while ( size < e->len + n ) {
+			size *= 2;
+		}
+		data = (char *)realloc( e->data, size );
+		if ( data == NULL ) {
+			return FALSE;
+		}
+		e->data = data;
+		e->size = size;
+	}
+	memcpy( e->data + e->len, p, n );
+	e->len += n;
+	return TRUE;
+}
 
-*/
+/* append a tag to a message being encoded */
+static int msgenc_tag( msgenc *e, char tag ) {
+	return msgenc_put( e, &tag, 1 );
+}
 
-static int luaproc_async_copyvalues( lua_State *Lfrom, lua_State *Lto, enum t_transfer type_) {
+/* make room for one more element in an array of n elements, which grows by
+   doubling. return the (possibly moved) array, or null if out of memory */
+static void *msgenc_grow( void *arr, int n, size_t elem ) {
+	if (( arr != NULL ) && (( n < 4 ) || (( n & ( n - 1 )) != 0 ))) {
+		return arr;
+	}
+	return realloc( arr, (( n < 4 ) ? 4 : 2 * n ) * elem );
+}
 
-	int i;
-	
-	//number of values to be transferred
-	int n_elem_to_copy = 0;
-	
-	//number of messages in the container Lua state, each message is stored in a container Lua state as a table
-	int temp_stack_len = 0;
-	
-	//return value
-	int result = TRUE;
-	
-	//"type_" may be either "to_temp" or "from_temp"
-	if(type_ == to_temp){
-		
-		//getting the total of values to be transferred from the sender's stack
-		n_elem_to_copy = lua_gettop( Lfrom );
-		
-		//getting the total of message stored in the container Lua state
-		temp_stack_len = lua_gettop( Lto );
+/* lua_dump writer appending the binary code of a function to a message */
+static int msgenc_writer( lua_State *L, const void *b, size_t size, void *ud ) {
+	(void)L;
+	return msgenc_put( (msgenc *)ud, b, size ) ? 0 : 1;
+}
+
+/* is the table at a given index registered by a C module? */
+static int luaproc_is_module( lua_State *L, int idx ) {
+
+	int found = FALSE;
+
+	lua_getglobal( L, "package" );
+	if ( lua_type( L, -1 ) == LUA_TTABLE ) {
+		lua_getfield( L, -1, "loaded" );
+		if ( lua_type( L, -1 ) == LUA_TTABLE ) {
+			lua_pushnil( L );
+			while (( !found ) && ( lua_next( L, -2 ) != 0 )) {
+				found = isequal( L, idx, -1 );
+				lua_pop( L, 1 );
+			}
+			if ( found ) {
+				lua_pop( L, 1 );  /* the key of the module */
+			}
+		}
+		lua_pop( L, 1 );
 	}
-	else{
-		//getting the total number of values to be transferred from the table at the beginning of the container Lua state stack's 
-		n_elem_to_copy = lua_rawlen(Lfrom, 1);
-		
-		//getting the total number of messages stored in the container Lua state
-		temp_stack_len = lua_gettop( Lfrom );
+	lua_pop( L, 1 );
+	return found;
+}
+
+static int msgenc_value( lua_State *L, int idx, msgenc *e, int lv );
+
+/* encode a table: its keys and values, up to an end tag */
+static int msgenc_table( lua_State *L, int idx, msgenc *e, int lv ) {
+
+	int ret;
+
+	if ( lv > MAX_NESTING_LEVELS ) {
+		return msgenc_fail( e, "%s", "number of nesting levels not supported" );
 	}
-	
-	//checks if there is enough space in the receiver's stack
-	if ( lua_checkstack( Lto, n_elem_to_copy ) == 0 ) {
-		
-		if(type_ == from_temp){
-			lua_pushnil( Lto );
-			lua_pushstring( Lto, "not enough space in the stack" );
-		}
-		else{
-			lua_pushnil( Lfrom );
-			lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
+	if ( !lua_checkstack( L, 3 )) {
+		return msgenc_fail( e, "%s", "not enough space in the stack" );
+	}
+	if ( !msgenc_tag( e, LUAPROC_MSG_TABLE )) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
+	}
+	lua_pushnil( L );
+	while ( lua_next( L, idx ) != 0 ) {
+		if ((( ret = msgenc_value( L, lua_gettop( L ) - 1, e, lv + 1 )) != LUAPROC_MSG_OK ) ||
+		    (( ret = msgenc_value( L, lua_gettop( L ), e, lv + 1 )) != LUAPROC_MSG_OK )) {
+			lua_pop( L, 2 );
+			return ret;
 		}
-		
-		return FALSE;
+		lua_pop( L, 1 );
 	}
-	
-	//copying a message to a container Lua state
-	if(type_ == to_temp){
-		
-		//creates the table storing the values of the transferred message
-		lua_newtable(Lto);
-		
-		for ( i = 2; i <= n_elem_to_copy; i++ ) {
-			lua_pushinteger(Lto, i - 1);
-			
-			//copies the value to the container Lua state's stack
-			result = copy_one_value(Lfrom, i, Lto, type_);
-			
-			if(result == FALSE)
-				break;
-			
-			//the values composing a message are stored in this table preserving the order they have
-			lua_rawset(Lto, -3);
+	if ( !msgenc_tag( e, LUAPROC_MSG_END )) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
+	}
+	return LUAPROC_MSG_OK;
+}
+
+/* encode an upvalue of a lua function */
+static int msgenc_upvalue( lua_State *L, int idx, msgenc *e ) {
+
+	int global;
+
+	if ( lua_type( L, idx ) == LUA_TTABLE ) {
+		/* the global table of the sender stands for that of the receiver */
+		lua_pushglobaltable( L );
+		global = isequal( L, idx, -1 );
+		lua_pop( L, 1 );
+		if ( global ) {
+			return msgenc_tag( e, LUAPROC_MSG_GLOBALS ) ? LUAPROC_MSG_OK :
+			       msgenc_fail( e, "%s", "not enough memory to store the message" );
+		}
+		/* tables registered by C modules are looked up by name in the receiver */
+		if ( luaproc_is_module( L, idx )) {
+			return LUAPROC_MSG_FALLBACK;
 		}
 	}
-	else{
-		
-		//copying a message from a container Lua state
-		for ( i = 1; i <= n_elem_to_copy; i++ ) {
-			
-			//getting the values composing a message in the order in which they were stored
-			lua_pushinteger(Lfrom, i );
-			lua_rawget(Lfrom, 1);
-			
-			//copies the value to the receiver's stack
-			result = copy_one_value(Lfrom, temp_stack_len + 1, Lto, type_);
+	return msgenc_value( L, idx, e, 1 );
+}
 
-			if(result == FALSE)
-				break;
-			
-			//removes the value from the stack
-			lua_pop(Lfrom, 1);
+/* encode a lua function: its binary code and its upvalues */
+static int msgenc_function( lua_State *L, int idx, msgenc *e ) {
+
+	int i, nups, ret;
+	size_t len = 0, start;
+	const void *f = lua_topointer( L, idx );
+	const void **funcs;
+	char err[ 16 ];
+
+	/* a function met again (it may even be its own upvalue) is encoded by
+	   reference to its first encoding */
+	for ( i = 0; i < e->nfuncs; i++ ) {
+		if ( e->funcs[ i ] == f ) {
+			if ( !msgenc_tag( e, LUAPROC_MSG_FUNCREF ) || !msgenc_put( e, &i, sizeof( i ))) {
+				return msgenc_fail( e, "%s", "not enough memory to store the message" );
+			}
+			return LUAPROC_MSG_OK;
 		}
 	}
-	
-	if(result == FALSE){
-		
-		//if an error ocurrs during the transfer, this method removes all the values temporary placed in the stack of the container Lua state
-		//in this way, a failed transfer does not cause the stack of a container Lua state to become inconsistent
-		if(type_ == to_temp)
-			lua_pop(Lto, lua_gettop( Lto ) - temp_stack_len);
-		else
-			lua_pop(Lfrom, lua_gettop( Lfrom ) - temp_stack_len);
-		
-		return FALSE;
+
+	/* C functions are looked up by their path in the receiver */
+	if ( lua_tocfunction( L, idx ) != NULL ) {
+		return LUAPROC_MSG_FALLBACK;
 	}
-	
-	if(type_ == from_temp){
-		
-		//if no error ocurrs during the transfer, it removes the message transferred from a container Lua state
-		lua_remove(Lfrom, 1);
-		
-		//decreases the counter of async messges not yet received 
-		sched_dec_async_msg_count();
+
+	if ( !lua_checkstack( L, 5 )) {
+		return msgenc_fail( e, "%s", "not enough space in the stack" );
 	}
-	else{
-		//if the message was transferred to a container Lua state, it increases the counter of async messges not yet received 
-		sched_inc_async_msg_count();
+	funcs = (const void **)msgenc_grow( (void *)e->funcs, e->nfuncs, sizeof( void * ));
+	if (( funcs == NULL ) || ( !msgenc_tag( e, LUAPROC_MSG_FUNCTION )) ||
+	    ( !msgenc_put( e, &len, sizeof( len )))) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
 	}
-		
-	return TRUE;
+	e->funcs = funcs;
+	e->funcs[ e->nfuncs++ ] = f;
+
+	/* the length of the binary code goes before it */
+	start = e->len;
+	lua_pushvalue( L, idx );
+	ret = dump( L, msgenc_writer, e, FALSE );
+	lua_pop( L, 1 );
+	if ( ret != 0 ) {
+		snprintf( err, sizeof( err ), "%d", ret );
+		return msgenc_fail( e, "error %s dumping function to binary string, it may not be a Lua function.", err );
+	}
+	len = e->len - start;
+	memcpy( e->data + start - sizeof( len ), &len, sizeof( len ));
+
+	for ( nups = 0; lua_getupvalue( L, idx, nups + 1 ) != NULL; nups++ ) {
+		lua_pop( L, 1 );
+	}
+	if ( !msgenc_put( e, &nups, sizeof( nups ))) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
+	}
+	for ( i = 1; i <= nups; i++ ) {
+		lua_getupvalue( L, idx, i );
+		ret = msgenc_upvalue( L, lua_gettop( L ), e );
+		lua_pop( L, 1 );
+		if ( ret != LUAPROC_MSG_OK ) {
+			return ret;
+		}
+	}
+	return LUAPROC_MSG_OK;
 }
 
-/* 
-sends an userdata between Lua state in a predefined way
+/* encode a channel handle: the message keeps a reference to the channel */
+static int msgenc_handle( msgenc *e, channel *chan ) {
 
-params:
+	int i;
+	channel **handles;
 
-type_	: kind of message transfer
-userdata	: userdata to be sent
-Lto		: receiver Lua state
+	for ( i = 0; ( i < e->nhandles ) && ( e->handles[ i ] != chan ); i++ );
+	if ( i == e->nhandles ) {
+		handles = (channel **)msgenc_grow( e->handles, e->nhandles, sizeof( channel * ));
+		if ( handles == NULL ) {
+			return msgenc_fail( e, "%s", "not enough memory to store the message" );
+		}
+		channel_retain( chan );
+		e->handles = handles;
+		e->handles[ e->nhandles++ ] = chan;
+	}
+	if ( !msgenc_tag( e, LUAPROC_MSG_CHANNEL ) || !msgenc_put( e, &i, sizeof( i ))) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
+	}
+	return LUAPROC_MSG_OK;
+}
 
-return values:
+/* encode the value at a given (absolute) stack index */
+static int msgenc_value( lua_State *L, int idx, msgenc *e, int lv ) {
 
-no values						: if the userdata was sent sucessfully
-a nil value plus error messages	: otherwise
+	int ok;
+	size_t len;
+	const char *str;
+	lua_Number n;
+	channel *chan;
+#if (LUA_VERSION_NUM >= 503)
+	lua_Integer i;
+#endif
 
-*/
+	switch ( lua_type( L, idx )) {
+		case LUA_TNIL:
+			ok = msgenc_tag( e, LUAPROC_MSG_NIL );
+			break;
 
-static int luaproc_default_send_udata(lua_State *L){
+		case LUA_TBOOLEAN:
+			ok = msgenc_tag( e, lua_toboolean( L, idx ) ? LUAPROC_MSG_TRUE : LUAPROC_MSG_FALSE );
+			break;
 
-	/* userdata's metatable name */
-	const char *mt_name = NULL;
+		case LUA_TNUMBER:
+#if (LUA_VERSION_NUM >= 503)
+			if ( lua_isinteger( L, idx )) {
+				i = lua_tointeger( L, idx );
+				ok = msgenc_tag( e, LUAPROC_MSG_INTEGER ) && msgenc_put( e, &i, sizeof( i ));
+				break;
+			}
+#endif
+			n = lua_tonumber( L, idx );
+			ok = msgenc_tag( e, LUAPROC_MSG_NUMBER ) && msgenc_put( e, &n, sizeof( n ));
+			break;
 
-	size_t len;
+		case LUA_TSTRING:
+			str = lua_tolstring( L, idx, &len );
+			ok = msgenc_tag( e, LUAPROC_MSG_STRING ) && msgenc_put( e, &len, sizeof( len )) &&
+			     msgenc_put( e, str, len );
+			break;
 
-	/* size of the memory block associated to the userdata to be transferred */
-	int size_udata = 0;
+		case LUA_TTABLE:
+			return msgenc_table( L, idx, e, lv );
 
-	/* validating the function's parameters */
-	luaL_checktype(L, 2, LUA_TUSERDATA);
-	luaL_checktype(L, 3, LUA_TLIGHTUSERDATA);
+		case LUA_TFUNCTION:
+			return msgenc_function( L, idx, e );
 
-	/* getting the function's parameters */
+		case LUA_TUSERDATA:
+			/* userdata are moved by their transfer functions */
+			chan = channel_tohandle( L, idx );
+			if ( chan == NULL ) {
+				return LUAPROC_MSG_FALLBACK;
+			}
+			return msgenc_handle( e, chan );
 
-	/* type_ may be either "1" (indicates the userdata is being transferred to another Lua processs) 
-	or "3" (indicates the userdata is being transferred to a container Lua state)*/
-	int type_ = luaL_checkinteger(L, 1);
+		default: /* threads, coroutines and light userdata */
+			return msgenc_fail( e, "failed to send value of unsupported type '%s'", luaL_typename( L, idx ));
+	}
 
-	/* getting a pointer to the userdata to be transferred */
-	const void *udata_pointer = lua_touserdata(L, 2);
+	if ( !ok ) {
+		return msgenc_fail( e, "%s", "not enough memory to store the message" );
+	}
+	return LUAPROC_MSG_OK;
+}
 
-	/* getting a pointer to the receiver Lua state */
-	lua_State *Lto = (lua_State *)lua_touserdata(L, 3);
+/*
+keeps the values at stack positions 2 to top of a Lua state (the channel is
+at 1) in a new message, on the stack of a container Lua state of its own
 
-	/* getting the userdata's metatable name in the sender Lua state */
-	lua_getmetatable(L, 2);
-	lua_pushstring(L, "__name");
-	lua_rawget(L, -2);
+return values:
 
-	mt_name = lua_tolstring(L, -1, &len);
+the message	: if all values were copied successfully
+NULL		: otherwise (nil plus an error message are pushed on the sender's stack)
 
-	/* getting the userdata's metatable in the receiver Lua state */
-	luaL_getmetatable(Lto, mt_name);
+*/
 
-	if(lua_isnil(Lto, -1)){
-		/* userdata's metatable is not registered in the receiver Lua state  */
-		
-		if(type_ == 1){
-			/* userdata is being transferred to another Lua state */
-			/* this function must leave error messages in both Lua states */
-			lua_pushnil(L);
-			lua_pushstring(L, "userdata's metatable must be registered in the receiver Lua process");
-			
-			lua_settop(Lto, 1);
-			lua_pushnil(Lto);
-			lua_pushstring(Lto, "userdata's metatable must be registered in the receiver Lua process");
-			
-			return 2;
-		}
-		else{
-			/* userdata is being transferred to a container Lua state */
-			/* this function must create (or get) the metatable to be associated to the resulting userdata */
-			lua_pop(Lto, 1);
-			luaL_newmetatable(Lto, mt_name);
-			
-			/* storing the metatable's name, in versions prior to Lua 5.3 */
-			#if (LUA_VERSION_NUM < 503)
-				lua_pushstring(Lto, "__name");
-				lua_pushlstring(Lto, mt_name, len);
-				lua_rawset(Lto, -3);
-			#endif
+static message *message_contain( lua_State *L ) {
+
+	int i, n = lua_gettop( L );
+	message *msg = (message *)calloc( 1, sizeof( message ));
+	lua_State *Ltemp = ( msg != NULL ) ? luaL_newstate() : NULL;
+
+	if (( Ltemp == NULL ) || ( lua_checkstack( Ltemp, n ) == 0 )) {
+		if ( Ltemp != NULL ) {
+			lua_close( Ltemp );
 		}
+		free( msg );
+		lua_pushnil( L );
+		lua_pushstring( L, "not enough memory to store the message" );
+		return NULL;
 	}
 
-	/* getting the size of the memory block associated to the userdata, in the sender Lua state */
-	size_udata = lua_rawlen(L, 2);
+	for ( i = 2; i <= n; i++ ) {
+		if ( copy_one_value( L, i, Ltemp, to_temp ) == FALSE ) {
+			lua_close( Ltemp );
+			free( msg );
+			return NULL;
+		}
+	}
 
-	/* creating the resulting userdata in the receiver Lua state */
-	void *toPointer = lua_newuserdata(Lto, size_udata);
+	msg->lstate = Ltemp;
+	msg->size = sizeof( message ) + (size_t)lua_gc( Ltemp, LUA_GCCOUNT, 0 ) * 1024 +
+	            lua_gc( Ltemp, LUA_GCCOUNTB, 0 );
+	return msg;
+}
 
-	/* copying the userdata's structure to the receiver Lua state */
-	memcpy(toPointer, udata_pointer, size_udata);
+/*
+encodes the values at stack positions 2 to top of a Lua state (the channel
+is at 1) into a new message. the encoding holds the number of values and of
+Lua functions, followed by the values, each one a tag plus its contents
 
-	/* associating the corresponding metatable to the resulting userdata  */
-	lua_pushvalue(Lto, -2);
-	lua_setmetatable(Lto, -2);
-	lua_remove(Lto, -2);
+return values:
 
-	/* if no error occurs, a sender transfer function returns no values */
-	return 0;
-}
+the message	: if all values were encoded successfully
+NULL		: otherwise (nil plus an error message are pushed on the sender's stack)
 
+*/
 
-/* 
-receives an userdata in a predefined way
+static message *message_encode( lua_State *L ) {
 
-params:
+	int i, n = lua_gettop( L ), ret = LUAPROC_MSG_OK;
+	unsigned int nvalues = n - 1;
+	message *msg;
+	msgenc e;
+
+	/* the message struct and its encoded values share one block of memory */
+	memset( &e, 0, sizeof( e ));
+	if (( !msgenc_put( &e, &e, sizeof( message ))) ||
+	    ( !msgenc_put( &e, &nvalues, sizeof( nvalues ))) ||
+	    ( !msgenc_put( &e, &e.nfuncs, sizeof( e.nfuncs )))) {
+		ret = msgenc_fail( &e, "%s", "not enough memory to store the message" );
+	}
+	for ( i = 2; ( ret == LUAPROC_MSG_OK ) && ( i <= n ); i++ ) {
+		ret = msgenc_value( L, i, &e, 1 );
+	}
+	lua_settop( L, n );
+	free( e.funcs );
+
+	if ( ret == LUAPROC_MSG_OK ) {
+		memcpy( e.data + sizeof( message ) + sizeof( nvalues ), &e.nfuncs, sizeof( e.nfuncs ));
+		/* give back the room the buffer has left */
+		msg = (message *)realloc( e.data, e.len );
+		if ( msg == NULL ) {
+			msg = (message *)e.data;
+		}
+		msg->data = (char *)( msg + 1 );
+		msg->len = e.len - sizeof( message );
+		msg->lstate = NULL;
+		msg->handles = e.handles;
+		msg->nhandles = e.nhandles;
+		msg->size = e.len + e.nhandles * sizeof( channel * );
+		return msg;
+	}
+
+	for ( i = 0; i < e.nhandles; i++ ) {
+		channel_release( e.handles[ i ] );
+	}
+	free( e.handles );
+	free( e.data );
+
+	if ( ret == LUAPROC_MSG_FALLBACK ) {
+		return message_contain( L );
+	}
+	lua_pushnil( L );
+	lua_pushstring( L, e.err );
+	return NULL;
+}
+
+static int msgdec_value( lua_State *L, msgdec *d );
+
+/* read bytes of a message being decoded */
+static void msgdec_get( msgdec *d, void *p, size_t n ) {
+	memcpy( p, d->p, n );
+	d->p += n;
+}
+
+/* decode a table */
+static int msgdec_table( lua_State *L, msgdec *d ) {
+
+	if ( !lua_checkstack( L, 3 )) {
+		d->err = "not enough space in the stack";
+		return FALSE;
+	}
+	lua_newtable( L );
+	while ( *d->p != LUAPROC_MSG_END ) {
+		if (( !msgdec_value( L, d )) || ( !msgdec_value( L, d ))) {
+			return FALSE;
+		}
+		lua_rawset( L, -3 );
+	}
+	d->p++;
+	return TRUE;
+}
+
+/* decode a lua function */
+static int msgdec_function( lua_State *L, msgdec *d ) {
+
+	int i, nups;
+	size_t len;
+
+	if ( !lua_checkstack( L, 3 )) {
+		d->err = "not enough space in the stack";
+		return FALSE;
+	}
+	msgdec_get( d, &len, sizeof( len ));
+	if ( luaL_loadbuffer( L, d->p, len, "=luaproc" ) != 0 ) {
+		lua_pop( L, 1 );
+		d->err = "error loading a function received";
+		return FALSE;
+	}
+	d->p += len;
+
+	/* registered before its upvalues, which may refer to it */
+	lua_pushvalue( L, -1 );
+	lua_rawseti( L, d->funcs, ++d->nfuncs );
+
+	msgdec_get( d, &nups, sizeof( nups ));
+	for ( i = 1; i <= nups; i++ ) {
+		if ( !msgdec_value( L, d )) {
+			return FALSE;
+		}
+		if ( lua_setupvalue( L, -2, i ) == NULL ) {
+			lua_pop( L, 1 );
+			d->err = "failed to set upvalues";
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* decode a value, pushing it on the stack */
+static int msgdec_value( lua_State *L, msgdec *d ) {
+
+	int i;
+	size_t len;
+	lua_Number n;
+#if (LUA_VERSION_NUM >= 503)
+	lua_Integer integer;
+#endif
+
+	switch ( *d->p++ ) {
+		case LUAPROC_MSG_NIL:
+			lua_pushnil( L );
+			break;
+		case LUAPROC_MSG_FALSE:
+			lua_pushboolean( L, FALSE );
+			break;
+		case LUAPROC_MSG_TRUE:
+			lua_pushboolean( L, TRUE );
+			break;
+#if (LUA_VERSION_NUM >= 503)
+		case LUAPROC_MSG_INTEGER:
+			msgdec_get( d, &integer, sizeof( integer ));
+			lua_pushinteger( L, integer );
+			break;
+#endif
+		case LUAPROC_MSG_NUMBER:
+			msgdec_get( d, &n, sizeof( n ));
+			lua_pushnumber( L, n );
+			break;
+		case LUAPROC_MSG_STRING:
+			msgdec_get( d, &len, sizeof( len ));
+			lua_pushlstring( L, d->p, len );
+			d->p += len;
+			break;
+		case LUAPROC_MSG_TABLE:
+			return msgdec_table( L, d );
+		case LUAPROC_MSG_FUNCTION:
+			return msgdec_function( L, d );
+		case LUAPROC_MSG_FUNCREF:
+			msgdec_get( d, &i, sizeof( i ));
+			lua_rawgeti( L, d->funcs, i + 1 );
+			break;
+		case LUAPROC_MSG_GLOBALS:
+			lua_pushglobaltable( L );
+			break;
+		case LUAPROC_MSG_CHANNEL:
+			msgdec_get( d, &i, sizeof( i ));
+			channel_pushhandle( L, d->msg->handles[ i ] );
+			break;
+		default:
+			d->err = "invalid message received";
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* pushes the metatable of the userdata already transferred, creating it if needed */
+static void luaproc_push_denied_mt( lua_State *L ) {
+
+	if ( luaL_newmetatable( L, LUAPROC_DENIED_MTUDATA )) {
+		lua_pushstring( L, "__index" );
+		lua_pushcfunction( L, luaproc_denied_udata );
+		lua_rawset( L, -3 );
+		
+		lua_pushstring( L, "__metatable" );
+		lua_pushstring( L, "Access denied" );
+		lua_rawset( L, -3 );
+	}
+}
+
+/*
+stops tracking the userdata received from a container Lua state. if the
+receive failed, those the receiver got so far are disabled, so collecting them
+does not release the resources the message still holds (e.g. close a file)
+*/
+
+static void message_drop_udata( lua_State *L, int failed ) {
+
+	int i, n;
+
+	lua_pushlightuserdata( L, (void *)received_udata );
+	lua_rawget( L, LUA_REGISTRYINDEX );
+	if ( failed ) {
+		luaproc_push_denied_mt( L );
+		n = (int)lua_rawlen( L, -2 );
+		for ( i = 1; i <= n; i++ ) {
+			lua_rawgeti( L, -2, i );
+			lua_pushvalue( L, -2 );
+			lua_setmetatable( L, -2 );
+			lua_pop( L, 1 );
+		}
+		lua_pop( L, 1 );
+	}
+	lua_pop( L, 1 );
+	lua_pushlightuserdata( L, (void *)received_udata );
+	lua_pushnil( L );
+	lua_rawset( L, LUA_REGISTRYINDEX );
+}
+
+/*
+pushes the values of a message on a Lua state's stack. the message is left
+untouched, so it can be received later if this fails
+
+return values:
+
+TRUE	: all values were pushed successfully
+FALSE	: otherwise (nil plus an error message are pushed on the receiver's stack)
+
+*/
+
+static int message_decode( message *msg, lua_State *L ) {
+
+	int i, n, base = lua_gettop( L );
+	unsigned int nvalues;
+	msgdec d;
+
+	//values that could not be encoded are copied from the container Lua state, each one from the top of its stack
+	if ( msg->lstate != NULL ) {
+		n = lua_gettop( msg->lstate );
+		if (( lua_checkstack( L, n + 3 ) == 0 ) || ( lua_checkstack( msg->lstate, 1 ) == 0 )) {
+			lua_pushnil( L );
+			lua_pushstring( L, "not enough space in the stack" );
+			return FALSE;
+		}
+		//the userdata received share their resources with the message, so they are tracked until all values are received
+		lua_pushlightuserdata( L, (void *)received_udata );
+		lua_newtable( L );
+		lua_rawset( L, LUA_REGISTRYINDEX );
+		for ( i = 1; i <= n; i++ ) {
+			lua_pushvalue( msg->lstate, i );
+			if ( copy_one_value( msg->lstate, n + 1, L, from_temp ) == FALSE ) {
+				lua_settop( msg->lstate, n );
+				message_drop_udata( L, TRUE );
+				return FALSE;
+			}
+			lua_pop( msg->lstate, 1 );
+		}
+		message_drop_udata( L, FALSE );
+		return TRUE;
+	}
+
+	d.p = msg->data;
+	d.msg = msg;
+	d.nfuncs = 0;
+	d.funcs = 0;
+	d.err = NULL;
+	msgdec_get( &d, &nvalues, sizeof( nvalues ));
+	msgdec_get( &d, &n, sizeof( n ));
+
+	if ( lua_checkstack( L, (int)nvalues + 2 ) == 0 ) {
+		lua_pushnil( L );
+		lua_pushstring( L, "not enough space in the stack" );
+		return FALSE;
+	}
+	//lua functions are kept in a table while decoding, as they may be met again
+	if ( n > 0 ) {
+		lua_createtable( L, n, 0 );
+		d.funcs = lua_gettop( L );
+	}
+	for ( i = 0; i < (int)nvalues; i++ ) {
+		if ( !msgdec_value( L, &d )) {
+			lua_settop( L, base );
+			lua_pushnil( L );
+			lua_pushstring( L, d.err );
+			return FALSE;
+		}
+	}
+	if ( n > 0 ) {
+		lua_remove( L, d.funcs );
+	}
+	return TRUE;
+}
+
+/*
+stores a message in a locked async channel, or hands it over right away to a
+Lua process waiting to receive from it. if that Lua process fails to receive
+it, it gets the error and the message is stored
+
+return values:
+
+TRUE	: the message was stored or received
+FALSE	: there is no memory to store it (the caller still owns the message)
+
+*/
+
+static int luaproc_async_post( channel *chan, message *msg ) {
+
+	int ret;
+	luaproc *dstlp = channel_dequeue( &chan->recv );
+
+	if ( dstlp != NULL ) {
+		//receivers wait only on empty channels, with nothing but the channel on their stacks
+		ret = message_decode( msg, dstlp->lstate );
+		dstlp->args = lua_gettop( dstlp->lstate ) - 1;
+		if ( dstlp == &mainlp ) {
+			luaproc_wake_main();
+		} else {
+			sched_queue_proc( dstlp );
+		}
+		if ( ret == TRUE ) {
+			message_free( msg );
+			return TRUE;
+		}
+	}
+
+	if ( !msgqueue_push( &chan->msgs, msg )) {
+		return FALSE;
+	}
+
+	//increases the counter of async messges not yet received
+	sched_inc_async_msg_count();
+	luaproc_notify_main( chan );
+	return TRUE;
+}
+
+/*
+stores a message from a Lua state's stack in a locked async channel
+
+params:
+
+L		: sender Lua state (the channel is at the bottom of its stack)
+chan	: async channel
+
+return values:
+
+TRUE	: all values were stored sucessfully
+FALSE	: otherwise (nil plus an error message are pushed on the sender's stack)
+
+*/
+
+static int luaproc_async_store( lua_State *L, channel *chan ) {
+
+	message *msg = message_encode( L );
+
+	if ( msg == NULL ) {
+		return FALSE;
+	}
+	if ( !luaproc_async_post( chan, msg )) {
+		message_free( msg );
+		lua_pushnil( L );
+		lua_pushstring( L, "not enough memory to store the message" );
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* 
+stores the messages of the Lua processes blocked on sending through a full
+async channel, oldest first, while the channel has room, and resumes them.
+caller must lock the channel.
+*/
+
+static void luaproc_async_admit( channel *chan ) {
+
+	luaproc *srclp;
+	
+	while (( !channel_is_full( chan )) && (( srclp = channel_dequeue( &chan->send )) != NULL )) {
+		
+		if ( luaproc_async_store( srclp->lstate, chan ) == TRUE ) {
+			lua_pushboolean( srclp->lstate, TRUE );
+			srclp->args = 1;
+		}
+		else { /* nil and error msg already in stack */
+			srclp->args = 2;
+		}
+		
+		if ( srclp == &mainlp ) {
+			luaproc_wake_main();
+		} else {
+			sched_queue_proc( srclp );
+		}
+	}
+}
+
+/* 
+moves the oldest message of an async channel to the receiver's stack. caller
+must lock the channel and make sure the channel stores a message.
+
+params:
+
+chan	: async channel
+L		: receiver Lua state
+
+return values:
+
+TRUE	: all values were transferred sucessfully
+FALSE	: otherwise (nil plus an error message are pushed on the receiver's stack,
+		  and the message stays in the channel)
+
+*/
+
+static int luaproc_async_fetch( channel *chan, lua_State *L ) {
+
+	message *msg = msgqueue_peek( &chan->msgs );
+	
+	if ( !message_decode( msg, L )) {
+		return FALSE;
+	}
+	
+	//the message was received, so it leaves the channel
+	msgqueue_pop( &chan->msgs );
+	message_free( msg );
+	
+	//decreases the counter of async messges not yet received 
+	sched_dec_async_msg_count();
+	
+	//the freed room goes to the Lua processes blocked on the channel being full
+	luaproc_async_admit( chan );
+	
+	return TRUE;
+}
+
+/* 
+reserves room for a message in a lock-free async channel, as long as it is not
+full. an empty channel takes a message of any size.
+
+return values:
+
+LUAPROC_LFQUEUE_OK		: room was reserved (the caller must store a message in it or give it back)
+LUAPROC_LFQUEUE_FULL	: the channel is full
+LUAPROC_LFQUEUE_GONE	: the channel was destroyed
+
+*/
+
+static int luaproc_lf_reserve( channel *chan ) {
+
+	lfqueue *q = chan->lfq;
+	unsigned int limit = ( chan->maxmsgs > 0 ) ? (unsigned int)chan->maxmsgs : (unsigned int)( q->mask + 1 );
+	unsigned int n = __atomic_load_n( &q->count, __ATOMIC_SEQ_CST );
+	
+	do {
+		if ( n == LUAPROC_LFQUEUE_DESTROYED ) {
+			return LUAPROC_LFQUEUE_GONE;
+		}
+		if (( n >= limit ) || (( chan->maxbytes > 0 ) && ( n > 0 ) &&
+		    ( __atomic_load_n( &q->bytes, __ATOMIC_RELAXED ) >= chan->maxbytes ))) {
+			return LUAPROC_LFQUEUE_FULL;
+		}
+	} while ( !__atomic_compare_exchange_n( &q->count, &n, n + 1, TRUE,
+	                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ));
+	
+	return LUAPROC_LFQUEUE_OK;
+}
+
+/* 
+stores a message in a lock-free async channel, in the room reserved for it.
+the size of a message is only known once encoded, so the bound on memory is
+checked again here: messages stored while it was being encoded may have
+reached it.
+
+return values:
+
+TRUE	: the message was stored
+FALSE	: the channel is full (the caller still owns the message and its room)
+
+*/
+
+static int luaproc_lf_post( channel *chan, message *msg ) {
+	
+	lfqueue *q = chan->lfq;
+	size_t bytes = __atomic_load_n( &q->bytes, __ATOMIC_RELAXED );
+	
+	//as stored messages are never empty, a channel storing none takes a message of any size
+	do {
+		if (( chan->maxbytes > 0 ) && ( bytes > 0 ) && ( bytes >= chan->maxbytes )) {
+			return FALSE;
+		}
+	} while ( !__atomic_compare_exchange_n( &q->bytes, &bytes, bytes + msg->size, TRUE,
+	                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED ));
+	
+	//counted before it can be received, so the counter never goes below zero
+	sched_inc_async_msg_count();
+	lfqueue_push( q, msg );
+	luaproc_notify_main( chan );
+	return TRUE;
+}
+
+/* 
+binds the single sender or receiver the topology of a lock-free async channel
+declares to the first Lua state using that side of the channel. the caller
+holds a reference to the channel, dropped before raising an error if another
+Lua state already uses that side. a Lua process lets go of the sides it is
+bound to when it ends (see luaproc_unbind_channels), so another one can take
+over, and a recycled Lua state starts with no binding.
+*/
+
+static void luaproc_lf_attach( lua_State *L, channel *chan, const char *chname, int recv ) {
+
+	lfqueue *q = chan->lfq;
+	lua_State **side = recv ? &q->receiver : &q->sender;
+	lua_State *cur = NULL;
+	luaproc *self;
+	lfbind *bind;
+	
+	if (( q->topology == LUAPROC_TOPOLOGY_MPMC ) ||
+	    (( !recv ) && ( q->topology == LUAPROC_TOPOLOGY_MPSC ))) {
+		return;
+	}
+	if ( !__atomic_compare_exchange_n( side, &cur, L, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE )) {
+		if ( cur != L ) {
+			channel_release( chan );
+			luaL_error( L, "channel '%s' takes a single %s", chname, recv ? "receiver" : "sender" );
+		}
+		return;
+	}
+	
+	//the main state never ends, so only Lua processes keep track of their bindings
+	self = luaproc_getself( L );
+	if ( self == NULL )
+		return;
+	bind = (lfbind *)malloc( sizeof( lfbind ));
+	if ( bind == NULL ) {
+		__atomic_store_n( side, NULL, __ATOMIC_RELEASE );
+		channel_release( chan );
+		luaL_error( L, "out of memory" );
+	}
+	channel_retain( chan );
+	bind->chan = chan;
+	bind->lstate = L;
+	bind->recv = recv;
+	bind->next = self->lfbinds;
+	self->lfbinds = bind;
+}
+
+/* let go of the single sides of lock-free channels a lua process is bound to */
+void luaproc_unbind_channels( luaproc *lp ) {
+
+	lfbind *bind;
+	lua_State **side;
+	lua_State *cur;
+	
+	while (( bind = lp->lfbinds ) != NULL ) {
+		lp->lfbinds = bind->next;
+		side = bind->recv ? &bind->chan->lfq->receiver : &bind->chan->lfq->sender;
+		cur = bind->lstate;
+		__atomic_compare_exchange_n( side, &cur, NULL, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED );
+		channel_release( bind->chan );
+		free( bind );
+	}
+}
+
+/* 
+moves the oldest message of a lock-free async channel to the receiver's stack.
+on channels with a single consumer, the caller must be the only one receiving
+from the channel at a time.
+
+params:
+
+chan	: lock-free async channel
+L		: receiver Lua state
+
+return values:
+
+TRUE	: all values were transferred sucessfully
+FALSE	: otherwise (nil plus an error message are pushed on the receiver's stack,
+		  and the message stays in the channel, except in mpmc channels)
+-1		: the channel stores no message
+
+*/
+
+static int luaproc_lf_fetch( channel *chan, lua_State *L ) {
+
+	lfqueue *q = chan->lfq;
+	message *msg;
+	int ret = TRUE;
+	
+	if ( q->topology != LUAPROC_TOPOLOGY_MPMC ) {
+		//the only receiver leaves the message in its slot until it is received
+		msg = lfqueue_peek( q );
+		if ( msg == NULL ) {
+			return -1;
+		}
+		if ( !message_decode( msg, L )) {
+			return FALSE;
+		}
+		lfqueue_pop( q );
+	}
+	else {
+		msg = lfqueue_pop( q );
+		if ( msg == NULL ) {
+			return -1;
+		}
+		//the message already left the queue, and putting it back at its tail would reorder the channel, so it is discarded
+		ret = message_decode( msg, L );
+	}
+	
+	//the message was received (or discarded), so its room is given back
+	__atomic_sub_fetch( &q->bytes, msg->size, __ATOMIC_RELAXED );
+	__atomic_sub_fetch( &q->count, 1, __ATOMIC_SEQ_CST );
+	message_free( msg );
+	sched_dec_async_msg_count();
+	
+	return ret;
+}
+
+/* 
+tells whether Lua processes wait (or are about to wait) on a lock-free async
+channel. it is called after storing or receiving a message; the Lua processes
+about to wait look at the channel again after announcing themselves, so either
+they see the message (or room) or this function sees them.
+*/
+
+static int luaproc_lf_waiting( channel *chan ) {
+	
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	
+	return (( __atomic_load_n( &chan->lfq->recvwait, __ATOMIC_RELAXED ) > 0 ) ||
+	        ( __atomic_load_n( &chan->lfq->sendwait, __ATOMIC_RELAXED ) > 0 ));
+}
+
+/* 
+hands the messages of a lock-free async channel to the Lua processes waiting
+to receive them and stores the messages of the Lua processes waiting for room,
+resuming them. caller must lock the channel.
+*/
+
+static void luaproc_lf_wake_locked( channel *chan ) {
+
+	lfqueue *q = chan->lfq;
+	luaproc *lp;
+	message *msg;
+	int ret, woken;
+	
+	do {
+		woken = FALSE;
+		
+		//receivers wait only on empty channels, with nothing but the channel on their stacks
+		while ((( lp = chan->recv.head ) != NULL ) &&
+		       (( ret = luaproc_lf_fetch( chan, lp->lstate )) != -1 )) {
+			
+			channel_dequeue( &chan->recv );
+			__atomic_sub_fetch( &q->recvwait, 1, __ATOMIC_SEQ_CST );
+			lp->args = ( ret == TRUE ) ? lua_gettop( lp->lstate ) - 1 : 2;
+			
+			if ( lp == &mainlp ) {
+				luaproc_wake_main();
+			} else {
+				sched_queue_proc( lp );
+			}
+			woken = TRUE;
+		}
+		
+		//the senders waiting for room store their messages while there is room
+		while ((( lp = chan->send.head ) != NULL ) &&
+		       ( luaproc_lf_reserve( chan ) == LUAPROC_LFQUEUE_OK )) {
+			
+			msg = message_encode( lp->lstate );
+			if (( msg != NULL ) && ( !luaproc_lf_post( chan, msg ))) {
+				//it keeps waiting until receivers free memory
+				message_free( msg );
+				__atomic_sub_fetch( &q->count, 1, __ATOMIC_SEQ_CST );
+				break;
+			}
+			
+			channel_dequeue( &chan->send );
+			__atomic_sub_fetch( &q->sendwait, 1, __ATOMIC_SEQ_CST );
+			
+			if ( msg != NULL ) {
+				lua_pushboolean( lp->lstate, TRUE );
+				lp->args = 1;
+			}
+			else { /* nil and error msg already in stack */
+				__atomic_sub_fetch( &q->count, 1, __ATOMIC_SEQ_CST );
+				lp->args = 2;
+			}
+			
+			if ( lp == &mainlp ) {
+				luaproc_wake_main();
+			} else {
+				sched_queue_proc( lp );
+			}
+			woken = TRUE;
+		}
+	} while ( woken );
+}
+
+/* like luaproc_lf_wake_locked, taking the channel's lock */
+static void luaproc_lf_wake( channel *chan ) {
+	pthread_mutex_lock( &chan->mutex );
+	luaproc_lf_wake_locked( chan );
+	pthread_mutex_unlock( &chan->mutex );
+}
+
+/* 
+sends an userdata between Lua state in a predefined way
+
+params:
+
+type_	: kind of message transfer
+userdata	: userdata to be sent
+Lto		: receiver Lua state
+
+return values:
+
+no values						: if the userdata was sent sucessfully
+a nil value plus error messages	: otherwise
+
+*/
+
+static int luaproc_default_send_udata(lua_State *L){
+
+	/* userdata's metatable name */
+	const char *mt_name = NULL;
+
+	size_t len;
+
+	/* size of the memory block associated to the userdata to be transferred */
+	int size_udata = 0;
+
+	/* validating the function's parameters */
+	luaL_checktype(L, 2, LUA_TUSERDATA);
+	luaL_checktype(L, 3, LUA_TLIGHTUSERDATA);
+
+	/* getting the function's parameters */
+
+	/* type_ may be either "1" (indicates the userdata is being transferred to another Lua processs) 
+	or "3" (indicates the userdata is being transferred to a container Lua state)*/
+	int type_ = luaL_checkinteger(L, 1);
+
+	/* getting a pointer to the userdata to be transferred */
+	const void *udata_pointer = lua_touserdata(L, 2);
+
+	/* getting a pointer to the receiver Lua state */
+	lua_State *Lto = (lua_State *)lua_touserdata(L, 3);
+
+	/* getting the userdata's metatable name in the sender Lua state */
+	lua_getmetatable(L, 2);
+	lua_pushstring(L, "__name");
+	lua_rawget(L, -2);
+
+	mt_name = lua_tolstring(L, -1, &len);
+
+	/* getting the userdata's metatable in the receiver Lua state */
+	luaL_getmetatable(Lto, mt_name);
+
+	if(lua_isnil(Lto, -1)){
+		/* userdata's metatable is not registered in the receiver Lua state  */
+		
+		if(type_ == 1){
+			/* userdata is being transferred to another Lua state */
+			/* this function must leave error messages in both Lua states */
+			lua_pushnil(L);
+			lua_pushstring(L, "userdata's metatable must be registered in the receiver Lua process");
+			
+			lua_settop(Lto, 1);
+			lua_pushnil(Lto);
+			lua_pushstring(Lto, "userdata's metatable must be registered in the receiver Lua process");
+			
+			return 2;
+		}
+		else{
+			/* userdata is being transferred to a container Lua state */
+			/* this function must create (or get) the metatable to be associated to the resulting userdata */
+			lua_pop(Lto, 1);
+			luaL_newmetatable(Lto, mt_name);
+			
+			/* storing the metatable's name, in versions prior to Lua 5.3 */
+			#if (LUA_VERSION_NUM < 503)
+				lua_pushstring(Lto, "__name");
+				lua_pushlstring(Lto, mt_name, len);
+				lua_rawset(Lto, -3);
+			#endif
+		}
+	}
+
+	/* getting the size of the memory block associated to the userdata, in the sender Lua state */
+	size_udata = lua_rawlen(L, 2);
+
+	/* creating the resulting userdata in the receiver Lua state */
+	void *toPointer = lua_newuserdata(Lto, size_udata);
+
+	/* copying the userdata's structure to the receiver Lua state */
+	memcpy(toPointer, udata_pointer, size_udata);
+
+	/* associating the corresponding metatable to the resulting userdata  */
+	lua_pushvalue(Lto, -2);
+	lua_setmetatable(Lto, -2);
+	lua_remove(Lto, -2);
+
+	/* if no error occurs, a sender transfer function returns no values */
+	return 0;
+}
+
+
+/* 
+receives an userdata in a predefined way
+
+params:
 
 type_	: kind of message transfer
 udata_idx	: index within the stack of the sender Lua state in which the userdata to be received is stored 
@@ -2716,21 +4736,435 @@ static int luaproc_recycle_set( lua_State *L ) {
   return 0;
 }
 
-/* wait until there are no more active lua processes */
+/* set the default time slice of new lua processes */
+static int luaproc_set_quantum( lua_State *L ) {
+
+  /* validate parameter is a non negative number */
+  lua_Integer quantum = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, quantum >= 0 && quantum <= INT_MAX, 1,
+                 "time slice must be a non negative number" );
+#if (LUA_VERSION_NUM < 503)
+  luaL_argcheck( L, quantum == 0, 1,
+                 "preemption requires Lua 5.3 or later" );
+#endif
+
+  defaultquantum = (int)quantum;
+
+  return 0;
+}
+
+/* set the maximum number of rounds idle workers spin before parking */
+static int luaproc_set_spin( lua_State *L ) {
+
+  /* validate parameter is a non negative number */
+  lua_Integer rounds = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, rounds >= 0 && rounds <= INT_MAX, 1,
+                 "spin rounds must be a non negative number" );
+
+  sched_set_spin( (int)rounds );
+
+  return 0;
+}
+
+/* return a table with scheduler counters */
+static int luaproc_get_schedstats( lua_State *L ) {
+
+  schedstats stats;
+
+  sched_get_stats( &stats );
+  lua_newtable( L );
+  lua_pushnumber( L, stats.preemptions );
+  lua_setfield( L, -2, "preemptions" );
+  lua_pushnumber( L, stats.scaleups );
+  lua_setfield( L, -2, "scaleups" );
+  lua_pushnumber( L, stats.scaledowns );
+  lua_setfield( L, -2, "scaledowns" );
+  lua_pushnumber( L, stats.spinwakes );
+  lua_setfield( L, -2, "spinwakes" );
+  lua_pushnumber( L, stats.parks );
+  lua_setfield( L, -2, "parks" );
+
+  return 1;
+}
+
+/* suspend the calling lua process for a number of milliseconds without
+   holding a worker */
+static int luaproc_sleep( lua_State *L ) {
+
+  luaproc *self;
+  struct timespec ts;
+  lua_Integer ms = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, ms >= 0, 1, "sleep time must be a non negative number" );
+
+  /* the main lua state is not run by workers; just block its thread */
+  if ( L == mainlp.lstate ) {
+    ts.tv_sec = (time_t)( ms / 1000 );
+    ts.tv_nsec = (long)( ms % 1000 ) * 1000000L;
+    while (( nanosleep( &ts, &ts ) != 0 ) && ( errno == EINTR ));
+    return 0;
+  }
+
+  /* set status and deadline, and yield; the scheduler sets the timer */
+  self = luaproc_getself( L );
+  self->deadline = sched_deadline( ms );
+  self->status = LUAPROC_STATUS_SLEEPING;
+  return lua_yield( L, 0 );
+}
+
+/* read an optional timeout argument, in milliseconds (-1 if absent or nil) */
+static lua_Integer luaproc_opt_timeout( lua_State *L, int arg ) {
+
+  lua_Integer ms;
+
+  if ( lua_isnoneornil( L, arg )) {
+    return -1;
+  }
+  ms = luaL_checkinteger( L, arg );
+  luaL_argcheck( L, ms >= 0, arg, "timeout must be a non negative number" );
+  return ms;
+}
+
+/* return the file descriptor given at an argument, either as a number or as
+   an object with a getfd method (such as a luasocket socket) */
+static int luaproc_check_fd( lua_State *L, int arg ) {
+
+  lua_Number n;
+
+  if ( lua_type( L, arg ) == LUA_TNUMBER ) {
+    n = lua_tonumber( L, arg );
+  } else {
+    luaL_argcheck( L, ( lua_type( L, arg ) == LUA_TUSERDATA ) ||
+                      ( lua_type( L, arg ) == LUA_TTABLE ), arg,
+                   "file descriptor expected" );
+    lua_getfield( L, arg, "getfd" );
+    luaL_argcheck( L, lua_isfunction( L, -1 ), arg,
+                   "file descriptor expected" );
+    lua_pushvalue( L, arg );
+    lua_call( L, 1, 1 );
+    luaL_argcheck( L, lua_type( L, -1 ) == LUA_TNUMBER, arg,
+                   "invalid file descriptor" );
+    n = lua_tonumber( L, -1 );
+    lua_pop( L, 1 );
+  }
+  /* file descriptors are non negative integers; 3.5 is not 3 */
+  luaL_argcheck( L, ( n >= 0 ) && ( n <= INT_MAX ) && ( n == (int)n ), arg,
+                 "invalid file descriptor" );
+  return (int)n;
+}
+
+/* wait on a file descriptor from the main lua state, which is not run by
+   workers, by blocking its thread */
+static int luaproc_main_waitfd( lua_State *L, int fd, int fdmode,
+                                lua_Integer timeout ) {
+
+  int ret;
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = 0;
+  pfd.revents = 0;
+  if ( fdmode & LUAPROC_FD_READ ) {
+    pfd.events |= POLLIN;
+  }
+  if ( fdmode & LUAPROC_FD_WRITE ) {
+    pfd.events |= POLLOUT;
+  }
+  if ( timeout > INT_MAX ) {
+    timeout = INT_MAX;
+  }
+  do {
+    ret = poll( &pfd, 1, ( timeout >= 0 ) ? (int)timeout : -1 );
+  } while (( ret < 0 ) && ( errno == EINTR ));
+
+  if (( ret > 0 ) && !( pfd.revents & POLLNVAL )) {
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  lua_pushnil( L );
+  if ( ret == 0 ) {
+    lua_pushliteral( L, "timeout" );
+  } else if ( ret > 0 ) {
+    lua_pushstring( L, strerror( EBADF ));
+  } else {
+    lua_pushstring( L, strerror( errno ));
+  }
+  return 2;
+}
+
+/* wait until a file descriptor is ready for reading and/or writing, for at
+   most a timeout, without holding a worker */
+static int luaproc_waitfd( lua_State *L ) {
+
+  luaproc *self;
+  int fdmode = 0;
+  int fd = luaproc_check_fd( L, 1 );
+  const char *mode = luaL_optstring( L, 2, "r" );
+  lua_Integer timeout = luaproc_opt_timeout( L, 3 );
+
+  if ( strchr( mode, 'r' ) != NULL ) {
+    fdmode |= LUAPROC_FD_READ;
+  }
+  if ( strchr( mode, 'w' ) != NULL ) {
+    fdmode |= LUAPROC_FD_WRITE;
+  }
+  luaL_argcheck( L, ( fdmode != 0 ) && ( strspn( mode, "rw" ) == strlen( mode )),
+                 2, "invalid mode (expected \"r\", \"w\" or \"rw\")" );
+
+  if ( L == mainlp.lstate ) {
+    return luaproc_main_waitfd( L, fd, fdmode, timeout );
+  }
+
+  /* set status, file descriptor and deadline, and yield; the scheduler
+     hands the file descriptor to its i/o reactor */
+  self = luaproc_getself( L );
+  self->fd = fd;
+  self->fdmode = fdmode;
+  self->deadline = ( timeout >= 0 ) ? sched_deadline( timeout ) : -1;
+  self->status = LUAPROC_STATUS_WAITING_FD;
+  return lua_yield( L, 0 );
+}
+
+/* run a blocking file operation; it does not touch any lua state, so it can
+   be run by any thread */
+static void luaproc_io_run( iojob *job ) {
+
+  int fd;
+  char *buf;
+  ssize_t ret;
+  size_t cap, n = 0;
+  struct stat st;
+
+  if ( job->writing ) {
+    fd = open( job->path, O_WRONLY | O_CREAT |
+                          (( job->offset < 0 ) ? O_APPEND : 0 ), 0666 );
+  } else {
+    fd = open( job->path, O_RDONLY );
+  }
+  if ( fd < 0 ) {
+    job->err = errno;
+    return;
+  }
+
+  if ( job->writing ) {
+    while ( n < job->len ) {
+      if ( job->offset < 0 ) {
+        ret = write( fd, job->data + n, job->len - n );
+      } else {
+        ret = pwrite( fd, job->data + n, job->len - n,
+                      (off_t)( job->offset + n ));
+      }
+      if ( ret < 0 ) {
+        if ( errno == EINTR ) {
+          continue;
+        }
+        job->err = errno;
+        break;
+      }
+      n += (size_t)ret;
+    }
+  } else {
+    /* without a length, read up to the end of the file (which may grow) */
+    cap = job->len;
+    if ( cap == (size_t)-1 ) {
+      cap = (( fstat( fd, &st ) == 0 ) && ( st.st_size > job->offset )) ?
+            (size_t)( st.st_size - job->offset ) : 0;
+    }
+    job->data = (char *)malloc( cap + 1 );
+    while ( job->data != NULL ) {
+      if ( n == cap ) {
+        if ( job->len != (size_t)-1 ) {
+          break;
+        }
+        /* the file grew: make room for more */
+        cap = 2 * cap + 4096;
+        if (( buf = (char *)realloc( job->data, cap + 1 )) == NULL ) {
+          break;
+        }
+        job->data = buf;
+      }
+      ret = pread( fd, job->data + n, cap - n, (off_t)( job->offset + n ));
+      if ( ret < 0 ) {
+        if ( errno == EINTR ) {
+          continue;
+        }
+        job->err = errno;
+        break;
+      }
+      if ( ret == 0 ) {
+        break;
+      }
+      n += (size_t)ret;
+    }
+    if ( job->data == NULL ) {
+      job->err = ENOMEM;
+    }
+  }
+  job->len = n;
+  close( fd );
+}
+
+/* push the results of a blocking file operation onto a lua state and free
+   it. returns the number of results */
+static int luaproc_io_results( lua_State *L, iojob *job ) {
+
+  int nres = 1;
+
+  if ( job->err != 0 ) {
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( job->err ));
+    nres = 2;
+  } else if ( job->writing ) {
+    lua_pushinteger( L, (lua_Integer)job->len );
+  } else {
+    lua_pushlstring( L, job->data, job->len );
+  }
+  free( job->path );
+  free( job->data );
+  free( job );
+  return nres;
+}
+
+#if (LUA_VERSION_NUM >= 502)
+/* push the results of an offloaded file operation once the lua process that
+   offloaded it is resumed, so they are pushed by its own (protected) resume
+   rather than by the offload thread */
+#if (LUA_VERSION_NUM >= 503)
+static int luaproc_io_resumed( lua_State *L, int status, lua_KContext ctx ) {
+  (void)status; (void)ctx;
+#else
+static int luaproc_io_resumed( lua_State *L ) {
+#endif
+  luaproc *self = luaproc_getself( L );
+  iojob *job = self->job;
+  self->job = NULL;
+  return luaproc_io_results( L, job );
+}
+#endif
+
+/* run a blocking file operation: offload it, if called by a lua process, or
+   run it right away, if called by the main lua state (which is not run by
+   workers) */
+static int luaproc_io_call( lua_State *L, iojob *job ) {
+
+  luaproc *self;
+
+  if (( job->path == NULL ) || (( job->writing ) && ( job->data == NULL ))) {
+    free( job->path );
+    free( job->data );
+    free( job );
+    return luaL_error( L, "not enough memory" );
+  }
+
+  if ( L == mainlp.lstate ) {
+    luaproc_io_run( job );
+    return luaproc_io_results( L, job );
+  }
+
+  /* set status and job, and yield; the scheduler hands the job to an offload
+     thread and the results are pushed once it is done */
+  self = luaproc_getself( L );
+  self->job = job;
+  self->status = LUAPROC_STATUS_OFFLOADED;
+#if (LUA_VERSION_NUM >= 502)
+  return lua_yieldk( L, 0, 0, luaproc_io_resumed );
+#else
+  return lua_yield( L, 0 );
+#endif
+}
+
+/* create a blocking file operation job for a file path */
+static iojob *luaproc_io_newjob( lua_State *L, int writing ) {
+
+  size_t len;
+  const char *path = luaL_checklstring( L, 1, &len );
+  iojob *job = (iojob *)malloc( sizeof( iojob ));
+
+  if ( job == NULL ) {
+    luaL_error( L, "not enough memory" );
+  }
+  job->writing = writing;
+  job->data = NULL;
+  job->err = 0;
+  if (( job->path = (char *)malloc( len + 1 )) != NULL ) {
+    memcpy( job->path, path, len + 1 );
+  }
+  return job;
+}
+
+/* read (up to a length of) a file from an offset, off the workers */
+static int luaproc_io_read( lua_State *L ) {
+
+  iojob *job;
+  lua_Integer offset = luaL_optinteger( L, 2, 0 );
+  lua_Integer len = luaL_optinteger( L, 3, -1 );
+
+  luaL_argcheck( L, offset >= 0, 2, "offset must be a non negative number" );
+  luaL_argcheck( L, ( len >= 0 ) || lua_isnoneornil( L, 3 ), 3,
+                 "length must be a non negative number" );
+  job = luaproc_io_newjob( L, FALSE );
+  job->offset = (long long)offset;
+  job->len = ( len >= 0 ) ? (size_t)len : (size_t)-1;
+  return luaproc_io_call( L, job );
+}
+
+/* write data to a file at an offset (or at its end), off the workers */
+static int luaproc_io_write( lua_State *L ) {
+
+  iojob *job;
+  size_t len;
+  const char *data = luaL_checklstring( L, 2, &len );
+  lua_Integer offset = luaL_optinteger( L, 3, -1 );
+
+  luaL_argcheck( L, ( offset >= 0 ) || lua_isnoneornil( L, 3 ), 3,
+                 "offset must be a non negative number" );
+  job = luaproc_io_newjob( L, TRUE );
+  job->offset = (long long)offset;
+  job->len = len;
+  if (( job->data = (char *)malloc( len > 0 ? len : 1 )) != NULL ) {
+    memcpy( job->data, data, len );
+  }
+  return luaproc_io_call( L, job );
+}
+
+/* wait until there are no more active lua processes; if asked to, the calling
+   thread runs ready lua processes while it waits */
 static int luaproc_wait( lua_State *L ) {
-  sched_wait();
+  if ( lua_toboolean( L, 1 )) {
+    sched_wait_help();
+  } else {
+    sched_wait();
+  }
   return 0;
 }
 
+/* return the id of the worker pool named at a given (optional) argument */
+static int luaproc_check_pool( lua_State *L, int arg ) {
+
+  int poolid;
+  const char *name = luaL_optstring( L, arg, LUAPROC_SCHED_DEFAULT_POOL );
+
+  poolid = sched_find_pool( name );
+  if ( poolid < 0 ) {
+    luaL_argerror( L, arg, lua_pushfstring( L, "unknown worker pool '%s'",
+                                                name ));
+  }
+
+  return poolid;
+}
+
 /* set number of workers (creates or destroys accordingly) */
 static int luaproc_set_numworkers( lua_State *L ) {
 
   /* validate parameter is a positive number */
-  lua_Integer numworkers = luaL_checkinteger( L, -1 );
+  lua_Integer numworkers = luaL_checkinteger( L, 1 );
+  int poolid = luaproc_check_pool( L, 2 );
   luaL_argcheck( L, numworkers > 0, 1, "number of workers must be positive" );
+  luaL_argcheck( L, numworkers <= LUAPROC_SCHED_MAX_WORKERS, 1,
+                 "too many workers" );
 
   /* set number of threads; signal error on failure */
-  if ( sched_set_numworkers( numworkers ) == LUAPROC_SCHED_PTHREAD_ERROR ) {
+  if ( sched_set_numworkers( poolid, numworkers ) ==
+       LUAPROC_SCHED_PTHREAD_ERROR ) {
       luaL_error( L, "failed to create worker" );
   } 
 
@@ -2739,10 +5173,179 @@ static int luaproc_set_numworkers( lua_State *L ) {
 
 /* return the number of active workers */
 static int luaproc_get_numworkers( lua_State *L ) {
-  lua_pushnumber( L, sched_get_numworkers( ));
+  lua_pushnumber( L, sched_get_numworkers( luaproc_check_pool( L, 1 )));
   return 1;
 }
 
+/* create a named worker pool */
+static int luaproc_new_pool( lua_State *L ) {
+
+  size_t len;
+  int ret;
+  const char *name = luaL_checklstring( L, 1, &len );
+  lua_Integer numworkers = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, len > 0 && len <= LUAPROC_SCHED_POOL_NAME_MAX, 1,
+                 "invalid worker pool name" );
+  luaL_argcheck( L, numworkers > 0, 2, "number of workers must be positive" );
+  luaL_argcheck( L, numworkers <= LUAPROC_SCHED_MAX_WORKERS, 2,
+                 "too many workers" );
+
+  ret = sched_new_pool( name, numworkers );
+  if ( ret == LUAPROC_SCHED_POOL_ERROR ) {
+    if ( sched_find_pool( name ) >= 0 ) {
+      luaL_error( L, "worker pool '%s' already exists", name );
+    }
+    luaL_error( L, "too many worker pools" );
+  } else if ( ret == LUAPROC_SCHED_PTHREAD_ERROR ) {
+    luaL_error( L, "failed to create worker" );
+  }
+
+  return 0;
+}
+
+/* set the cpu affinity of the workers of a pool */
+static int luaproc_set_affinity( lua_State *L ) {
+
+  int cpus[ LUAPROC_SCHED_MAX_WORKERS ];
+  int i, n = 0, affinity;
+  int poolid = luaproc_check_pool( L, 2 );
+  lua_Integer cpu;
+
+  if ( lua_type( L, 1 ) == LUA_TTABLE ) {
+    affinity = LUAPROC_SCHED_AFFINITY_SET;
+    n = (int)lua_rawlen( L, 1 );
+    luaL_argcheck( L, n > 0 && n <= LUAPROC_SCHED_MAX_WORKERS, 1,
+                   "invalid number of cpus" );
+    for ( i = 0; i < n; i++ ) {
+      lua_rawgeti( L, 1, i + 1 );
+      cpu = lua_tointeger( L, -1 );
+      luaL_argcheck( L, lua_isnumber( L, -1 ) && cpu >= 0 && cpu <= INT_MAX,
+                     1, "cpu numbers must be non negative integers" );
+      cpus[ i ] = (int)cpu;
+      lua_pop( L, 1 );
+    }
+  } else {
+    const char *const modes[] = { "none", "auto", NULL };
+    affinity = ( luaL_checkoption( L, 1, NULL, modes ) == 0 ) ?
+               LUAPROC_SCHED_AFFINITY_NONE : LUAPROC_SCHED_AFFINITY_AUTO;
+  }
+
+  if ( sched_set_affinity( poolid, affinity, cpus, n ) != LUAPROC_SCHED_OK ) {
+    luaL_error( L, "failed to set cpu affinity" );
+  }
+
+  return 0;
+}
+
+/* read an optional non negative integer field of a settings table */
+static int luaproc_opt_intfield( lua_State *L, int idx, const char *k,
+                                 int def ) {
+
+  lua_Integer v = def;
+
+  lua_getfield( L, idx, k );
+  if ( !lua_isnil( L, -1 )) {
+    v = lua_tointeger( L, -1 );
+    if (( !lua_isnumber( L, -1 )) || ( v < 0 ) || ( v > INT_MAX )) {
+      luaL_error( L, "'%s' must be a non negative number", k );
+    }
+  }
+  lua_pop( L, 1 );
+
+  return (int)v;
+}
+
+/* enable or disable automatic scaling of the number of workers of a pool */
+static int luaproc_autoscale( lua_State *L ) {
+
+  schedscale scale;
+  int poolid = luaproc_check_pool( L, 2 );
+
+  if (( lua_type( L, 1 ) == LUA_TBOOLEAN ) && ( !lua_toboolean( L, 1 ))) {
+    sched_set_autoscale( poolid, NULL );
+    return 0;
+  }
+  luaL_checktype( L, 1, LUA_TTABLE );
+  scale.minworkers = luaproc_opt_intfield( L, 1, "min", 1 );
+  scale.maxworkers = luaproc_opt_intfield( L, 1, "max",
+                                           LUAPROC_SCHED_MAX_WORKERS );
+  scale.threshold = luaproc_opt_intfield( L, 1, "threshold",
+                                          LUAPROC_SCHED_SCALE_THRESHOLD );
+  scale.cooldown = luaproc_opt_intfield( L, 1, "cooldown",
+                                         LUAPROC_SCHED_SCALE_COOLDOWN );
+  luaL_argcheck( L, scale.minworkers > 0, 1,
+                 "minimum number of workers must be positive" );
+  luaL_argcheck( L, scale.minworkers <= scale.maxworkers &&
+                 scale.maxworkers <= LUAPROC_SCHED_MAX_WORKERS, 1,
+                 "invalid maximum number of workers" );
+
+  if ( sched_set_autoscale( poolid, &scale ) != LUAPROC_SCHED_OK ) {
+    luaL_error( L, "failed to create autoscaler thread" );
+  }
+
+  return 0;
+}
+
+/* read the settings table optionally given to newproc */
+static void luaproc_check_procopts( lua_State *L, int idx, procopts *opts ) {
+
+  static const char *const priorities[] = { "high", "normal", "low", NULL };
+  lua_Integer quantum;
+  const char *priority;
+  int i;
+
+  opts->quantum = defaultquantum;
+  opts->priority = LUAPROC_PRIORITY_NORMAL;
+  opts->pool = 0;  /* default pool */
+
+  if ( lua_isnoneornil( L, idx )) {
+    return;
+  }
+  luaL_checktype( L, idx, LUA_TTABLE );
+
+  lua_getfield( L, idx, "quantum" );
+  if ( !lua_isnil( L, -1 )) {
+    quantum = lua_tointeger( L, -1 );
+    if (( !lua_isnumber( L, -1 )) || ( quantum < 0 ) || ( quantum > INT_MAX )) {
+      luaL_error( L, "time slice must be a non negative number" );
+    }
+#if (LUA_VERSION_NUM < 503)
+    if ( quantum > 0 ) {
+      luaL_error( L, "preemption requires Lua 5.3 or later" );
+    }
+#endif
+    opts->quantum = (int)quantum;
+  }
+  lua_pop( L, 1 );
+
+  lua_getfield( L, idx, "priority" );
+  if ( !lua_isnil( L, -1 )) {
+    priority = lua_tostring( L, -1 );
+    for ( i = 0; ( priority != NULL ) && ( priorities[ i ] != NULL ); i++ ) {
+      if ( strcmp( priority, priorities[ i ] ) == 0 ) {
+        break;
+      }
+    }
+    if (( priority == NULL ) || ( priorities[ i ] == NULL )) {
+      luaL_error( L, "priority must be 'high', 'normal' or 'low'" );
+    }
+    opts->priority = i;
+  }
+  lua_pop( L, 1 );
+
+  lua_getfield( L, idx, "pool" );
+  if ( !lua_isnil( L, -1 )) {
+    if ( lua_type( L, -1 ) != LUA_TSTRING ) {
+      luaL_error( L, "worker pool name must be a string" );
+    }
+    opts->pool = sched_find_pool( lua_tostring( L, -1 ));
+    if ( opts->pool < 0 ) {
+      luaL_error( L, "unknown worker pool '%s'", lua_tostring( L, -1 ));
+    }
+  }
+  lua_pop( L, 1 );
+}
+
 /* create and schedule a new lua process */
 static int luaproc_create_newproc( lua_State *L ) {
 
@@ -2750,8 +5353,13 @@ static int luaproc_create_newproc( lua_State *L ) {
   luaproc *lp;
   luaL_Buffer buff;
   const char *code;
-  int d;
+  int d, numa;
   int lt = lua_type( L, 1 );
+  procopts opts;
+  schedmempolicy mempolicy;
+
+  /* read optional settings before the arguments are rearranged */
+  luaproc_check_procopts( L, 2, &opts );
 
   /* check function argument type - must be function or string; in case it is
      a function, dump it into a binary string */
@@ -2776,6 +5384,9 @@ static int luaproc_create_newproc( lua_State *L ) {
   /* get pointer to code string */
   code = lua_tolstring( L, 1, &len );
 
+  /* place new lua states on the numa node of the workers that run them */
+  numa = sched_numa_prefer( opts.pool, &mempolicy );
+
   /* get exclusive access to recycled lua processes list */
   pthread_mutex_lock( &mutex_recycle_list );
 
@@ -2793,10 +5404,22 @@ static int luaproc_create_newproc( lua_State *L ) {
   /* release exclusive access to recycled lua processes list */
   pthread_mutex_unlock( &mutex_recycle_list );
 
+  if ( numa ) {
+    sched_numa_restore( &mempolicy );
+  }
+
   /* init lua process */
-  lp->status = LUAPROC_STATUS_IDLE;
-  lp->args   = 0;
-  lp->chan   = NULL;
+  lp->status  = LUAPROC_STATUS_IDLE;
+  lp->args    = 0;
+  lp->chan    = NULL;
+  lp->waitlist = NULL;
+  lp->quantum = opts.quantum;
+  lp->priority = opts.priority;
+  lp->pool = opts.pool;
+  lp->timedwait = FALSE;
+  lp->timer = -1;
+  lp->job = NULL;
+  lp->lfbinds = NULL;
 
   /* load code in lua process */
   luaproc_loadbuffer( L, lp->lstate, code, len );
@@ -2999,22 +5622,28 @@ params:
 
 chname	: channel's name
 n_elems	: number of Lua processes involved in the operation
+timeout	: optional, maximum time (in milliseconds) to wait for the others
 
 return values:
 
 TRUE						: once all the Lua processes involved in the operation have reached this channel
 a nil value plus error messages	: if the channel specified in the call does not exist
+nil and "timeout"			: if the timeout expired before the others reached this channel
 
 */
 static int luaproc_barrier(lua_State *L){
 	
 	//name of the channel on which the operation is performed
-	const char *chname = luaL_checkstring( L, 1 );
+	const char *chname = channel_checkname( L, 1 );
 	
 	//number of Lua processes involved in the operation
 	int n_elems = luaL_checkinteger( L, 2 );
 	
+	//maximum time to wait for the others (negative if there is no limit)
+	lua_Integer timeout = luaproc_opt_timeout( L, 3 );
+	
 	luaproc *self = NULL;
+	luaproc *lp;
 	
 	//gets the Lua process executing this function
 	if (L == mainlp.lstate)
@@ -3023,7 +5652,7 @@ static int luaproc_barrier(lua_State *L){
 		self = luaproc_getself( L );
 	
 	//gets and locks the channel on which the operation will be performed
-	channel *ch = channel_locked_get(chname);
+	channel *ch = channel_locked_arg( L, 1 );
 	
 	/* if channel is not found, return an error to lua */
 	if ( ch == NULL ) {
@@ -3037,6 +5666,12 @@ static int luaproc_barrier(lua_State *L){
 		
 		//If not, allocates memory for the structure used for handling a barrier operation
 		ch->barrier = malloc(sizeof(struct stbarrier));
+		if ( ch->barrier == NULL ) {
+			luaproc_unlock_channel( ch );
+			lua_pushnil( L );
+			lua_pushliteral( L, "out of memory" );
+			return 2;
+		}
 		
 		//initializes the queue storing the involved Lua processes
 		list_init(&ch->barrier->elems);
@@ -3059,27 +5694,26 @@ static int luaproc_barrier(lua_State *L){
 		lua_pushboolean(self->lstate, TRUE);
 		self->args = 1;
 		
+		//indicates the channel on which this Lua process waits (and Luaproc must unlock after releasing the thread executing it)
+		self->chan = ch;
+		channel_set_timeout(self, timeout);
+		
 		if ( self->lstate == mainlp.lstate ){
 			
 			//in case this is the main Lua process
 			ch->barrier->mainlp = self;
+			channel_start_timeout(self, NULL);
 			
-			pthread_mutex_lock( &mutex_mainls );
-			luaproc_unlock_channel( ch );
-			pthread_cond_wait(&cond_mainls_sendrecv, &mutex_mainls);
-			pthread_mutex_unlock( &mutex_mainls );
-			return mainlp.args;
+			return luaproc_main_wait( ch );
 		}
 		
 		//inserts this Lua process in the queue storing the Lua processes involved in the operation
 		list_insert(&ch->barrier->elems, self);
+		channel_start_timeout(self, &ch->barrier->elems);
 		
 		//indicates this Lua process will block while performing a barrier operation
 		self->status = LUAPROC_BLOCKED_BARRIER;
 		
-		//indicates the channel Luaproc must unlock after releasing the thread executing this Lua process
-		self->chan = ch;
-		
 		//releases the worker thread executing this Lua process
 		return lua_yield( L, lua_gettop( L ));
 	}
@@ -3087,12 +5721,18 @@ static int luaproc_barrier(lua_State *L){
 	//if this Lua process is the last one in reaching the barrier, it resumes the execution of the Lua processes blocked in this channel
 	lua_pushboolean(self->lstate, TRUE);
 	
+	//the timeouts of the blocked Lua processes are stopped before resuming them
+	//their argument count was reset when they yielded, so it is set again for the true they pushed
+	for (lp = ch->barrier->elems.head; lp != NULL; lp = lp->next){
+		channel_stop_timeout(lp);
+		lp->args = 1;
+	}
+	
 	sched_queue_list_proc(&ch->barrier->elems);
 	
 	if(ch->barrier->mainlp != NULL){
-		pthread_mutex_lock( &mutex_mainls );
-		pthread_cond_signal( &cond_mainls_sendrecv );
-		pthread_mutex_unlock( &mutex_mainls );
+		channel_stop_timeout(ch->barrier->mainlp);
+		luaproc_wake_main();
 	}
 	
 	//free the strucure used for handling the barrier operation
@@ -3106,24 +5746,150 @@ static int luaproc_barrier(lua_State *L){
 	return 1;
 }
 
-// sends a message either synchronously or asynchronously 
-static int luaproc_send( lua_State *L ) {
+/* send a message through a lock-free async channel the caller holds a
+   reference to (dropped by this function), waiting for room up to a timeout,
+   if any. the channel's lock is only taken to wait for room */
+static int luaproc_lf_send( lua_State *L, channel *chan, const char *chname,
+                            lua_Integer timeout, int nowait ) {
+
+	lfqueue *q = chan->lfq;
+	message *msg;
+	luaproc *self;
+	int ret;
+
+	luaproc_lf_attach( L, chan, chname, FALSE );
+	ret = luaproc_lf_reserve( chan );
+	while ( TRUE ) {
+		if (( ret == LUAPROC_LFQUEUE_FULL ) && ( !nowait )) {
+			
+			//announces itself as waiting before looking for room once more, so a receiver freeing room meanwhile wakes it up
+			pthread_mutex_lock( &chan->mutex );
+			__atomic_add_fetch( &q->sendwait, 1, __ATOMIC_SEQ_CST );
+			ret = luaproc_lf_reserve( chan );
+			
+			if ( ret == LUAPROC_LFQUEUE_FULL ) {
+				if ( L == mainlp.lstate ) {
+					/* sending process is the parent (main) Lua state - block it */
+					mainlp.chan = chan;
+					channel_set_timeout( &mainlp, timeout );
+					luaproc_queue_sender( &mainlp );
+					return luaproc_main_wait( chan );
+				} else {
+					/* a receiver stores the message once it frees room - set status, block and yield */
+					self = luaproc_getself( L );
+					if ( self != NULL ) {
+						self->status = LUAPROC_STATUS_TMP_SEND;
+						self->chan   = chan;
+						channel_set_timeout( self, timeout );
+					}
+					/* yield. channel will be unlocked by the scheduler */
+					return lua_yield( L, lua_gettop( L ));
+				}
+			}
+			
+			__atomic_sub_fetch( &q->sendwait, 1, __ATOMIC_SEQ_CST );
+			pthread_mutex_unlock( &chan->mutex );
+		}
+		
+		if ( ret != LUAPROC_LFQUEUE_OK ) {
+			channel_release( chan );
+			lua_pushnil( L );
+			if ( ret == LUAPROC_LFQUEUE_GONE ) {
+				lua_pushfstring( L, "channel '%s' does not exist", chname );
+			} else {
+				lua_pushfstring( L, "channel '%s' is full", chname );
+			}
+			return 2;
+		}
+		
+		msg = message_encode( L );
+		if (( msg == NULL ) || ( luaproc_lf_post( chan, msg ))) {
+			break;
+		}
+		
+		//messages stored while this one was being encoded took the memory the channel allows, so it looks for room again
+		message_free( msg );
+		__atomic_sub_fetch( &q->count, 1, __ATOMIC_SEQ_CST );
+		ret = LUAPROC_LFQUEUE_FULL;
+	}
+	
+	if ( msg == NULL ) {
+		//the room reserved for the message is given back
+		__atomic_sub_fetch( &q->count, 1, __ATOMIC_SEQ_CST );
+	}
+	
+	if ( luaproc_lf_waiting( chan )) {
+		luaproc_lf_wake( chan );
+	}
+	channel_release( chan );
+	
+	if ( msg != NULL ) { /* was store successful? */
+		lua_pushboolean( L, TRUE );
+		return 1;
+	} else { /* nil and error msg already in stack */
+		return 2;
+	}
+}
+
+/* make a Lua process sending through a full locked async channel wait for
+   room up to a timeout, if any (with nowait set, fail right away). a receiver
+   stores its message once it frees room */
+static int luaproc_async_wait_room( lua_State *L, channel *chan, const char *chname,
+                                    lua_Integer timeout, int nowait ) {
+
+	luaproc *self;
+
+	if ( nowait ) {
+		luaproc_unlock_channel( chan );
+		lua_pushnil( L );
+		lua_pushfstring( L, "channel '%s' is full", chname );
+		return 2;
+	}
+	
+	if ( L == mainlp.lstate ) {
+		/* sending process is the parent (main) Lua state - block it */
+		mainlp.chan = chan;
+		channel_set_timeout( &mainlp, timeout );
+		luaproc_queue_sender( &mainlp );
+		return luaproc_main_wait( chan );
+	} else {
+		/* a receiver stores the message once it frees room - set status, block and yield */
+		self = luaproc_getself( L );
+		if ( self != NULL ) {
+			self->status = LUAPROC_STATUS_TMP_SEND;
+			self->chan   = chan;
+			channel_set_timeout( self, timeout );
+		}
+		/* yield. channel will be unlocked by the scheduler */
+		return lua_yield( L, lua_gettop( L ));
+	}
+}
+
+// sends a message either synchronously or asynchronously, waiting for a receiver up to a timeout (negative if there is no limit)
+/* send a message, waiting for a receiver (sync channels) or for room (full
+   async channels) up to a timeout, if any. with nowait set, fail instead of
+   waiting */
+static int luaproc_send_timeout( lua_State *L, lua_Integer timeout, int nowait ) {
 
 	int ret;
 	channel *chan;
+	message *msg;
 	luaproc *dstlp, *self;
-	const char *chname = luaL_checkstring( L, 1 );
+	const char *chname = channel_checkname( L, 1 );
 
-	chan = channel_locked_get( chname );
+	chan = channel_arg( L, 1 );
+	if (( chan != NULL ) && ( chan->lfq != NULL )) {
+		return luaproc_lf_send( L, chan, chname, timeout, nowait );
+	}
 	/* if channel is not found, return an error to lua */
-	if ( chan == NULL ) {
+	if (( chan == NULL ) || ( !channel_lock( chan ))) {
 		lua_pushnil( L );
 		lua_pushfstring( L, "channel '%s' does not exist", chname );
 		return 2;
 	}	
 
 	/* remove first lua process, if any, from channel's receive list */
-	dstlp = list_remove( &chan->recv );
+	dstlp = channel_dequeue( &chan->recv );
 
 	if ( dstlp != NULL ) { /* found a receiver? */
 		/* unlock channel access */
@@ -3135,9 +5901,7 @@ static int luaproc_send( lua_State *L ) {
 		dstlp->args = lua_gettop( dstlp->lstate ) - 1; 
 		if ( dstlp->lstate == mainlp.lstate ) {
 			/* if sending process is the parent (main) Lua state, unblock it */
-			pthread_mutex_lock( &mutex_mainls );
-			pthread_cond_signal( &cond_mainls_sendrecv );
-			pthread_mutex_unlock( &mutex_mainls );
+			luaproc_wake_main();
 		} else {
 			/* schedule receiving lua process for execution */
 			sched_queue_proc( dstlp );
@@ -3155,33 +5919,72 @@ static int luaproc_send( lua_State *L ) {
 	//if there is no a matching receiver Lua process
 	else if(chan->type == 0){
 		
+		if ( nowait ) {
+			luaproc_unlock_channel( chan );
+			lua_pushnil( L );
+			lua_pushfstring( L, "no receivers waiting on channel '%s'", chname );
+			return 2;
+		}
+		
 		//in a synchronous sending, this Lua process will block
 		if ( L == mainlp.lstate ) {
 			/* sending process is the parent (main) Lua state - block it */
 			mainlp.chan = chan;
+			channel_set_timeout( &mainlp, timeout );
 			luaproc_queue_sender( &mainlp );
-			luaproc_unlock_channel( chan );
-			pthread_mutex_lock( &mutex_mainls );
-			pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
-			pthread_mutex_unlock( &mutex_mainls );
-			return mainlp.args;
+			return luaproc_main_wait( chan );
 		} else {
 			/* sending process is a standard luaproc - set status, block and yield */
 			self = luaproc_getself( L );
 			if ( self != NULL ) {
 				self->status = LUAPROC_STATUS_BLOCKED_SEND;
 				self->chan   = chan;
+				channel_set_timeout( self, timeout );
 			}
 			/* yield. channel will be unlocked by the scheduler */
 			return lua_yield( L, lua_gettop( L ));
 		}
 	}
+	//a full asynchronous channel makes this Lua process wait for room
+	else if ( channel_is_full( chan )) {
+		return luaproc_async_wait_room( L, chan, chname, timeout, nowait );
+	}
 	else{
 		
-		//in an asynchronous sending, this Lua process must copy the message to a container Lua state
-		ret = luaproc_async_copyvalues( L, chan->lstate, to_temp);
+		//in an asynchronous sending, the message is encoded without holding the channel, with room reserved for it
+		chan->msgs.reserved++;
+		pthread_mutex_unlock( &chan->mutex );
+		msg = message_encode( L );
+		pthread_mutex_lock( &chan->mutex );
+		chan->msgs.reserved--;
+		
+		//messages stored meanwhile may have taken the memory the channel allows, so it waits for room as if it found the channel full
+		if (( msg != NULL ) && ( !chan->destroyed ) && ( channel_bytes_full( chan ))) {
+			message_free( msg );
+			return luaproc_async_wait_room( L, chan, chname, timeout, nowait );
+		}
+		
+		ret = FALSE;
+		if ( msg == NULL ) {
+			/* nil and error msg already in stack */
+		} else if ( chan->destroyed ) {
+			message_free( msg );
+			lua_pushnil( L );
+			lua_pushfstring( L, "channel '%s' does not exist", chname );
+		} else if ( !luaproc_async_post( chan, msg )) {
+			message_free( msg );
+			lua_pushnil( L );
+			lua_pushstring( L, "not enough memory to store the message" );
+		} else {
+			ret = TRUE;
+		}
+		
+		//if the message was not stored, the room reserved for it goes to the Lua processes waiting for room
+		if ( ret == FALSE ) {
+			luaproc_async_admit( chan );
+		}
 		
-		//after copying the message, it releases the channel
+		//after storing the message, it releases the channel
 		luaproc_unlock_channel( chan );
 		
 		if ( ret == TRUE ) { /* was store successful? */
@@ -3193,20 +5996,112 @@ static int luaproc_send( lua_State *L ) {
 	}
 }
 
+/* sends a message */
+static int luaproc_send( lua_State *L ) {
+	return luaproc_send_timeout( L, -1, FALSE );
+}
+
+/* sends a message, waiting for a receiver up to a timeout (in milliseconds) */
+static int luaproc_timedsend( lua_State *L ) {
+
+	lua_Integer timeout;
+
+	channel_checkname( L, 1 );
+	luaL_checkany( L, 2 );
+	timeout = luaproc_opt_timeout( L, 2 );
+	/* the timeout is not part of the message */
+	lua_remove( L, 2 );
+	return luaproc_send_timeout( L, timeout, FALSE );
+}
+
+/* sends a message only if it does not have to wait for a receiver or for room
+   in the channel */
+static int luaproc_trysend( lua_State *L ) {
+	return luaproc_send_timeout( L, -1, TRUE );
+}
+
+/* receive a message from a lock-free async channel the caller holds a
+   reference to (dropped by this function), waiting for a sender up to a
+   timeout, if any. the channel's lock is only taken to wait for a sender */
+static int luaproc_lf_receive( lua_State *L, channel *chan, const char *chname,
+                               lua_Integer timeout ) {
+
+	luaproc *self;
+	int ret;
+
+	luaproc_lf_attach( L, chan, chname, TRUE );
+	
+	//ensures the receiver's stack to store only the channel's name 
+	lua_settop( L, 1 );
+	
+	ret = luaproc_lf_fetch( chan, L );
+	if ( ret == -1 ) {
+		
+		if ( !channel_lock( chan )) {
+			lua_pushnil( L );
+			lua_pushfstring( L, "channel '%s' does not exist", chname );
+			return 2;
+		}
+		
+		//announces itself as waiting before looking for a message once more, so a sender storing one meanwhile wakes it up
+		__atomic_add_fetch( &chan->lfq->recvwait, 1, __ATOMIC_SEQ_CST );
+		ret = luaproc_lf_fetch( chan, L );
+		
+		if ( ret == -1 ) {
+			if ( L == mainlp.lstate ) {
+				/*  receiving process is the parent (main) Lua state - block it */
+				mainlp.chan = chan;
+				channel_set_timeout( &mainlp, timeout );
+				luaproc_queue_receiver( &mainlp );
+				return luaproc_main_wait( chan );
+			} else {
+				self = luaproc_getself( L );
+				if ( self != NULL ) {
+					self->status = LUAPROC_STATUS_TMP_RECV;
+					self->chan   = chan;
+					channel_set_timeout( self, timeout );
+				}
+				/* yield. channel will be unlocked by the scheduler */
+				return lua_yield( L, lua_gettop( L ));
+			}
+		}
+		
+		__atomic_sub_fetch( &chan->lfq->recvwait, 1, __ATOMIC_SEQ_CST );
+		pthread_mutex_unlock( &chan->mutex );
+	}
+	
+	//the room freed goes to the senders waiting for it
+	if ( luaproc_lf_waiting( chan )) {
+		luaproc_lf_wake( chan );
+	}
+	channel_release( chan );
+	
+	if ( ret == TRUE ) { /* was receive successful? */
+		return lua_gettop( L ) - 1; 
+	} else { /* nil and error msg already in stack */
+		return 2;
+	}
+}
+
 /* receives a message sent either synchronously or asynchronously */
 static int luaproc_receive( lua_State *L ) {
 
 	int ret, nargs;
 	channel *chan;
 	luaproc *srclp, *self;
-	const char *chname = luaL_checkstring( L, 1 );
+	const char *chname = channel_checkname( L, 1 );
+	/* maximum time to wait for a sender (negative if there is no limit) */
+	lua_Integer timeout = luaproc_opt_timeout( L, 3 );
 
 	/* get number of arguments passed to function */
 	nargs = lua_gettop( L );
 
-	chan = channel_locked_get( chname );
+	chan = channel_arg( L, 1 );
+	if (( chan != NULL ) && ( chan->lfq != NULL )) {
+		return luaproc_lf_receive( L, chan, chname, timeout );
+	}
 	/* if channel is not found, return an error to Lua */
-	if ( chan == NULL ) {
+	if (( chan == NULL ) || ( !channel_lock( chan ))) {
 		lua_pushnil( L );
 		lua_pushfstring( L, "channel '%s' does not exist", chname );
 		return 2;
@@ -3216,7 +6111,7 @@ static int luaproc_receive( lua_State *L ) {
 	if(chan->type == 0){
 
 		/* remove first lua process, if any, from channels' send list */
-		srclp = list_remove( &chan->send );
+		srclp = channel_dequeue( &chan->send );
 
 		if ( srclp != NULL ) {  /* found a sender? */
 
@@ -3236,9 +6131,7 @@ static int luaproc_receive( lua_State *L ) {
 
 			if ( srclp->lstate == mainlp.lstate ) {
 				/* if sending process is the parent (main) Lua state, unblock it */
-				pthread_mutex_lock( &mutex_mainls );
-				pthread_cond_signal( &cond_mainls_sendrecv );
-				pthread_mutex_unlock( &mutex_mainls );
+				luaproc_wake_main();
 			} else {
 				/* otherwise, schedule process for execution */
 				sched_queue_proc( srclp );
@@ -3265,12 +6158,9 @@ static int luaproc_receive( lua_State *L ) {
 				if ( L == mainlp.lstate ) {
 					/*  receiving process is the parent (main) Lua state - block it */
 					mainlp.chan = chan;
+					channel_set_timeout( &mainlp, timeout );
 					luaproc_queue_receiver( &mainlp );
-					luaproc_unlock_channel( chan );
-					pthread_mutex_lock( &mutex_mainls );
-					pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
-					pthread_mutex_unlock( &mutex_mainls );
-					return mainlp.args;
+					return luaproc_main_wait( chan );
 				} else {
 					/* receiving process is a standard luaproc - set status, block and 
 					yield */
@@ -3278,6 +6168,7 @@ static int luaproc_receive( lua_State *L ) {
 					if ( self != NULL ) {
 						self->status = LUAPROC_STATUS_BLOCKED_RECV;
 						self->chan   = chan;
+						channel_set_timeout( self, timeout );
 					}
 					/* yield. channel will be unlocked by the scheduler */
 					return lua_yield( L, lua_gettop( L ));
@@ -3292,11 +6183,11 @@ static int luaproc_receive( lua_State *L ) {
 		//ensures the receiver's stack to store only the channel's name 
 		lua_settop(L, 1);
 	
-		//checks whether the container Lua state stores messages in transit
-		if(lua_gettop(chan->lstate) > 0){
+		//checks whether the channel stores messages in transit
+		if(chan->msgs.count > 0){
 			
-			//If so, it receives the message at the beginning of the container Lua state's stack
-			ret = luaproc_async_copyvalues(chan->lstate, L, from_temp);
+			//If so, it receives the oldest message
+			ret = luaproc_async_fetch( chan, L );
 			
 			//releases this channel
 			luaproc_unlock_channel( chan );
@@ -3313,17 +6204,15 @@ static int luaproc_receive( lua_State *L ) {
 			if ( L == mainlp.lstate ) {
 				/*  receiving process is the parent (main) Lua state - block it */
 				mainlp.chan = chan;
+				channel_set_timeout( &mainlp, timeout );
 				luaproc_queue_receiver( &mainlp );
-				pthread_mutex_lock( &mutex_mainls );
-				luaproc_unlock_channel( chan );
-				pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
-				pthread_mutex_unlock( &mutex_mainls );
-				return mainlp.args;
+				return luaproc_main_wait( chan );
 			} else {
 				self = luaproc_getself( L );
 				if ( self != NULL ) {
 					self->status = LUAPROC_STATUS_TMP_RECV;
 					self->chan   = chan;
+					channel_set_timeout( self, timeout );
 				}
 				/* yield. channel will be unlocked by the scheduler */
 				return lua_yield( L, lua_gettop( L ));
@@ -3335,94 +6224,158 @@ static int luaproc_receive( lua_State *L ) {
 /* create a new channel */
 static int luaproc_create_channel( lua_State *L ) {
 
+	static const char *const topologies[] = { "spsc", "mpsc", "mpmc", NULL };
 	const char *chname = luaL_checkstring( L, 1 );
-	int type_ch = 0;
+	const char *topology;
+	int i, type_ch = 0, maxmsgs = 0, lftopology = 0, exists;
+	size_t maxbytes = 0, size;
+	lua_Integer n;
+	lfqueue *lfq = NULL;
+	channel *chan;
 	
 	//gets the type of channel to be created
 	if(lua_gettop(L) > 1 && lua_isboolean(L, 2))
 		type_ch = lua_toboolean(L, 2);
 	
-	channel *chan = channel_locked_get( chname );
-	if (chan != NULL) {  /* does channel exist? */
-		/* unlock the channel mutex locked by channel_locked_get */
-		luaproc_unlock_channel( chan );
+	//gets the capacity and topology of an asynchronous channel, if given
+	if ( !lua_isnoneornil( L, 3 )) {
+		luaL_argcheck( L, type_ch, 3, "only asynchronous channels take options" );
+		luaL_checktype( L, 3, LUA_TTABLE );
+		lua_getfield( L, 3, "messages" );
+		if ( !lua_isnil( L, -1 )) {
+			n = lua_tointeger( L, -1 );
+			if (( !lua_isnumber( L, -1 )) || ( n < 1 ) || ( n > INT_MAX )) {
+				luaL_error( L, "capacity in messages must be a positive number" );
+			}
+			maxmsgs = (int)n;
+		}
+		lua_pop( L, 1 );
+		lua_getfield( L, 3, "bytes" );
+		if ( !lua_isnil( L, -1 )) {
+			n = lua_tointeger( L, -1 );
+			if (( !lua_isnumber( L, -1 )) || ( n < 1 )) {
+				luaL_error( L, "capacity in bytes must be a positive number" );
+			}
+			maxbytes = (size_t)n;
+		}
+		lua_pop( L, 1 );
+		lua_getfield( L, 3, "topology" );
+		if ( !lua_isnil( L, -1 )) {
+			topology = lua_tostring( L, -1 );
+			for ( i = 0; ( topology != NULL ) && ( topologies[ i ] != NULL ); i++ ) {
+				if ( strcmp( topology, topologies[ i ] ) == 0 ) {
+					lftopology = LUAPROC_TOPOLOGY_SPSC + i;
+					break;
+				}
+			}
+			if ( lftopology == 0 ) {
+				luaL_error( L, "topology must be 'spsc', 'mpsc' or 'mpmc'" );
+			}
+		}
+		lua_pop( L, 1 );
+	}
+	
+	//a channel declared with a topology stores its messages in a lock-free queue, with a slot for each message it may hold
+	if ( lftopology != 0 ) {
+		size = LUAPROC_LFQUEUE_SIZE;
+		if ( maxmsgs > 0 ) {
+			//with a single slot, a full slot would look free to the sender of the next round, so there are at least two (the bound in messages still holds)
+			for ( size = 2; size < (size_t)maxmsgs; size *= 2 );
+		}
+		lfq = lfqueue_new( lftopology, size );
+		if ( lfq == NULL ) {
+			lua_pushnil( L );
+			lua_pushliteral( L, "out of memory" );
+			return 2;
+		}
+	}
+	
+	/* the directory checks whether the channel exists while creating it */
+	chan = channel_create( chname, type_ch, maxmsgs, maxbytes, lfq, &exists );
+	if ( chan == NULL ) {
+		if ( lfq != NULL ) {
+			lfqueue_free( lfq );
+		}
 		/* return an error to lua */
 		lua_pushnil( L );
-		lua_pushfstring( L, "channel '%s' already exists", chname );
+		if ( exists ) {
+			lua_pushfstring( L, "channel '%s' already exists", chname );
+		} else {
+			lua_pushliteral( L, "out of memory" );
+		}
+		return 2;
+	}
+	/* return a handle to the new channel */
+	channel_pushhandle( L, chan );
+	channel_release( chan );
+	return 1;
+}
+
+/* return a handle to an existing channel */
+static int luaproc_find_channel( lua_State *L ) {
+
+	const char *chname = luaL_checkstring( L, 1 );
+	channel *chan = channel_lookup( chname );
+
+	if ( chan == NULL ) {
+		lua_pushnil( L );
+		lua_pushfstring( L, "channel '%s' does not exist", chname );
 		return 2;
-	} else {  /* create channel */
-		channel_create(chname, type_ch);
-		lua_pushboolean( L, TRUE );
-		return 1;
 	}
+	channel_pushhandle( L, chan );
+	channel_release( chan );
+	return 1;
 }
 
 /* destroy a channel */
 static int luaproc_destroy_channel( lua_State *L ) {
 
+	unsigned int n;
+	int stored;
 	channel *chan;
 	list *blockedlp;
 	luaproc *lp;
-	const char *chname = luaL_checkstring( L,  1 );
-
-	/* get exclusive access to channels list */
-	pthread_mutex_lock( &mutex_channel_list );
-
-	/*
-	try to get channel and lock it; if lock fails, release external
-	lock ('mutex_channel_list') to try again when signaled -- this avoids
-	keeping the external lock busy for too long. during this release,
-	the channel may have been destroyed, so it must try to get it again.
-	*/
-	while ((( chan = channel_unlocked_get( chname )) != NULL ) &&
-		( pthread_mutex_trylock( &chan->mutex ) != 0 )) {
-			pthread_cond_wait( &chan->can_be_used, &mutex_channel_list );
-	}
+	const char *chname = channel_checkname( L, 1 );
 
+	chan = channel_locked_arg( L, 1 );
 	if ( chan == NULL ) {  /* found channel? */
-		/* release exclusive access to channels list */
-		pthread_mutex_unlock( &mutex_channel_list );
 		/* return an error to lua */
 		lua_pushnil( L );
 		lua_pushfstring( L, "channel '%s' does not exist", chname );
 		return 2;
 	}
 
-	//checks whether an asynchronous channel still stores messages in transit
-	if(chan->type == 1 && lua_gettop(chan->lstate) > 0){
+	//checks whether an asynchronous channel still stores messages in transit. a lock-free one found empty is marked destroyed at once, so no sender can reserve room in it anymore
+	if ( chan->lfq != NULL ) {
+		n = 0;
+		stored = !__atomic_compare_exchange_n( &chan->lfq->count, &n, LUAPROC_LFQUEUE_DESTROYED,
+		                                       FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+	} else {
+		stored = (( chan->type == 1 ) && ( chan->msgs.count > 0 ));
+	}
+	if ( stored ) {
 		
 		//If so, it returns a nil value plus error messages
 		lua_pushnil( L );
 		lua_pushfstring( L, "asynchronous channel '%s' still stores messages", chname );
 		
-		pthread_mutex_unlock( &chan->mutex );
-		pthread_cond_signal( &chan->can_be_used );
-		pthread_mutex_unlock( &mutex_channel_list );
+		luaproc_unlock_channel( chan );
 		
 		return 2;
 	}
 
-	/* remove channel from table */
-	lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-	lua_pushnil( chanls );
-	lua_setfield( chanls, -2, chname );
-	lua_pop( chanls, 1 );
-
-	pthread_mutex_unlock( &mutex_channel_list );
+	/* operations waiting for the channel's lock give up once they get it */
+	chan->destroyed = TRUE;
 
-	/*
-	wake up workers there are waiting to use the channel.
-	they will not find the channel, since it was removed,
-	and will not get this condition anymore.
-	*/
-	pthread_cond_broadcast( &chan->can_be_used );
+	/* remove channel from the directory */
+	channel_unregister( chan );
 
 	/*
 	dequeue lua processes waiting on the channel, return an error message
 	to each of them indicating channel was destroyed and schedule them
 	for execution (unblock them).
 	*/
-	if ( chan->type == 0 && chan->send.head != NULL ) {
+	if ( chan->send.head != NULL ) {
 		lua_pushfstring( L, "channel '%s' destroyed while waiting for receiver", chname );
 		blockedlp = &chan->send;
 	}
@@ -3431,27 +6384,307 @@ static int luaproc_destroy_channel( lua_State *L ) {
 		blockedlp = &chan->recv;
 	}
 	
-	while (( lp = list_remove( blockedlp )) != NULL ) {
+	while (( lp = channel_dequeue( blockedlp )) != NULL ) {
 		/* return an error to each process */
 		lua_pushnil( lp->lstate );
 		lua_pushstring( lp->lstate, lua_tostring( L, -1 ));
 		lp->args = 2;
-		sched_queue_proc( lp ); /* schedule process for execution */
+		if ( lp == &mainlp ) {
+			luaproc_wake_main();
+		} else {
+			sched_queue_proc( lp ); /* schedule process for execution */
+		}
+	}
+	
+	//Lua processes waiting in a barrier operation on this channel get an error too
+	if ( chan->barrier != NULL ) {
+		lua_pushfstring( L, "channel '%s' destroyed while waiting at a barrier", chname );
+		while (( lp = channel_dequeue( &chan->barrier->elems )) != NULL ) {
+			lua_pushnil( lp->lstate );
+			lua_pushstring( lp->lstate, lua_tostring( L, -1 ));
+			lp->args = 2;
+			sched_queue_proc( lp );
+		}
+		if ( chan->barrier->mainlp != NULL ) {
+			channel_stop_timeout( &mainlp );
+			lua_pushnil( mainlp.lstate );
+			lua_pushstring( mainlp.lstate, lua_tostring( L, -1 ));
+			mainlp.args = 2;
+			luaproc_wake_main();
+		}
+		free( chan->barrier );
+		chan->barrier = NULL;
+	}
+	
+	//no Lua process waits on a destroyed lock-free channel
+	if ( chan->lfq != NULL ) {
+		__atomic_store_n( &chan->lfq->recvwait, 0, __ATOMIC_SEQ_CST );
+		__atomic_store_n( &chan->lfq->sendwait, 0, __ATOMIC_SEQ_CST );
 	}
 	
-	//when destroying an asynchronous channel, its contanier Lua state must be closed
-	if(chan->type == 1)
-		lua_close(chan->lstate);
+	//when destroying an asynchronous channel, its message queue must be released
+	if(chan->type == 1){
+		msgqueue_free( &chan->msgs );
+	}
 
-	/* unlock channel mutex and destroy both mutex and condition */
-	pthread_mutex_unlock( &chan->mutex );
-	pthread_mutex_destroy( &chan->mutex );
-	pthread_cond_destroy( &chan->can_be_used );
+	/* unlock the channel and drop the reference of the directory; the
+	   channel is freed once operations still holding it are done */
+	luaproc_unlock_channel( chan );
+	channel_release( chan );
+
+	lua_pushboolean( L, TRUE );
+	return 1;
+}
+
+/* push the table of channels polled by the main state, creating it if needed */
+static void luaproc_push_subscriptions( lua_State *L ) {
+	lua_getfield( L, LUA_REGISTRYINDEX, LUAPROC_SUBSCRIPTIONS_TABLE );
+	if ( lua_type( L, -1 ) != LUA_TTABLE ) {
+		lua_pop( L, 1 );
+		lua_newtable( L );
+		lua_pushvalue( L, -1 );
+		lua_setfield( L, LUA_REGISTRYINDEX, LUAPROC_SUBSCRIPTIONS_TABLE );
+	}
+}
+
+/* forget a subscribed channel name */
+static void channel_unsubscribe_name( const char *chname ) {
+
+	subscription **link, *sub;
+
+	pthread_mutex_lock( &mutex_subscriptions );
+	link = channel_subscription( chname );
+	if (( sub = *link ) != NULL ) {
+		*link = sub->next;
+		free( sub->name );
+		free( sub );
+	}
+	pthread_mutex_unlock( &mutex_subscriptions );
+}
+
+/* make luaproc.poll and luaproc.pollfd (main state only) watch a channel */
+static int luaproc_subscribe( lua_State *L ) {
+
+	channel *chan;
+	subscription **link, *sub;
+	const char *chname = channel_checkname( L, 1 );
+	chanshard *sh = channel_shard( channel_hash( chname ));
+
+	if ( L != mainlp.lstate ) {
+		lua_pushnil( L );
+		lua_pushliteral( L, "only the main state can subscribe to channels" );
+		return 2;
+	}
+
+	/* remember the name first, so a channel created meanwhile is subscribed */
+	pthread_mutex_lock( &sh->mutex );
+	pthread_mutex_lock( &mutex_subscriptions );
+	link = channel_subscription( chname );
+	if ( *link == NULL ) {
+		sub = (subscription *)malloc( sizeof( subscription ));
+		if (( sub != NULL ) && (( sub->name = strdup( chname )) != NULL )) {
+			sub->next = NULL;
+			*link = sub;
+		} else {
+			free( sub );
+			link = NULL;
+		}
+	}
+	pthread_mutex_unlock( &mutex_subscriptions );
+	pthread_mutex_unlock( &sh->mutex );
+	if ( link == NULL ) {
+		lua_pushnil( L );
+		lua_pushliteral( L, "out of memory" );
+		return 2;
+	}
+
+	chan = channel_locked_arg( L, 1 );
+	if ( chan == NULL ) {
+		channel_unsubscribe_name( chname );
+		lua_pushnil( L );
+		lua_pushfstring( L, "channel '%s' does not exist", chname );
+		return 2;
+	}
+	__atomic_store_n( &chan->subscribed, TRUE, __ATOMIC_SEQ_CST );
+	/* messages already waiting must be reported too */
+	if ( channel_has_message( chan )) {
+		luaproc_notify_main( chan );
+	}
+	luaproc_unlock_channel( chan );
+
+	luaproc_push_subscriptions( L );
+	lua_pushboolean( L, TRUE );
+	lua_setfield( L, -2, chname );
+	lua_pop( L, 1 );
+
+	lua_pushboolean( L, TRUE );
+	return 1;
+}
+
+/* stop watching a channel in luaproc.poll and luaproc.pollfd */
+static int luaproc_unsubscribe( lua_State *L ) {
+
+	channel *chan;
+	const char *chname = channel_checkname( L, 1 );
+
+	if ( L != mainlp.lstate ) {
+		lua_pushnil( L );
+		lua_pushliteral( L, "only the main state can subscribe to channels" );
+		return 2;
+	}
+
+	luaproc_push_subscriptions( L );
+	lua_pushnil( L );
+	lua_setfield( L, -2, chname );
+	lua_pop( L, 1 );
+	channel_unsubscribe_name( chname );
+
+	chan = channel_locked_arg( L, 1 );
+	if ( chan != NULL ) {
+		chan->subscribed = FALSE;
+		luaproc_unlock_channel( chan );
+	}
 
 	lua_pushboolean( L, TRUE );
 	return 1;
 }
 
+/* return an eventfd that becomes readable when a message may be waiting for
+   the main state on a subscribed channel */
+static int luaproc_pollfd( lua_State *L ) {
+#if defined(__linux__)
+	int fd;
+
+	if ( L != mainlp.lstate ) {
+		lua_pushnil( L );
+		lua_pushliteral( L, "only the main state can poll channels" );
+		return 2;
+	}
+
+	if ( mainevfd < 0 ) {
+		fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		if ( fd < 0 ) {
+			lua_pushnil( L );
+			lua_pushstring( L, strerror( errno ));
+			return 2;
+		}
+		/* start signaled, so messages sent before are not missed */
+		__atomic_store_n( &mainpending, TRUE, __ATOMIC_SEQ_CST );
+		eventfd_write( fd, 1 );
+		__atomic_store_n( &mainevfd, fd, __ATOMIC_RELEASE );
+	}
+
+	lua_pushinteger( L, mainevfd );
+	return 1;
+#else
+	lua_pushnil( L );
+	lua_pushliteral( L, "luaproc.pollfd is not supported on this platform" );
+	return 2;
+#endif
+}
+
+/*
+   receive, without blocking, a message from the first subscribed channel
+   holding one, leaving the channel name followed by the message on the
+   stack. the stack must be empty. return the number of values left on the
+   stack (0, if no subscribed channel holds a message).
+ */
+static int luaproc_poll_channels( lua_State *L ) {
+
+	int ret;
+	channel *chan;
+	luaproc *srclp;
+
+	luaproc_push_subscriptions( L );
+	lua_pushnil( L );
+	while ( lua_next( L, 1 ) != 0 ) {
+		/* keep the key for lua_next and a copy of the name as the first result */
+		lua_pop( L, 1 );
+		lua_pushvalue( L, 2 );
+
+		chan = channel_lookup( lua_tostring( L, 3 ));
+		if (( chan == NULL ) ||
+		    (( chan->lfq == NULL ) && ( !channel_lock( chan )))) {
+			lua_settop( L, 2 );
+			continue;
+		}
+
+		if ( chan->lfq != NULL ) {
+			/* lock-free channels are polled without their lock */
+			luaproc_lf_attach( L, chan, lua_tostring( L, 3 ), TRUE );
+			ret = luaproc_lf_fetch( chan, L );
+			if (( ret != -1 ) && ( luaproc_lf_waiting( chan ))) {
+				luaproc_lf_wake( chan );
+			}
+			channel_release( chan );
+			if ( ret == -1 ) {
+				lua_settop( L, 2 );
+				continue;
+			}
+		} else if (( chan->type == 0 ) &&
+		    (( srclp = channel_dequeue( &chan->send )) != NULL )) {
+			luaproc_unlock_channel( chan );
+			ret = luaproc_copyvalues( srclp->lstate, L, from_normal );
+			if ( ret == TRUE ) {
+				lua_pushboolean( srclp->lstate, TRUE );
+				srclp->args = 1;
+			} else {
+				srclp->args = 2;
+			}
+			sched_queue_proc( srclp );
+		} else if (( chan->type == 1 ) && ( chan->msgs.count > 0 )) {
+			luaproc_async_fetch( chan, L );
+			luaproc_unlock_channel( chan );
+		} else {
+			luaproc_unlock_channel( chan );
+			lua_settop( L, 2 );
+			continue;
+		}
+
+		/* drop the subscriptions table and the key */
+		lua_remove( L, 1 );
+		lua_remove( L, 1 );
+		return lua_gettop( L );
+	}
+
+	lua_settop( L, 0 );
+	return 0;
+}
+
+/* receive a message waiting on any subscribed channel without blocking;
+   return the channel name followed by the message, or nil if there is none */
+static int luaproc_poll( lua_State *L ) {
+
+	int n;
+
+	if ( L != mainlp.lstate ) {
+		lua_pushnil( L );
+		lua_pushliteral( L, "only the main state can poll channels" );
+		return 2;
+	}
+
+	lua_settop( L, 0 );
+	if (( n = luaproc_poll_channels( L )) > 0 ) {
+		return n;
+	}
+
+	/* no messages left: rearm the eventfd, then look again for messages sent
+	   while it was still signaled */
+	__atomic_store_n( &mainpending, FALSE, __ATOMIC_SEQ_CST );
+#if defined(__linux__)
+	if ( mainevfd >= 0 ) {
+		eventfd_t value;
+		eventfd_read( mainevfd, &value );
+	}
+#endif
+	if (( n = luaproc_poll_channels( L )) > 0 ) {
+		return n;
+	}
+
+	lua_pushnil( L );
+	return 1;
+}
+
 /***********************
  * get'ers and set'ers *
  ***********************/
@@ -3486,6 +6719,59 @@ void luaproc_set_numargs( luaproc *lp, int n ) {
   lp->args = n;
 }
 
+/* return a lua process' time slice */
+int luaproc_get_quantum( luaproc *lp ) {
+  return lp->quantum;
+}
+
+/* return a lua process' priority */
+int luaproc_get_priority( luaproc *lp ) {
+  return lp->priority;
+}
+
+/* return the worker pool a lua process is assigned to */
+int luaproc_get_pool( luaproc *lp ) {
+  return lp->pool;
+}
+
+/* return the deadline of a lua process' sleep or timed wait */
+long long luaproc_get_deadline( luaproc *lp ) {
+  return lp->deadline;
+}
+
+/* run the blocking call a lua process offloaded. its results are pushed
+   when the lua process is resumed (lua 5.1 has no continuations, so there
+   they are pushed right away, by the calling thread) */
+void luaproc_run_offloaded( luaproc *lp ) {
+  luaproc_io_run( lp->job );
+#if (LUA_VERSION_NUM >= 502)
+  lp->args = 0;
+#else
+  lp->args = luaproc_io_results( lp->lstate, lp->job );
+  lp->job = NULL;
+#endif
+}
+
+/* return the file descriptor a lua process waits on */
+int luaproc_get_fd( luaproc *lp ) {
+  return lp->fd;
+}
+
+/* return what a lua process waits for on a file descriptor */
+int luaproc_get_fdmode( luaproc *lp ) {
+  return lp->fdmode;
+}
+
+/* return the slot of a lua process' pending timer (-1 if none) */
+int luaproc_get_timer( luaproc *lp ) {
+  return lp->timer;
+}
+
+/* set the slot of a lua process' pending timer (-1 if none) */
+void luaproc_set_timer( luaproc *lp, int slot ) {
+  lp->timer = slot;
+}
+
 
 /**********************************
  * register structs and functions *
@@ -3523,8 +6809,23 @@ static void luaproc_openlualibs( lua_State *L ) {
 
 LUALIB_API int luaopen_luaproc( lua_State *L ) {
 
+	int i;
+	int readyqueue = LUAPROC_SCHED_BACKEND_LIST;
+	const char *backend = getenv( LUAPROC_READY_QUEUE_ENV );
+
+	/* choose the scheduler's ready queue backend */
+	if ( backend != NULL ) {
+		if ( strcmp( backend, "mpmc" ) == 0 ) {
+			readyqueue = LUAPROC_SCHED_BACKEND_MPMC;
+		} else if ( strcmp( backend, "list" ) != 0 ) {
+			luaL_error( L, "invalid ready queue backend '%s'", backend );
+		}
+	}
+
 	/* register luaproc functions */
 	luaL_newlib( L, luaproc_funcs );
+	luaL_newlib( L, luaproc_io_funcs );
+	lua_setfield( L, -2, "io" );
 
 	/* wrap main state inside a lua process */
 	mainlp.lstate = L;
@@ -3532,13 +6833,23 @@ LUALIB_API int luaopen_luaproc( lua_State *L ) {
 	mainlp.args   = 0;
 	mainlp.chan   = NULL;
 	mainlp.next   = NULL;
+	mainlp.prev   = NULL;
+	mainlp.waitlist = NULL;
+	mainlp.quantum = 0;
+	mainlp.priority = LUAPROC_PRIORITY_NORMAL;
+	mainlp.pool = 0;
+	mainlp.timedwait = FALSE;
+	mainlp.timer = -1;
+	mainlp.job = NULL;
 	/* initialize recycle list */
 	list_init( &recycle_list );
 
-	/* initialize channels table and lua_State used to store it */
-	chanls = luaL_newstate();
-	lua_newtable( chanls );
-	lua_setglobal( chanls, LUAPROC_CHANNELS_TABLE );
+	/* initialize channel directory */
+	for ( i = 0; i < LUAPROC_CHANNEL_SHARDS; i++ ) {
+		pthread_mutex_init( &chanshards[ i ].mutex, NULL );
+		chanshards[ i ].table = NULL;
+		chanshards[ i ].count = 0;
+	}
 	/* create finalizer to join workers when Lua exits */
 	lua_newuserdata( L, 0 );
 	lua_setfield( L, LUA_REGISTRYINDEX, "LUAPROC_FINALIZER_UDATA" );
@@ -3553,7 +6864,7 @@ LUALIB_API int luaopen_luaproc( lua_State *L ) {
 	lua_pop( L, 1 );
 
 	/* initialize scheduler */
-	if ( sched_init() == LUAPROC_SCHED_PTHREAD_ERROR ) {
+	if ( sched_init( readyqueue ) == LUAPROC_SCHED_PTHREAD_ERROR ) {
 		luaL_error( L, "failed to create worker" );
 	}
 
@@ -3564,6 +6875,8 @@ static int luaproc_loadlib( lua_State *L ) {
 
   /* register luaproc functions */
   luaL_newlib( L, luaproc_funcs );
+  luaL_newlib( L, luaproc_io_funcs );
+  lua_setfield( L, -2, "io" );
 
   return 1;
 }
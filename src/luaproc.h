@@ -18,6 +18,26 @@
 
 #define LUAPROC_STATUS_TMP_RECV  5
 #define LUAPROC_BLOCKED_BARRIER 6
+#define LUAPROC_STATUS_PREEMPTED 7
+#define LUAPROC_STATUS_SLEEPING  8
+#define LUAPROC_STATUS_WAITING_FD 9
+#define LUAPROC_STATUS_OFFLOADED 10
+#define LUAPROC_STATUS_TMP_SEND  11
+
+/* file descriptor wait modes (may be combined) */
+#define LUAPROC_FD_READ   1
+#define LUAPROC_FD_WRITE  2
+
+/********************************
+ * lua process priority classes *
+ *******************************/
+
+#define LUAPROC_PRIORITY_HIGH    0
+#define LUAPROC_PRIORITY_NORMAL  1
+#define LUAPROC_PRIORITY_LOW     2
+
+/* number of priority classes */
+#define LUAPROC_PRIORITIES       3
 
 /*******************
  * structure types *
@@ -53,6 +73,10 @@ void luaproc_queue_receiver( luaproc *lp );
 /* add a lua process to the recycle list */
 void luaproc_recycle_insert( luaproc *lp );
 
+/* let go of the single sides of lock-free channels a lua process is bound
+   to (done when it ends) */
+void luaproc_unbind_channels( luaproc *lp );
+
 /* return a lua process' status */
 int luaproc_get_status( luaproc *lp );
 
@@ -68,6 +92,47 @@ int luaproc_get_numargs( luaproc *lp );
 /* set the number of arguments expected by a lua process */
 void luaproc_set_numargs( luaproc *lp, int n );
 
+/* return a lua process' time slice, in VM instructions (0 means none) */
+int luaproc_get_quantum( luaproc *lp );
+
+/* return a lua process' priority class (LUAPROC_PRIORITY_*) */
+int luaproc_get_priority( luaproc *lp );
+
+/* return the id of the worker pool a lua process is assigned to */
+int luaproc_get_pool( luaproc *lp );
+
+/* return the deadline of a lua process' sleep or timed wait on a channel or
+   file descriptor (monotonic time, in nanoseconds; -1 if none) */
+long long luaproc_get_deadline( luaproc *lp );
+
+/* return the file descriptor a lua process waits on */
+int luaproc_get_fd( luaproc *lp );
+
+/* return what a lua process waits for on a file descriptor (LUAPROC_FD_*) */
+int luaproc_get_fdmode( luaproc *lp );
+
+/* run the blocking call a lua process offloaded, off the workers; its
+   results are pushed once the lua process is resumed */
+void luaproc_run_offloaded( luaproc *lp );
+
+/* return the slot of a lua process' pending timer in the scheduler's timer
+   heap (-1 if none) */
+int luaproc_get_timer( luaproc *lp );
+
+/* set the slot of a lua process' pending timer in the scheduler's timer heap
+   (-1 if none) */
+void luaproc_set_timer( luaproc *lp, int slot );
+
+/* end a lua process' wait on a channel whose timeout expired. returns -1 if
+   the channel is in use, in which case a reference to it is stored in 'busy'
+   (try again after luaproc_wait_channel), TRUE if the lua process must be
+   queued for execution or FALSE otherwise */
+int luaproc_expire_wait( luaproc *lp, channel **busy );
+
+/* block until a channel found in use by luaproc_expire_wait is released, and
+   drop the reference to it */
+void luaproc_wait_channel( channel *chan );
+
 /* initialize an empty list */
 void list_init( list *l );
 
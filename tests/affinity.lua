@@ -0,0 +1,51 @@
+-- workers pinned to cpus keep running lua processes, including workers
+-- created afterwards
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- affinity is only supported on linux
+if not pcall( luaproc.setaffinity, "none" ) then
+  print( "affinity skipped" )
+  return
+end
+
+-- cpus must exist and modes must be known
+assert( not pcall( luaproc.setaffinity, { 100000 } ))
+assert( not pcall( luaproc.setaffinity, { -1 } ))
+assert( not pcall( luaproc.setaffinity, "some" ))
+assert( not pcall( luaproc.setaffinity, "auto", "missing" ))
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+local function run( n )
+  for i = 1, n do
+    luaproc.newproc( [[
+      luaproc.send( "results", true )
+    ]] )
+  end
+  for i = 1, n do
+    assert( luaproc.receive( "results" ))
+  end
+end
+
+luaproc.setaffinity( { 0 } )
+luaproc.setnumworkers( 2 )
+run( 100 )
+
+luaproc.setaffinity( "auto" )
+luaproc.setnumworkers( 4 )
+run( 100 )
+
+luaproc.newpool( "pinned", 1 )
+luaproc.setaffinity( "auto", "pinned" )
+luaproc.newproc( [[
+  luaproc.send( "results", "pinned" )
+]], { pool = "pinned" } )
+assert( luaproc.receive( "results" ) == "pinned" )
+
+luaproc.setaffinity( "none" )
+run( 100 )
+
+print( "affinity ok" )
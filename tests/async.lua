@@ -0,0 +1,89 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+-- messages of an asynchronous channel come out in the order they went in,
+-- while its ring buffer wraps around and grows
+luaproc.newchannel( "ring", true )
+local sent, received = 0, 0
+for round = 1, 50 do
+  for i = 1, round do
+    sent = sent + 1
+    assert( luaproc.send( "ring", sent, "msg" .. sent ))
+  end
+  for i = 1, math.floor( round / 2 ) do
+    received = received + 1
+    local n, s = luaproc.receive( "ring" )
+    assert(( n == received ) and ( s == "msg" .. received ))
+  end
+end
+while received < sent do
+  received = received + 1
+  assert( luaproc.receive( "ring" ) == received )
+end
+
+-- a producer and a consumer drain bursts of messages
+luaproc.newchannel( "burst", true )
+luaproc.newchannel( "done" )
+luaproc.newproc( [[
+  for i = 1, 20000 do
+    luaproc.send( "burst", i, { i, tostring( i ) } )
+  end
+  luaproc.send( "burst", "end" )
+]] )
+luaproc.newproc( [[
+  local sum = 0
+  while true do
+    local i, t = luaproc.receive( "burst" )
+    if i == "end" then break end
+    assert(( t[ 1 ] == i ) and ( t[ 2 ] == tostring( i )))
+    sum = sum + i
+  end
+  luaproc.send( "done", sum )
+]] )
+assert( luaproc.receive( "done" ) == 20000 * 20001 / 2 )
+
+-- a byte-bounded channel is full once it stores a message as large as its
+-- bound, even when many senders encode their messages at the same time
+for _, opts in ipairs({ { bytes = 1000 }, { bytes = 1000, topology = "mpmc" } }) do
+  luaproc.newchannel( "bytes", true, opts )
+  for i = 1, 8 do
+    luaproc.newproc( [[
+      local string = require "string"
+      local big = string.rep( "x", 5000 )
+      luaproc.send( "done", luaproc.trysend( "bytes", big ) ~= nil )
+    ]] )
+  end
+  local stored = 0
+  for i = 1, 8 do
+    if luaproc.receive( "done" ) then
+      stored = stored + 1
+    end
+  end
+  assert( stored == 1 )
+  assert( #luaproc.receive( "bytes" ) == 5000 )
+  luaproc.delchannel( "bytes" )
+end
+
+-- a message that fails to be received stays whole in the channel: the file
+-- it carries is not closed when the receiver collects what it got so far
+luaproc.newchannel( "files", true )
+local f = io.tmpfile()
+f:write( "still open" )
+assert( luaproc.send( "files", f, string.format ))
+luaproc.newproc( [[
+  require "io"
+  local ok, err = luaproc.receive( "files" )
+  collectgarbage()
+  luaproc.send( "done", ok, err )
+]] )
+local ok, err = luaproc.receive( "done" )
+assert( ok == nil and err )
+local g, fmt = luaproc.receive( "files" )
+assert( fmt == string.format )
+g:seek( "set" )
+assert( g:read( "*a" ) == "still open" )
+
+print( "async ok" )
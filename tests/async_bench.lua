@@ -0,0 +1,49 @@
+-- measures the cost of queueing messages on an async channel: the time
+-- taken to send and receive them and the memory they take while queued
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- number of messages queued
+local n = tonumber( arg and arg[ 1 ] ) or 200000
+
+-- resident memory of this process, in kilobytes (nil if unknown)
+local function rss()
+  local f = io.open( "/proc/self/status" )
+  if f == nil then
+    return nil
+  end
+  for l in f:lines() do
+    local kb = l:match( "VmRSS:%s+(%d+)" )
+    if kb then
+      f:close()
+      return tonumber( kb )
+    end
+  end
+  f:close()
+  return nil
+end
+
+luaproc.newchannel( "bench", true )
+
+collectgarbage()
+local mem0 = rss()
+local t0 = os.clock()
+for i = 1, n do
+  assert( luaproc.send( "bench", i, "payload string", { x = i, y = 2.5 } ))
+end
+local t1 = os.clock()
+local mem1 = rss()
+for i = 1, n do
+  local v, s, t = luaproc.receive( "bench" )
+  assert( v == i and t.x == i )
+end
+local t2 = os.clock()
+
+print( string.format( "%d messages: send %.3fs, receive %.3fs", n, t1 - t0, t2 - t1 ))
+if mem0 and mem1 then
+  print( string.format( "queued memory: %.0f bytes per message",
+                        ( mem1 - mem0 ) * 1024 / n ))
+end
+
+print( "async_bench ok" )
@@ -0,0 +1,74 @@
+-- an autoscaled pool adds workers while lua processes pile up in its ready
+-- queue and retires them once they stay idle
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- keep the main state busy for a few seconds, or until cond holds
+local function waitfor( secs, cond )
+  local start = os.time()
+  while ( os.time() - start < secs ) and not ( cond and cond() ) do end
+end
+
+-- settings must make sense
+assert( not pcall( luaproc.autoscale, { min = 0 } ))
+assert( not pcall( luaproc.autoscale, { min = 3, max = 2 } ))
+assert( not pcall( luaproc.autoscale, { cooldown = -1 } ))
+assert( not pcall( luaproc.autoscale, {}, "missing" ))
+
+luaproc.autoscale( { min = 1, max = 4, threshold = 1, cooldown = 50 } )
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+-- a backlog of lua processes that take a while to run
+local n = 200
+for i = 1, n do
+  luaproc.newproc( [[
+    for i = 1, 200000 do end
+    luaproc.send( "results", true )
+  ]] )
+end
+local peak = luaproc.getnumworkers()
+for i = 1, n do
+  assert( luaproc.receive( "results" ))
+  peak = math.max( peak, luaproc.getnumworkers() )
+end
+local stats = luaproc.getschedstats()
+assert( stats.scaleups > 0 )
+assert( peak > 1 and peak <= 4 )
+
+-- idle workers are retired, down to the minimum
+waitfor( 6, function() return luaproc.getnumworkers() == 1 end )
+assert( luaproc.getnumworkers() == 1 )
+assert( luaproc.getschedstats().scaledowns > 0 )
+
+-- with autoscaling off, the number of workers stays as set
+luaproc.autoscale( false )
+luaproc.setnumworkers( 3 )
+waitfor( 1 )
+assert( luaproc.getnumworkers() == 3 )
+
+-- workers that leave do not leave their threads behind: adding and dropping
+-- workers over and over does not grow the address space by a thread stack
+-- each time
+local function vmsize()
+  local f = io.open( "/proc/self/status" )
+  if not f then
+    return nil
+  end
+  local kb = f:read( "*a" ):match( "VmSize:%s*(%d+)" )
+  f:close()
+  return tonumber( kb )
+end
+local before = vmsize()
+for i = 1, 100 do
+  luaproc.setnumworkers( 4 )
+  luaproc.setnumworkers( 1 )
+  waitfor( 2, function() return luaproc.getnumworkers() == 1 end )
+end
+if before then
+  assert( vmsize() - before < 64 * 1024 )
+end
+
+print( "autoscale ok" )
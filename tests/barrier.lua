@@ -0,0 +1,32 @@
+-- lua processes made ready together, when a barrier is released, all run,
+-- round after round
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+luaproc.newchannel( "gate" )
+
+local n, rounds = 64, 20
+for i = 1, n do
+  luaproc.newproc( string.format( [[
+    for r = 1, %d do
+      assert( luaproc.barrier( "gate", %d ))
+      for i = 1, 10000 do end
+      luaproc.send( "results", r )
+    end
+  ]], rounds, n + 1 ))
+end
+
+for r = 1, rounds do
+  assert( luaproc.barrier( "gate", n + 1 ))
+  for i = 1, n do
+    assert( luaproc.receive( "results" ) == r )
+  end
+end
+
+print( "barrier ok" )
@@ -0,0 +1,33 @@
+-- workers take lua processes queued by the main state in batches; every lua
+-- process runs exactly once, even when the worker holding its batch is
+-- destroyed
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+local n = 3000
+for i = 1, n do
+  luaproc.newproc( string.format( [[
+    for i = 1, 1000 do end
+    luaproc.send( "results", %d )
+  ]], i ))
+  if i == n / 2 then
+    luaproc.setnumworkers( 1 )
+  end
+end
+luaproc.setnumworkers( 3 )
+
+local ran = {}
+for i = 1, n do
+  local k = luaproc.receive( "results" )
+  assert( not ran[ k ] )
+  ran[ k ] = true
+end
+
+print( "batch ok" )
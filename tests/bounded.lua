@@ -0,0 +1,73 @@
+-- bounded asynchronous channels make senders wait for room, or fail when
+-- they cannot wait
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+-- only asynchronous channels take bounds, and bounds must be positive
+assert( not pcall( luaproc.newchannel, "bad", false, { messages = 4 } ))
+assert( not pcall( luaproc.newchannel, "bad", true, { messages = 0 } ))
+assert( not pcall( luaproc.newchannel, "bad", true, { bytes = -1 } ))
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+-- trysend fails on a full channel, while send and timedsend wait for room
+luaproc.newchannel( "bounded", true, { messages = 4 } )
+for i = 1, 4 do
+  assert( luaproc.trysend( "bounded", i ))
+end
+local ok, err = luaproc.trysend( "bounded", 5 )
+assert(( ok == nil ) and ( err == "channel 'bounded' is full" ))
+ok, err = luaproc.timedsend( "bounded", 20, 5 )
+assert(( ok == nil ) and ( err == "timeout" ))
+for i = 1, 4 do
+  assert( luaproc.receive( "bounded" ) == i )
+end
+
+-- a lua process sending faster than another receives is held back, and its
+-- messages keep their order
+luaproc.newproc( [[
+  for i = 1, 2000 do
+    assert( luaproc.send( "bounded", i ))
+  end
+  luaproc.send( "results", "sent" )
+]] )
+luaproc.newproc( [[
+  for i = 1, 2000 do
+    assert( luaproc.receive( "bounded" ) == i )
+  end
+  luaproc.send( "results", "received" )
+]] )
+local done = {}
+done[ luaproc.receive( "results" ) ] = true
+done[ luaproc.receive( "results" ) ] = true
+assert( done.sent and done.received )
+
+-- the main state waiting for room is woken up by a lua process receiving
+luaproc.newchannel( "go" )
+for i = 1, 4 do
+  assert( luaproc.send( "bounded", i ))
+end
+luaproc.newproc( [[
+  luaproc.receive( "go" )
+  for i = 1, 5 do
+    assert( luaproc.receive( "bounded" ) == i )
+  end
+]] )
+luaproc.send( "go", true )
+assert( luaproc.send( "bounded", 5 ))
+
+-- a channel bounded in memory takes one message of any size when empty
+luaproc.newchannel( "bytes", true, { bytes = 1000 } )
+assert( luaproc.trysend( "bytes", string.rep( "x", 5000 )))
+ok, err = luaproc.trysend( "bytes", "y" )
+assert(( ok == nil ) and ( err == "channel 'bytes' is full" ))
+assert( #luaproc.receive( "bytes" ) == 5000 )
+assert( luaproc.trysend( "bytes", "y" ))
+assert( luaproc.receive( "bytes" ) == "y" )
+
+print( "bounded ok" )
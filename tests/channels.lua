@@ -0,0 +1,52 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results" )
+
+-- creating an existing channel fails
+assert( luaproc.newchannel( "dup" ))
+local ok, err = luaproc.newchannel( "dup" )
+assert(( ok == nil ) and ( err == "channel 'dup' already exists" ))
+assert( luaproc.delchannel( "dup" ))
+assert( luaproc.delchannel( "dup" ) == nil )
+
+-- lua processes create, use and destroy many channels concurrently, so the
+-- directory grows while it is being looked up
+for p = 1, 8 do
+  luaproc.newproc( string.format( [[
+    local p = %d
+    for i = 1, 500 do
+      local name = "ch-" .. p .. "-" .. i
+      assert( luaproc.newchannel( name, true ))
+      assert( luaproc.send( name, i ))
+    end
+    for i = 1, 500 do
+      local name = "ch-" .. p .. "-" .. i
+      assert( luaproc.receive( name ) == i )
+      if i %% 2 == 0 then
+        assert( luaproc.delchannel( name ))
+      end
+    end
+    luaproc.send( "results", p )
+  ]], p ))
+end
+for p = 1, 8 do
+  luaproc.receive( "results" )
+end
+
+-- channels left behind can still be found by name, the others cannot
+for p = 1, 8 do
+  for i = 1, 500 do
+    local name = "ch-" .. p .. "-" .. i
+    assert(( luaproc.send( name, i ) ~= nil ) == ( i % 2 == 1 ))
+    if i % 2 == 1 then
+      assert( luaproc.receive( name ) == i )
+    end
+  end
+end
+
+print( "channels ok" )
@@ -0,0 +1,52 @@
+-- lua processes create, use and destroy channels of their own while others
+-- keep exchanging messages, so channel operations do not get in each other's
+-- way
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+local n, rounds = 8, 500
+
+for p = 1, n do
+  luaproc.newproc( string.format( [[
+    for i = 1, %d do
+      local name = "churn%d_" .. i
+      assert( luaproc.newchannel( name, true ))
+      assert( luaproc.send( name, i ))
+      assert( luaproc.receive( name ) == i )
+      assert( luaproc.delchannel( name ))
+    end
+    luaproc.send( "results", "churn" )
+  ]], rounds, p ))
+end
+
+luaproc.newchannel( "ping" )
+luaproc.newproc( string.format( [[
+  for i = 1, %d do
+    luaproc.send( "ping", i )
+  end
+]], n * rounds ))
+luaproc.newproc( string.format( [[
+  for i = 1, %d do
+    assert( luaproc.receive( "ping" ) == i )
+  end
+  luaproc.send( "results", "ping" )
+]], n * rounds ))
+
+local got = { churn = 0, ping = 0 }
+for i = 1, n + 1 do
+  local kind = luaproc.receive( "results" )
+  got[ kind ] = got[ kind ] + 1
+end
+assert( got.churn == n and got.ping == 1 )
+
+-- destroyed channels are gone
+assert( luaproc.send( "churn1_1", 1 ) == nil )
+
+print( "churn ok" )
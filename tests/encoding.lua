@@ -0,0 +1,70 @@
+-- values stored in asynchronous channels come out as they went in
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+luaproc.newchannel( "values", true )
+
+-- nil, booleans, numbers, strings and nested tables, with non-string keys
+assert( luaproc.send( "values", 1, 2.5, "x", true, false, nil,
+                      { 1, 2, { k = "v" }, [ 3.5 ] = true, [ true ] = "t" } ))
+local a, b, c, d, e, f, t = luaproc.receive( "values" )
+assert(( a == 1 ) and ( b == 2.5 ) and ( c == "x" ))
+assert(( d == true ) and ( e == false ) and ( f == nil ))
+assert(( t[ 1 ] == 1 ) and ( t[ 2 ] == 2 ) and ( t[ 3 ].k == "v" ))
+assert(( t[ 3.5 ] == true ) and ( t[ true ] == "t" ))
+if math.type then
+  assert(( math.type( a ) == "integer" ) and ( math.type( b ) == "float" ))
+end
+
+-- lua functions keep their upvalues, recursion and identity
+local up = 10
+local function fact( n )
+  if n <= 1 then return 1 end
+  return n * fact( n - 1 )
+end
+local function addup( x )
+  return x + up
+end
+assert( luaproc.send( "values", fact, addup, addup, { f = fact } ))
+local f1, f2, f3, ft = luaproc.receive( "values" )
+assert( f1( 5 ) == 120 )
+assert( f2( 1 ) == 11 )
+assert( f2 == f3 )
+assert( ft.f == f1 )
+
+-- c functions, userdata and functions using library tables are kept too
+local str = string
+local function twice( s )
+  return str.rep( s, 2 )
+end
+assert( luaproc.send( "values", string.format, io.stdout, twice ))
+local fmt, out, tw = luaproc.receive( "values" )
+assert(( fmt == string.format ) and ( io.type( out ) == "file" ))
+assert( tw( "ab" ) == "abab" )
+
+-- values a lua process sends come out in another lua process
+luaproc.newchannel( "results", true )
+luaproc.newproc( [[
+  local t, fn = luaproc.receive( "values" )
+  luaproc.send( "results", t.n + fn( t.n ))
+]] )
+assert( luaproc.send( "values", { n = 20 }, function( x ) return x + 1 end ))
+assert( luaproc.receive( "results" ) == 41 )
+
+-- coroutines cannot be sent, nor tables nested too deeply
+local ok, err = luaproc.send( "values", coroutine.create( function() end ))
+assert(( ok == nil ) and err )
+local deep = {}
+local cur = deep
+for i = 1, 300 do
+  cur.n = {}
+  cur = cur.n
+end
+ok, err = luaproc.send( "values", deep )
+assert(( ok == nil ) and err )
+
+print( "encoding ok" )
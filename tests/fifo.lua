@@ -0,0 +1,29 @@
+-- with the mpmc ready queue (the LUAPROC_READY_QUEUE environment variable set
+-- to mpmc), a single worker runs ready lua processes in the order they became
+-- ready. the list ready queue (the default) lets a worker take a lua process
+-- from the shared queue every now and then, ahead of its own, so there every
+-- lua process is only checked to run. 'make test' runs this with both
+
+-- load luaproc
+luaproc = require "luaproc"
+
+local fifo = ( os.getenv( "LUAPROC_READY_QUEUE" ) == "mpmc" )
+
+-- channel where lua processes tell in which order they ran
+luaproc.newchannel( "order", true )
+
+local n = 2000
+for i = 1, n do
+  luaproc.newproc( string.format( [[
+    luaproc.send( "order", %d )
+  ]], i ))
+end
+local ran = {}
+for i = 1, n do
+  local k = luaproc.receive( "order" )
+  assert(( not fifo ) or ( k == i ))
+  assert( not ran[ k ] )
+  ran[ k ] = true
+end
+
+print( "fifo ok" )
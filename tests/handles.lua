@@ -0,0 +1,53 @@
+-- channel handles stand for channels in every operation, travel in messages
+-- and to new lua processes, and outlive the channels they refer to
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+-- creating a channel and looking it up give handles to the same channel
+local results = luaproc.newchannel( "results", true )
+assert( luaproc.getchannel( "results" ) == results )
+local ok, err = luaproc.getchannel( "missing" )
+assert(( ok == nil ) and err )
+
+-- handles work wherever names do
+assert( luaproc.send( results, 1 ))
+assert( luaproc.receive( "results" ) == 1 )
+assert( luaproc.send( "results", 2 ))
+assert( luaproc.receive( results ) == 2 )
+
+-- a handle sent in a message, or captured by the function of a new lua
+-- process, refers to the same channel
+local reply = luaproc.newchannel( "reply" )
+luaproc.newproc( [[
+  local ch, x = luaproc.receive( "results" )
+  luaproc.send( ch, x * 2 )
+]] )
+assert( luaproc.send( results, reply, 21 ))
+assert( luaproc.receive( reply ) == 42 )
+luaproc.newproc( function()
+  luaproc.send( reply, "captured" )
+end )
+assert( luaproc.receive( reply ) == "captured" )
+
+-- operations on a handle to a destroyed channel fail, even once a channel of
+-- the same name is created again
+local old = luaproc.newchannel( "gone", true )
+assert( luaproc.delchannel( old ))
+ok, err = luaproc.send( old, 1 )
+assert(( ok == nil ) and ( err == "channel 'gone' does not exist" ))
+local new = luaproc.newchannel( "gone", true )
+assert( new ~= old )
+ok, err = luaproc.send( old, 1 )
+assert( ok == nil )
+assert( luaproc.send( new, 1 ))
+assert( luaproc.receive( "gone" ) == 1 )
+
+-- anything else is not a channel
+assert( not pcall( luaproc.send, 1, 1 ))
+assert( not pcall( luaproc.receive, {} ))
+
+print( "handles ok" )
@@ -0,0 +1,35 @@
+-- two lua processes handing a worker back and forth through rendezvous do not
+-- keep other ready lua processes from running
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+luaproc.newchannel( "ping" )
+luaproc.newchannel( "pong" )
+
+-- a single worker runs a ping-pong pair, which keeps waking each other up
+luaproc.newproc( [[
+  for i = 1, 100000 do
+    luaproc.send( "ping", i )
+    assert( luaproc.receive( "pong" ) == i )
+  end
+  luaproc.send( "results", "pair" )
+]] )
+luaproc.newproc( [[
+  for i = 1, 100000 do
+    luaproc.send( "pong", luaproc.receive( "ping" ))
+  end
+]] )
+
+-- a lua process made ready afterwards still runs before the pair is done
+luaproc.newproc( [[
+  luaproc.send( "results", "other" )
+]] )
+
+assert( luaproc.receive( "results" ) == "other" )
+assert( luaproc.receive( "results" ) == "pair" )
+
+print( "handoff ok" )
@@ -0,0 +1,43 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+-- channel used to collect results
+luaproc.newchannel( "results" )
+
+local path = os.tmpname()
+
+-- lua processes write and read the file off the workers
+luaproc.newproc( string.format( [[
+  local path = %q
+  local n, err = luaproc.io.write( path, "hello world", 0 )
+  luaproc.send( "results", n, err )
+  luaproc.send( "results", luaproc.io.read( path ))
+  luaproc.send( "results", luaproc.io.read( path, 6, 3 ))
+  luaproc.send( "results", luaproc.io.read( path .. ".missing" ))
+]], path ))
+
+assert( luaproc.receive( "results" ) == 11 )
+assert( luaproc.receive( "results" ) == "hello world" )
+assert( luaproc.receive( "results" ) == "wor" )
+local data, err = luaproc.receive( "results" )
+assert(( data == nil ) and ( type( err ) == "string" ))
+
+-- the main lua state runs file operations right away
+assert( luaproc.io.read( path, 0, 5 ) == "hello" )
+
+-- many lua processes offload at once
+for i = 1, 20 do
+  luaproc.newproc( string.format( [[
+    luaproc.send( "results", luaproc.io.read( %q, 0, 5 ))
+  ]], path ))
+end
+for i = 1, 20 do
+  assert( luaproc.receive( "results" ) == "hello" )
+end
+
+os.remove( path )
+
+print( "io ok" )
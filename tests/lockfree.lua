@@ -0,0 +1,125 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "done" )
+
+-- only asynchronous channels take a topology, and only a known one
+assert( not pcall( luaproc.newchannel, "bad", false, { topology = "spsc" } ))
+assert( not pcall( luaproc.newchannel, "bad", true, { topology = "xx" } ))
+
+-- many producers keep the order of their own messages through a single
+-- consumer
+local n = 10000
+luaproc.newchannel( "mpsc", true, { topology = "mpsc", messages = 16 } )
+for p = 1, 4 do
+  luaproc.newproc( string.format( [[
+    for i = 1, %d do
+      assert( luaproc.send( "mpsc", %d, i ))
+    end
+  ]], n, p ))
+end
+local last = { 0, 0, 0, 0 }
+for i = 1, 4 * n do
+  local p, v = luaproc.receive( "mpsc" )
+  assert( v == last[ p ] + 1 )
+  last[ p ] = v
+end
+
+-- many producers and consumers get every message through
+luaproc.newchannel( "mpmc", true, { topology = "mpmc", messages = 64 } )
+for c = 1, 4 do
+  luaproc.newproc( string.format( [[
+    local sum = 0
+    for i = 1, %d do
+      sum = sum + luaproc.receive( "mpmc" )
+    end
+    luaproc.send( "done", sum )
+  ]], n ))
+end
+for p = 1, 4 do
+  luaproc.newproc( string.format( [[
+    for i = 1, %d do
+      assert( luaproc.send( "mpmc", i ))
+    end
+  ]], n ))
+end
+local total = 0
+for c = 1, 4 do
+  total = total + luaproc.receive( "done" )
+end
+assert( total == 4 * n * ( n + 1 ) / 2 )
+
+-- a channel holding a single message goes back and forth between a blocked
+-- sender and a consumer
+luaproc.newchannel( "one", true, { topology = "spsc", messages = 1 } )
+local ok, err = luaproc.trysend( "one", 1 )
+assert( ok )
+ok, err = luaproc.trysend( "one", 2 )
+assert(( ok == nil ) and ( err == "channel 'one' is full" ))
+luaproc.newproc( [[
+  for i = 1, 1000 do
+    assert( luaproc.receive( "one" ) == i )
+  end
+  luaproc.send( "done", "one" )
+]] )
+for i = 2, 1000 do
+  assert( luaproc.send( "one", i ))
+end
+assert( luaproc.receive( "done" ) == "one" )
+
+-- the single sender and receiver a topology declares are enforced while
+-- they run
+luaproc.newchannel( "go" )
+luaproc.newchannel( "spsc", true, { topology = "spsc" } )
+assert( luaproc.send( "spsc", 1 ))
+luaproc.newproc( [[
+  luaproc.send( "done", pcall( luaproc.send, "spsc", 2 ))
+]] )
+ok, err = luaproc.receive( "done" )
+assert(( not ok ) and err:find( "single sender" ))
+luaproc.newproc( [[
+  luaproc.send( "done", luaproc.receive( "spsc" ))
+  luaproc.receive( "go" )
+  luaproc.send( "done", luaproc.receive( "spsc" ))
+]] )
+assert( luaproc.receive( "done" ) == 1 )
+ok, err = pcall( luaproc.receive, "spsc" )
+assert(( not ok ) and err:find( "single receiver" ))
+assert( luaproc.send( "spsc", 2 ))
+luaproc.send( "go", true )
+assert( luaproc.receive( "done" ) == 2 )
+
+-- once the receiver has ended, another lua process can take over, even one
+-- given its recycled lua state, and then the main state
+luaproc.recycle( 10 )
+luaproc.wait()
+luaproc.newproc( [[
+  luaproc.send( "done", luaproc.receive( "spsc" ))
+]] )
+assert( luaproc.send( "spsc", 3 ))
+assert( luaproc.receive( "done" ) == 3 )
+luaproc.wait()
+assert( luaproc.send( "spsc", 4 ))
+assert( luaproc.receive( "spsc" ) == 4 )
+
+-- a message an mpmc channel fails to hand over is discarded, so the
+-- messages after it keep their order
+luaproc.newchannel( "order", true, { topology = "mpmc" } )
+assert( luaproc.send( "order", io.stdout, string.format ))
+assert( luaproc.send( "order", 1 ))
+assert( luaproc.send( "order", 2 ))
+luaproc.newproc( [[
+  luaproc.send( "done", luaproc.receive( "order" ))
+]] )
+ok, err = luaproc.receive( "done" )
+assert(( ok == nil ) and err )
+assert( luaproc.receive( "order" ) == 1 )
+assert( luaproc.receive( "order" ) == 2 )
+ok, err = luaproc.receive( "order", false, 10 )
+assert(( ok == nil ) and ( err == "timeout" ))
+
+print( "lockfree ok" )
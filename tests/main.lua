@@ -0,0 +1,44 @@
+-- the main state blocks on channels and barriers over and over, and is woken
+-- up by the lua processes it waits for each time
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+luaproc.newchannel( "tomain" )
+luaproc.newchannel( "frommain" )
+luaproc.newchannel( "gate" )
+
+local rounds = 1000
+
+luaproc.newproc( string.format( [[
+  for i = 1, %d do
+    luaproc.send( "tomain", i )
+    assert( luaproc.receive( "frommain" ) == i )
+    assert( luaproc.barrier( "gate", 2 ))
+  end
+]], rounds ))
+
+for i = 1, rounds do
+  assert( luaproc.receive( "tomain", false, 10000 ) == i )
+  assert( luaproc.timedsend( "frommain", 10000, i ))
+  assert( luaproc.barrier( "gate", 2 ))
+end
+
+-- many lua processes wake the main state up while it waits on one channel
+luaproc.newchannel( "many", true )
+for i = 1, 100 do
+  luaproc.newproc( [[
+    luaproc.sleep( 1 )
+    luaproc.send( "many", 1 )
+  ]] )
+end
+local sum = 0
+for i = 1, 100 do
+  sum = sum + luaproc.receive( "many" )
+end
+assert( sum == 100 )
+
+print( "main ok" )
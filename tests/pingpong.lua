@@ -0,0 +1,48 @@
+-- pairs of lua processes exchange messages through synchronous channels
+-- while workers come and go. run it with the LUAPROC_READY_QUEUE environment
+-- variable set to list (the default) and to mpmc to cover both ready queues
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results" )
+
+local npairs, rounds = 16, 2000
+
+for p = 1, npairs do
+  luaproc.newchannel( "ping" .. p )
+  luaproc.newchannel( "pong" .. p )
+  luaproc.newproc( string.format( [[
+    for i = 1, %d do
+      luaproc.send( "ping%d", i )
+      assert( luaproc.receive( "pong%d" ) == i + 1 )
+    end
+    luaproc.send( "results", %d )
+  ]], rounds, p, p, p ))
+  luaproc.newproc( string.format( [[
+    for i = 1, %d do
+      luaproc.send( "pong%d", luaproc.receive( "ping%d" ) + 1 )
+    end
+  ]], rounds, p, p ))
+end
+
+-- workers destroyed meanwhile hand their queued lua processes over to the
+-- remaining ones, and new workers steal from the others
+luaproc.setnumworkers( 1 )
+luaproc.setnumworkers( 8 )
+luaproc.setnumworkers( 2 )
+
+local done = {}
+for p = 1, npairs do
+  done[ luaproc.receive( "results" ) ] = true
+end
+for p = 1, npairs do
+  assert( done[ p ] )
+end
+assert( luaproc.getnumworkers() == 2 )
+
+print( "pingpong ok" )
@@ -0,0 +1,40 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create an asynchronous channel and watch it from the main state
+luaproc.newchannel( "events", true )
+assert( luaproc.subscribe( "events" ))
+local fd = luaproc.pollfd()
+assert( fd )
+
+-- a message sent by a lua process is reported through the eventfd and poll
+luaproc.newproc( [[ luaproc.send( "events", "first" ) ]] )
+assert( luaproc.waitfd( fd, "r", 1000 ))
+local name, msg = luaproc.poll()
+while name == nil do
+  assert( luaproc.waitfd( fd, "r", 1000 ))
+  name, msg = luaproc.poll()
+end
+assert(( name == "events" ) and ( msg == "first" ))
+assert( luaproc.poll() == nil )
+
+-- the subscription outlives the channel: once it is created again, messages
+-- sent to it still signal the eventfd
+luaproc.delchannel( "events" )
+luaproc.newchannel( "events", true )
+luaproc.newproc( [[ luaproc.send( "events", "second" ) ]] )
+assert( luaproc.waitfd( fd, "r", 1000 ) == true )
+name, msg = luaproc.poll()
+while name == nil do
+  assert( luaproc.waitfd( fd, "r", 1000 ))
+  name, msg = luaproc.poll()
+end
+assert(( name == "events" ) and ( msg == "second" ))
+
+-- once unsubscribed, the channel is no longer polled
+assert( luaproc.unsubscribe( "events" ))
+luaproc.send( "events", "third" )
+assert( luaproc.poll() == nil )
+assert( luaproc.receive( "events" ) == "third" )
+
+print( "poll ok" )
@@ -0,0 +1,46 @@
+-- workers only run lua processes of their own pool, so a pool kept busy does
+-- not hold back the lua processes of another
+
+-- load luaproc
+luaproc = require "luaproc"
+
+luaproc.newpool( "batch", 1 )
+assert( luaproc.getnumworkers( "batch" ) == 1 )
+assert( luaproc.getnumworkers() == 1 )
+
+-- pool names are unique and short, and pools must exist to be used
+assert( not pcall( luaproc.newpool, "batch", 1 ))
+assert( not pcall( luaproc.newpool, string.rep( "x", 32 ), 1 ))
+assert( not pcall( luaproc.newpool, "none", 0 ))
+assert( not pcall( luaproc.newproc, "", { pool = "missing" } ))
+assert( not pcall( luaproc.setnumworkers, 2, "missing" ))
+assert( not pcall( luaproc.getnumworkers, "missing" ))
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+luaproc.newchannel( "go" )
+
+-- the only worker of the batch pool spins until told to stop
+luaproc.newproc( [[
+  luaproc.send( "results", "batch" )
+  while not luaproc.receive( "go", true ) do end
+]], { pool = "batch" } )
+assert( luaproc.receive( "results" ) == "batch" )
+
+-- the default pool still runs its lua processes meanwhile, while those of the
+-- batch pool wait for its worker
+luaproc.newproc( [[
+  luaproc.send( "results", "queued" )
+]], { pool = "batch" } )
+luaproc.newproc( [[
+  luaproc.send( "results", "default" )
+]] )
+assert( luaproc.receive( "results" ) == "default" )
+
+-- a new worker of the batch pool runs its queued lua process
+luaproc.setnumworkers( 2, "batch" )
+assert( luaproc.getnumworkers( "batch" ) == 2 )
+assert( luaproc.receive( "results" ) == "queued" )
+luaproc.send( "go", true )
+
+print( "pools ok" )
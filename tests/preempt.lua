@@ -0,0 +1,50 @@
+-- a lua process that never yields is preempted at the end of its time slice,
+-- so it cannot keep others from running
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- preemption requires Lua 5.3 or later
+if _VERSION == "Lua 5.1" or _VERSION == "Lua 5.2" then
+  assert( not pcall( luaproc.setquantum, 1000 ))
+  print( "preempt skipped" )
+  return
+end
+
+-- time slices must be non negative
+assert( not pcall( luaproc.setquantum, -1 ))
+assert( not pcall( luaproc.newproc, "", { quantum = -1 } ))
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+luaproc.newchannel( "stop" )
+
+-- a single worker runs a lua process spinning until told to stop
+luaproc.newproc( [[
+  while not luaproc.receive( "stop", true ) do
+    for i = 1, 1000 do end
+  end
+  luaproc.send( "results", "stopped" )
+]], { quantum = 1000 } )
+
+-- lua processes created afterwards still run, with the default time slice or
+-- their own
+luaproc.setquantum( 1000 )
+luaproc.newproc( [[
+  luaproc.send( "results", "default" )
+]] )
+luaproc.setquantum( 0 )
+luaproc.newproc( [[
+  luaproc.send( "results", "own" )
+]], { quantum = 500 } )
+
+local ran = {}
+ran[ luaproc.receive( "results" ) ] = true
+ran[ luaproc.receive( "results" ) ] = true
+assert( ran.default and ran.own )
+assert( luaproc.getschedstats().preemptions > 0 )
+
+luaproc.send( "stop", true )
+assert( luaproc.receive( "results" ) == "stopped" )
+
+print( "preempt ok" )
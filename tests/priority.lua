@@ -0,0 +1,58 @@
+-- ready lua processes of a higher priority class run first, without starving
+-- the lower classes
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- priority classes must be known
+assert( not pcall( luaproc.newproc, "", { priority = "urgent" } ))
+
+-- channel where lua processes tell in which order they ran
+luaproc.newchannel( "order", true )
+luaproc.newchannel( "go" )
+
+-- keeps the only worker busy until lua processes of every class are ready
+local function hold()
+  luaproc.newproc( [[
+    luaproc.send( "order", "held" )
+    while not luaproc.receive( "go", true ) do end
+  ]] )
+  assert( luaproc.receive( "order" ) == "held" )
+end
+
+local function spawn( n, class )
+  for i = 1, n do
+    luaproc.newproc( string.format( [[
+      luaproc.send( "order", %q )
+    ]], class ), { priority = class } )
+  end
+end
+
+-- high before normal before low
+hold()
+spawn( 3, "low" )
+spawn( 3, "normal" )
+spawn( 3, "high" )
+luaproc.send( "go", true )
+local expected = { "high", "high", "high", "normal", "normal", "normal",
+                   "low", "low", "low" }
+for i = 1, #expected do
+  assert( luaproc.receive( "order" ) == expected[ i ] )
+end
+
+-- a low priority lua process still runs while high priority ones keep
+-- coming, once passed over a few times
+hold()
+spawn( 1, "low" )
+spawn( 50, "high" )
+luaproc.send( "go", true )
+local before = 0
+while luaproc.receive( "order" ) ~= "low" do
+  before = before + 1
+end
+assert( before < 50 )
+for i = before + 1, 50 do
+  assert( luaproc.receive( "order" ) == "high" )
+end
+
+print( "priority ok" )
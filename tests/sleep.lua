@@ -0,0 +1,44 @@
+-- sleeping lua processes do not hold a worker, and wake up in the order of
+-- their deadlines
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- sleep times must be non negative
+assert( not pcall( luaproc.sleep, -1 ))
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+-- many lua processes sleep at once on a single worker
+local n = 200
+local t0 = os.time()
+for i = 1, n do
+  luaproc.newproc( [[
+    luaproc.sleep( 100 )
+    luaproc.send( "results", "slept" )
+  ]] )
+end
+-- a lua process that does not sleep runs meanwhile
+luaproc.newproc( [[
+  luaproc.send( "results", "awake" )
+]] )
+assert( luaproc.receive( "results" ) == "awake" )
+for i = 1, n do
+  assert( luaproc.receive( "results" ) == "slept" )
+end
+-- one after the other, they would have taken 20 seconds
+assert( os.time() - t0 <= 5 )
+
+-- shorter sleeps end first
+for _, ms in ipairs( { 90, 10, 50 } ) do
+  luaproc.newproc( string.format( [[
+    luaproc.sleep( %d )
+    luaproc.send( "results", %d )
+  ]], ms, ms ))
+end
+assert( luaproc.receive( "results" ) == 10 )
+assert( luaproc.receive( "results" ) == 50 )
+assert( luaproc.receive( "results" ) == 90 )
+
+print( "sleep ok" )
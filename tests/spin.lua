@@ -0,0 +1,44 @@
+-- idle workers poll for new work for a while before going to sleep, and go to
+-- sleep right away once spinning is disabled
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- spin rounds must be non negative
+assert( not pcall( luaproc.setspin, -1 ))
+
+-- a single worker, which keeps spinning while the main state queues the next
+-- lua process
+luaproc.setnumworkers( 1 )
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+-- lua processes that keep workers going idle and finding work again
+local function run()
+  for i = 1, 200 do
+    luaproc.newproc( [[
+      luaproc.send( "results", true )
+    ]] )
+    assert( luaproc.receive( "results" ))
+  end
+end
+
+-- a large budget spins long enough for the main state to run even on a
+-- single cpu
+luaproc.setspin( 100000 )
+run()
+local stats = luaproc.getschedstats()
+assert( stats.spinwakes > 0 )
+
+-- without spinning, idle workers go to sleep right away. a worker still
+-- spinning stops, once it gets to run
+luaproc.setspin( 0 )
+local start = os.clock()
+while os.clock() - start < 0.05 do end
+stats = luaproc.getschedstats()
+run()
+assert( luaproc.getschedstats().spinwakes == stats.spinwakes )
+assert( luaproc.getschedstats().parks > stats.parks )
+
+print( "spin ok" )
@@ -0,0 +1,83 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- channel used to collect results
+luaproc.newchannel( "results" )
+-- channels nobody sends to, receives from or waits on
+luaproc.newchannel( "norecv" )
+luaproc.newchannel( "nosend" )
+luaproc.newchannel( "nobarrier" )
+-- channel where some receives are matched before they time out
+luaproc.newchannel( "busy" )
+
+-- a receive and a send that are never matched time out
+luaproc.newproc( [[
+  local ok, err = luaproc.receive( "nosend", false, 10 )
+  luaproc.send( "results", "receive", ok, err )
+]] )
+luaproc.newproc( [[
+  local ok, err = luaproc.timedsend( "norecv", 10, "lost" )
+  luaproc.send( "results", "send", ok, err )
+]] )
+
+-- a barrier that never gets enough lua processes times out
+luaproc.newproc( [[
+  local ok, err = luaproc.barrier( "nobarrier", 2, 10 )
+  luaproc.send( "results", "barrier", ok, err )
+]] )
+
+-- many receives with short timeouts race with a few senders; each receive
+-- either gets a message or times out, and no message is lost
+for i = 1, 50 do
+  luaproc.newproc( [[
+    local v, err = luaproc.receive( "busy", false, 5 )
+    luaproc.send( "results", "race", v, err )
+  ]] )
+end
+for i = 1, 20 do
+  luaproc.newproc( [[
+    luaproc.send( "results", "sent", luaproc.timedsend( "busy", 5, 1 ))
+  ]] )
+end
+
+local got = {}
+for i = 1, 3 + 50 + 20 do
+  local kind, a, b = luaproc.receive( "results" )
+  got[ kind ] = got[ kind ] or { ok = 0, timeout = 0 }
+  if a then
+    got[ kind ].ok = got[ kind ].ok + 1
+  else
+    assert( b == "timeout", kind .. ": " .. tostring( b ))
+    got[ kind ].timeout = got[ kind ].timeout + 1
+  end
+end
+
+assert( got.receive.timeout == 1 )
+assert( got.send.timeout == 1 )
+assert( got.barrier.timeout == 1 )
+assert( got.race.ok + got.race.timeout == 50 )
+assert( got.sent.ok + got.sent.timeout == 20 )
+-- every message sent was received
+assert( got.race.ok == got.sent.ok )
+
+-- a barrier reached by everyone in time returns true to each of them
+luaproc.newchannel( "barrier" )
+luaproc.newproc( [[
+  luaproc.send( "results", luaproc.barrier( "barrier", 2, 1000 ))
+]] )
+luaproc.sleep( 20 )
+assert( luaproc.barrier( "barrier", 2, 1000 ) == true )
+assert( luaproc.receive( "results" ) == true )
+
+-- a huge timeout does not expire right away
+luaproc.newproc( [[
+  luaproc.send( "results", luaproc.receive( "busy", false, 2^53 ))
+]] )
+luaproc.sleep( 20 )
+luaproc.send( "busy", "late" )
+assert( luaproc.receive( "results" ) == "late" )
+
+print( "timeout ok" )
@@ -0,0 +1,38 @@
+-- the main thread helps the workers run lua processes while it waits for
+-- them to finish
+
+-- load luaproc
+luaproc = require "luaproc"
+
+-- channel used to collect results
+luaproc.newchannel( "results", true )
+
+-- a single worker spins until the main thread helps run the lua process
+-- that tells it to stop
+luaproc.newchannel( "stop" )
+luaproc.newproc( [[
+  luaproc.send( "results", "started" )
+  while not luaproc.receive( "stop", true ) do end
+]] )
+assert( luaproc.receive( "results" ) == "started" )
+luaproc.newproc( [[
+  luaproc.send( "stop", true )
+  luaproc.send( "results", "stopped" )
+]] )
+luaproc.wait( true )
+assert( luaproc.receive( "results" ) == "stopped" )
+
+-- waiting without helping returns once every lua process finished too
+local n = 100
+for i = 1, n do
+  luaproc.newproc( [[
+    for i = 1, 10000 do end
+    luaproc.send( "results", true )
+  ]] )
+end
+luaproc.wait()
+for i = 1, n do
+  assert( luaproc.receive( "results" ))
+end
+
+print( "wait ok" )
@@ -0,0 +1,23 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- channel used to collect results
+luaproc.newchannel( "results" )
+
+-- file descriptors must be non negative integers
+assert( not pcall( luaproc.waitfd, 3.5 ))
+assert( not pcall( luaproc.waitfd, -1 ))
+assert( not pcall( luaproc.waitfd, 2^40 ))
+assert( not pcall( luaproc.waitfd, "1" ))
+assert( not pcall( luaproc.waitfd, { getfd = function() return 1.5 end } ))
+
+-- the standard output can be written to right away, from the main state and
+-- from a lua process
+assert( luaproc.waitfd( 1, "w", 1000 ))
+assert( luaproc.waitfd( { getfd = function() return 1 end }, "w", 1000 ))
+luaproc.newproc( [[
+  luaproc.send( "results", luaproc.waitfd( 1, "w", 1000 ))
+]] )
+assert( luaproc.receive( "results" ) == true )
+
+print( "waitfd ok" )